@@ -0,0 +1,93 @@
+#include "beaconscheduler.h"
+
+#include <QRandomGenerator>
+#include <QDebug>
+
+BeaconScheduler::BeaconScheduler(QObject *parent) : QObject(parent)
+{
+    m_beaconTimer.setSingleShot(true);
+    connect(&m_beaconTimer, &QTimer::timeout, this, &BeaconScheduler::onBeaconTimer);
+
+    m_replyTimer.setSingleShot(true);
+    connect(&m_replyTimer, &QTimer::timeout, this, &BeaconScheduler::onReplyTimer);
+
+    m_statisticsTimer.setInterval(60000);
+    connect(&m_statisticsTimer, &QTimer::timeout, this, &BeaconScheduler::logStatistics);
+}
+
+void BeaconScheduler::start()
+{
+    m_interval = minInterval;
+    m_statisticsTimer.start();
+
+    QMetaObject::invokeMethod(this, &BeaconScheduler::onBeaconTimer, Qt::QueuedConnection);
+}
+
+void BeaconScheduler::onNetworkChanged()
+{
+    if (m_interval == minInterval) {
+        return;
+    }
+
+    qDebug() << "Network changed, beaconing faster";
+    m_interval = minInterval;
+
+    if (m_beaconTimer.remainingTime() > minInterval) {
+        scheduleNext();
+    }
+}
+
+void BeaconScheduler::requestReply()
+{
+    // Anything we send anyways in the near future counts as the reply
+    if (m_replyTimer.isActive() ||
+            (m_sinceLastBeacon.isValid() && m_sinceLastBeacon.elapsed() < minInterval / 2) ||
+            (m_beaconTimer.isActive() && m_beaconTimer.remainingTime() < maxReplyDelay)) {
+        m_repliesSuppressed++;
+        return;
+    }
+
+    // Jitter, so all the hosts that heard the same beacon don't answer at the same time
+    m_replyTimer.start(QRandomGenerator::global()->bounded(minReplyDelay, maxReplyDelay));
+}
+
+void BeaconScheduler::onBeaconTimer()
+{
+    m_replyTimer.stop();
+
+    // Announce the interval until the next one
+    m_interval = qMin(m_interval * 2, maxInterval);
+
+    m_beaconsSent++;
+    m_sinceLastBeacon.restart();
+    emit sendBeacon();
+
+    scheduleNext();
+}
+
+void BeaconScheduler::onReplyTimer()
+{
+    m_repliesSent++;
+    m_sinceLastBeacon.restart();
+    emit sendBeacon();
+}
+
+void BeaconScheduler::scheduleNext()
+{
+    // +-5%, so hosts started at the same time don't stay in lockstep
+    const int jitter = QRandomGenerator::global()->bounded(m_interval / 10 + 1);
+    m_beaconTimer.start(m_interval - m_interval / 20 + jitter);
+}
+
+void BeaconScheduler::logStatistics()
+{
+    qDebug() << "Beacons last minute: sent" << (m_beaconsSent - m_lastBeaconsSent)
+             << "replies" << (m_repliesSent - m_lastRepliesSent)
+             << "received" << (m_beaconsReceived - m_lastBeaconsReceived)
+             << "current interval" << m_interval << "ms"
+             << "total replies suppressed" << m_repliesSuppressed;
+
+    m_lastBeaconsSent = m_beaconsSent;
+    m_lastRepliesSent = m_repliesSent;
+    m_lastBeaconsReceived = m_beaconsReceived;
+}
@@ -0,0 +1,67 @@
+#ifndef BEACONSCHEDULER_H
+#define BEACONSCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+/// Decides when to send discovery beacons.
+/// Backs off while nothing changes, goes back to fast beaconing when
+/// something does, and folds replies to other hosts into a single
+/// delayed beacon.
+class BeaconScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int minInterval = 1000; // ms
+    static constexpr int maxInterval = 8000; // ms, others consider us gone after three of these
+    static constexpr int minReplyDelay = 50; // ms
+    static constexpr int maxReplyDelay = 500; // ms
+
+    explicit BeaconScheduler(QObject *parent = nullptr);
+
+    // What we tell others to expect, so they know when to consider us gone
+    int interval() const { return m_interval; }
+
+    quint64 beaconsSent() const { return m_beaconsSent; }
+    quint64 repliesSent() const { return m_repliesSent; }
+    quint64 repliesSuppressed() const { return m_repliesSuppressed; }
+    quint64 beaconsReceived() const { return m_beaconsReceived; }
+
+public slots:
+    void start();
+    void onNetworkChanged();
+    void requestReply();
+    void onBeaconReceived() { m_beaconsReceived++; }
+
+signals:
+    void sendBeacon();
+
+private slots:
+    void onBeaconTimer();
+    void onReplyTimer();
+    void logStatistics();
+
+private:
+    void scheduleNext();
+
+    QTimer m_beaconTimer;
+    QTimer m_replyTimer;
+    QTimer m_statisticsTimer;
+    QElapsedTimer m_sinceLastBeacon;
+
+    int m_interval = minInterval;
+
+    quint64 m_beaconsSent = 0;
+    quint64 m_repliesSent = 0;
+    quint64 m_repliesSuppressed = 0;
+    quint64 m_beaconsReceived = 0;
+
+    // Counters at the last time we logged, for per minute numbers
+    quint64 m_lastBeaconsSent = 0;
+    quint64 m_lastRepliesSent = 0;
+    quint64 m_lastBeaconsReceived = 0;
+};
+
+#endif // BEACONSCHEDULER_H
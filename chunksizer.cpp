@@ -0,0 +1,80 @@
+#include "chunksizer.h"
+
+#include <QtGlobal>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+}
+#endif
+
+namespace {
+// Don't touch the sizes over small wobbles
+bool differsMuch(qint64 current, qint64 wanted)
+{
+    return wanted < current * 3 / 4 || wanted > current * 5 / 4;
+}
+}
+
+bool ChunkSizer::onBytesWritten(qint64 bytes, qintptr socketDescriptor)
+{
+    if (!m_timer.isValid()) {
+        m_timer.start();
+        return false;
+    }
+
+    m_drained += bytes;
+
+    const qint64 elapsed = m_timer.elapsed();
+    if (elapsed < sampleInterval) {
+        return false;
+    }
+
+    const double rate = m_drained * 1000. / elapsed;
+    m_drainRate = m_drainRate > 0 ? m_drainRate * 0.75 + rate * 0.25 : rate;
+    m_drained = 0;
+    m_timer.restart();
+
+    const int rtt = measureRtt(socketDescriptor);
+    m_rtt = rtt > 0 ? rtt : defaultRtt;
+
+    const qint64 bdp = qint64(m_drainRate * m_rtt / 1000000.);
+
+    // One chunk is about what is in flight, the kernel buffer holds two so
+    // it doesn't run dry between us noticing it drained and refilling it
+    qint64 chunkSize = qBound(minChunk, bdp, maxChunk);
+    chunkSize = (chunkSize + minChunk - 1) / minChunk * minChunk;
+    const qint64 sendBufferSize = qBound(minBuffer, bdp * 2, maxBuffer);
+
+    bool changed = false;
+    if (differsMuch(m_chunkSize, chunkSize)) {
+        m_chunkSize = chunkSize;
+        changed = true;
+    }
+    if (m_sendBufferSize == 0 || differsMuch(m_sendBufferSize, sendBufferSize)) {
+        m_sendBufferSize = sendBufferSize;
+        changed = true;
+    }
+    return changed;
+}
+
+int ChunkSizer::measureRtt(qintptr socketDescriptor)
+{
+#ifdef Q_OS_LINUX
+    if (socketDescriptor < 0) {
+        return 0;
+    }
+
+    tcp_info info = {};
+    socklen_t length = sizeof(info);
+    if (getsockopt(int(socketDescriptor), IPPROTO_TCP, TCP_INFO, &info, &length) < 0) {
+        return 0;
+    }
+    return int(info.tcpi_rtt);
+#else
+    Q_UNUSED(socketDescriptor);
+    return 0;
+#endif
+}
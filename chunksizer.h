@@ -0,0 +1,44 @@
+#ifndef CHUNKSIZER_H
+#define CHUNKSIZER_H
+
+#include <QElapsedTimer>
+
+#include "common.h"
+
+/// Picks how much a sending connection writes at a time and how big the
+/// socket send buffer is, from the bandwidth-delay product. Bandwidth is
+/// how fast bytesWritten drains, the delay is the kernel's smoothed RTT.
+/// Small when the link is slow or shared, so others get a turn, and large
+/// enough on fast links to keep the pipe full while we refill.
+class ChunkSizer
+{
+public:
+    static constexpr qint64 minChunk = 64 * 1024;
+    static constexpr qint64 maxChunk = TRANSFER_BYTE_SIZE;
+    static constexpr qint64 initialChunk = 256 * 1024;
+    static constexpr qint64 minBuffer = 128 * 1024;
+    static constexpr qint64 maxBuffer = 16 * 1024 * 1024;
+    static constexpr int sampleInterval = 250; // ms
+    static constexpr int defaultRtt = 1000; // us, if the kernel won't tell us
+
+    // Call with what bytesWritten reports, returns true if the sizes changed
+    bool onBytesWritten(qint64 bytes, qintptr socketDescriptor);
+
+    qint64 chunkSize() const { return m_chunkSize; }
+    qint64 sendBufferSize() const { return m_sendBufferSize; } // 0 until we have measured
+    int rtt() const { return m_rtt; } // us
+    qint64 drainRate() const { return qint64(m_drainRate); } // bytes per second
+
+private:
+    static int measureRtt(qintptr socketDescriptor);
+
+    QElapsedTimer m_timer;
+    qint64 m_drained = 0;
+    double m_drainRate = 0;
+    int m_rtt = 0;
+
+    qint64 m_chunkSize = initialChunk;
+    qint64 m_sendBufferSize = 0;
+};
+
+#endif // CHUNKSIZER_H
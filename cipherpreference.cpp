@@ -0,0 +1,114 @@
+#include "cipherpreference.h"
+
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QDebug>
+
+#include <openssl/evp.h>
+#include <memory>
+
+#if defined(Q_OS_LINUX) && (defined(Q_PROCESSOR_ARM_64) || defined(Q_PROCESSOR_ARM_32))
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+bool CipherPreference::hasHardwareAes()
+{
+#if defined(Q_PROCESSOR_X86) && (defined(Q_CC_GNU) || defined(Q_CC_CLANG))
+    // GCM needs carry-less multiplication as well to be fast
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(Q_OS_LINUX) && defined(Q_PROCESSOR_ARM_64)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL);
+#elif defined(Q_OS_LINUX) && defined(Q_PROCESSOR_ARM_32)
+    return (getauxval(AT_HWCAP2) & HWCAP2_AES) && (getauxval(AT_HWCAP2) & HWCAP2_PMULL);
+#else
+    // Don't know how to ask, assume a desktop
+    return true;
+#endif
+}
+
+QList<QSslCipher> CipherPreference::order(const QList<QSslCipher> &ciphers)
+{
+    static const bool fastAes = []() {
+        const bool fast = hasHardwareAes();
+        qDebug() << "Hardware AES:" << fast << "preferring" << (fast ? "AES-GCM" : "ChaCha20-Poly1305");
+        return fast;
+    }();
+
+    QList<QSslCipher> aesGcm, chacha, rest;
+    for (const QSslCipher &cipher : ciphers) {
+        const QString name = cipher.name();
+        if (name.contains("CHACHA20")) {
+            chacha.append(cipher);
+        } else if (name.contains("AES") && name.contains("GCM")) {
+            aesGcm.append(cipher);
+        } else {
+            rest.append(cipher);
+        }
+    }
+
+    if (fastAes) {
+        return aesGcm + chacha + rest;
+    } else {
+        return chacha + aesGcm + rest;
+    }
+}
+
+using EVP_CIPHER_CTX_ptr = std::unique_ptr<EVP_CIPHER_CTX, decltype(&::EVP_CIPHER_CTX_free)>;
+
+bool CipherPreference::runBenchmark()
+{
+    struct Candidate {
+        const char *name;
+        const EVP_CIPHER *cipher;
+    };
+    const Candidate candidates[] = {
+        { "AES-128-GCM", EVP_aes_128_gcm() },
+        { "AES-256-GCM", EVP_aes_256_gcm() },
+        { "ChaCha20-Poly1305", EVP_chacha20_poly1305() },
+    };
+
+    QTextStream out(stdout);
+    out << "Hardware AES: " << (hasHardwareAes() ? "yes" : "no") << '\n';
+    out.flush();
+
+    const unsigned char key[32] = {};
+    unsigned char iv[12] = {};
+    unsigned char tag[16];
+    QByteArray input(benchmarkRecordSize, 'x');
+    QByteArray output(benchmarkRecordSize + EVP_MAX_BLOCK_LENGTH, 0);
+    const unsigned char *in = reinterpret_cast<const unsigned char*>(input.constData());
+    unsigned char *outData = reinterpret_cast<unsigned char*>(output.data());
+
+    for (const Candidate &candidate : candidates) {
+        EVP_CIPHER_CTX_ptr context(EVP_CIPHER_CTX_new(), ::EVP_CIPHER_CTX_free);
+        if (!context || !EVP_EncryptInit_ex(context.get(), candidate.cipher, nullptr, key, iv)) {
+            qWarning() << "Failed to set up" << candidate.name;
+            return false;
+        }
+
+        qint64 bytes = 0;
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < benchmarkDuration) {
+            // New nonce per record, like TLS does
+            iv[0]++;
+            int length = 0;
+            if (!EVP_EncryptInit_ex(context.get(), nullptr, nullptr, nullptr, iv) ||
+                    !EVP_EncryptUpdate(context.get(), outData, &length, in, benchmarkRecordSize) ||
+                    !EVP_EncryptFinal_ex(context.get(), outData + length, &length) ||
+                    !EVP_CIPHER_CTX_ctrl(context.get(), EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag)) {
+                qWarning() << "Encryption failed with" << candidate.name;
+                return false;
+            }
+            bytes += benchmarkRecordSize;
+        }
+
+        const double seconds = timer.nsecsElapsed() / 1000000000.;
+        out << candidate.name << ": " << QString::number(bytes / 1024. / 1024. / seconds, 'f', 1) << " MB/s" << '\n';
+        out.flush();
+    }
+
+    out << "Preferring " << (hasHardwareAes() ? "AES-GCM" : "ChaCha20-Poly1305") << '\n';
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef CIPHERPREFERENCE_H
+#define CIPHERPREFERENCE_H
+
+#include <QList>
+#include <QSslCipher>
+
+/// Orders TLS ciphers by what is fast on this CPU. AES-GCM is the fastest
+/// there is with AES instructions (AES-NI, ARMv8 crypto extensions), but
+/// several times slower than ChaCha20-Poly1305 without them. Servers go
+/// by the order the client sent, so the side that connects decides.
+class CipherPreference
+{
+public:
+    static constexpr int benchmarkRecordSize = 16 * 1024; // a full TLS record
+    static constexpr int benchmarkDuration = 1000; // ms per cipher
+
+    static bool hasHardwareAes();
+
+    // The same ciphers, the fast ones for this machine first
+    static QList<QSslCipher> order(const QList<QSslCipher> &ciphers);
+
+    // Prints MB/s for each AEAD we might end up using, returns false if OpenSSL failed
+    static bool runBenchmark();
+};
+
+#endif // CIPHERPREFERENCE_H
@@ -4,8 +4,17 @@
 #define PING_HEADER "martin er best"
 #define PING_PORT 6666
 
+// Beacons are fixed size: header, version, interval until the next beacon (ms, big endian),
+// certificate fingerprint, hostname (NUL padded)
+#define PING_VERSION 3
+#define PING_INTERVAL_SIZE 2
+#define PING_FINGERPRINT_SIZE 32
+#define PING_HOSTNAME_SIZE 64
+#define PING_SIZE (int(sizeof(PING_HEADER)) + 1 + PING_INTERVAL_SIZE + PING_FINGERPRINT_SIZE + PING_HOSTNAME_SIZE)
+
 #define TRANSFER_PORT 3333
 
+// Upper bound for how much a connection hands the socket at once, see ChunkSizer
 #define TRANSFER_BYTE_SIZE (10 * 1024 * 1024)
 
 #endif // COMMON_H
@@ -2,14 +2,28 @@
 
 #include "common.h"
 #include "connectionhandler.h"
+#include "screencapture.h"
+#include "sparsefile.h"
+#include "inotifywatcher.h"
 
 #include <QSslSocket>
 #include <QSslConfiguration>
-#include <QSettings>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QJsonArray>
 #include <QPoint>
 #include <QDir>
+#include <QtEndian>
+#include <QSettings>
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 Connection::Connection(ConnectionHandler *parent) :
     m_handler(parent)
@@ -17,17 +31,7 @@ Connection::Connection(ConnectionHandler *parent) :
     m_basePath = QDir::homePath() + '/';
 
     m_socket = new QSslSocket(this);
-
-    QSslConfiguration config = m_socket->sslConfiguration();
-
-    QSettings settings;
-    QSslCertificate ourCert = QSslCertificate(settings.value("privcert").toByteArray());
-    QSslKey ourKey = QSslKey(settings.value("privkey").toByteArray(), QSsl::Ec);
-
-    config.setCaCertificates(parent->trustedCertificates());
-    config.setLocalCertificate(ourCert);
-    config.setPrivateKey(ourKey);
-    m_socket->setSslConfiguration(config);
+    m_socket->setSslConfiguration(parent->sslConfiguration());
     m_socket->ignoreSslErrors();
 
     connect(m_socket, SIGNAL(sslErrors(QList<QSslError>)), m_socket, SLOT(ignoreSslErrors()));
@@ -47,80 +51,291 @@ Connection::Connection(ConnectionHandler *parent) :
     m_timeoutTimer->setSingleShot(true);
 
     // abort() nukes the buffers and doesn't wait
-    connect(m_timeoutTimer.data(), &QTimer::timeout, m_socket, [this]() { m_socket->abort(); });
+    connect(m_timeoutTimer.data(), &QTimer::timeout, m_socket, [this]() {
+        const bool wasConnected = m_socket->state() == QAbstractSocket::ConnectedState || m_socket->state() == QAbstractSocket::ClosingState;
+        m_socket->abort();
+        if (!wasConnected) {
+            onConnectFailed();
+        }
+    });
     m_timeoutTimer->start();
 }
 
 Connection::~Connection()
 {
+    // Dropped in the middle of a shortcut, don't leave the keys held down
+    if (m_injectedKeys && m_handler) {
+        m_handler->inputInjector().postReleaseKeys(this);
+    }
+
+    if (m_sharedReader != -1 && m_handler) {
+        m_handler->readCache().unregisterReader(m_sharedReader);
+    }
+
+    if (m_admitted && m_handler) {
+        m_handler->releaseTransfer(m_hostId);
+    }
+
+    if (m_flow != -1 && m_handler) {
+        m_handler->transferScheduler().unregisterFlow(m_flow);
+    }
+
+    if (m_progress) {
+        m_progress->finished.storeRelease(1);
+    }
+
     if (m_socket->state() != QAbstractSocket::UnconnectedState) {
         m_socket->abort();
     }
 }
 
-void Connection::initiateMouseControl(const Host &host)
+void Connection::initiateMouseControl(HostId host)
 {
-    qDebug() << "initiating mouse control of" << host.address;
-    m_host = host;
     m_type = SendMouseControl;
+    connectToHost(host);
+    startFlow(TransferScheduler::Interactive);
 
-    m_socket->connectToHostEncrypted(host.address.toString(), TRANSFER_PORT);
+    qDebug() << "initiating mouse control of" << m_address;
 }
 
-void Connection::download(const Host &host, const QString &remotePath, const QString &localPath)
+void Connection::download(HostId host, const QString &remotePath, const QString &localPath, qint64 size)
 {
-    qDebug() << "downloading" << remotePath << "from" << host.address;
-    m_host = host;
     m_type = ReceiveFile;
     m_remotePath = remotePath;
     m_localPath = localPath;
+    m_expectedSize = size;
+    connectToHost(host);
 
-    m_socket->connectToHostEncrypted(host.address.toString(), TRANSFER_PORT);
+    qDebug() << "downloading" << remotePath << "from" << m_address;
 }
 
-void Connection::upload(const Host &host, const QString &remotePath, const QString &localPath)
+void Connection::upload(HostId host, const QString &remoteDirectory, const QStringList &localPaths, const QString &syncRoot)
 {
-    qDebug() << "uploading" << remotePath << "to" << host.address;
+    m_type = SendFile;
+    m_remotePath = remoteDirectory;
+    m_uploadPaths = localPaths;
+    m_syncRoot = syncRoot;
+
+    // Small files are read many at a time while we connect and send
+    if (localPaths.count() >= SmallFileReader::minFiles) {
+        m_smallFiles.start(localPaths);
+    }
 
-    m_host = host;
-    m_type = ReceiveFile;
-    m_remotePath = remotePath;
-    m_localPath = localPath;
+    connectToHost(host);
 
-    m_socket->connectToHostEncrypted(host.address.toString(), TRANSFER_PORT);
+    qDebug() << "uploading" << localPaths.count() << "files to" << remoteDirectory << "on" << m_address;
 }
 
-void Connection::list(const Host &host, const QString &remotePath)
+void Connection::list(HostId host, const QString &remotePath)
 {
-    qDebug() << "listing" << remotePath << "on" << host.address;
-
-    m_host = host;
     m_type = ReceiveListing;
     m_remotePath = remotePath;
+    connectToHost(host);
+
+    qDebug() << "listing" << remotePath << "on" << m_address;
+}
+
+void Connection::openListingSession(HostId host)
+{
+    m_type = ReceiveListing;
+    m_keepAlive = true;
+    connectToHost(host);
+
+    qDebug() << "opening listing session to" << m_address;
+}
+
+void Connection::requestListing(const QString &path, bool prefetch)
+{
+    Q_ASSERT(m_keepAlive);
+
+    QJsonObject request;
+    request["command"] = "list";
+    request["path"] = path;
+    request["keepalive"] = true;
+    request["sizes"] = true;
+    if (prefetch) {
+        request["prefetch"] = true;
+    }
+    m_listingPaths.append(path);
+
+    sendSessionRequest(request);
+}
+
+void Connection::watchDirectory(const QString &path)
+{
+    Q_ASSERT(m_keepAlive);
+
+    QJsonObject request;
+    request["command"] = "watch";
+    request["path"] = path;
+    request["sizes"] = true;
+
+    sendSessionRequest(request);
+}
+
+void Connection::openReadSession(HostId host)
+{
+    m_type = ReadRanges;
+    m_keepAlive = true;
+    connectToHost(host);
+
+    qDebug() << "opening read session to" << m_address;
+}
+
+void Connection::requestRange(const QString &path, qint64 offset, qint64 length, bool prefetch)
+{
+    Q_ASSERT(m_type == ReadRanges);
+
+    QJsonObject request;
+    request["command"] = "read";
+    request["path"] = path;
+    request["offset"] = offset;
+    request["length"] = length;
+    if (prefetch) {
+        request["prefetch"] = true;
+    }
+    m_rangeRequests.append({ path, offset, length });
+
+    sendSessionRequest(request);
+}
+
+void Connection::sendSessionRequest(const QJsonObject &request)
+{
+    Q_ASSERT(m_keepAlive);
+
+    const QByteArray line = QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n";
+    if (!m_sessionReady) {
+        // Not until we know who we're talking to
+        m_unsentRequests += line;
+        return;
+    }
+    m_socket->write(line);
+}
+
+void Connection::fetchCertificate(const QHostAddress &address, const QByteArray &fingerprint)
+{
+    qDebug() << "fetching certificate from" << address;
 
-    m_socket->connectToHostEncrypted(host.address.toString(), TRANSFER_PORT);
+    m_type = FetchCertificate;
+    m_address = address;
+    m_expectedFingerprint = fingerprint;
+
+    m_setupTimer.start();
+    m_socket->connectToHostEncrypted(address.toString(), TRANSFER_PORT);
+}
+
+void Connection::connectToHost(HostId host)
+{
+    m_hostId = host;
+    m_address = m_handler->hosts().address(host);
+    m_expectedFingerprint = m_handler->hosts().fingerprint(host);
+
+    // From here, so the handshake is all that is timed
+    m_setupTimer.start();
+    m_socket->connectToHostEncrypted(m_address.toString(), TRANSFER_PORT);
+}
+
+void Connection::startFlow(TransferScheduler::Priority priority)
+{
+    if (m_flow != -1) {
+        m_handler->transferScheduler().unregisterFlow(m_flow);
+    }
+    m_flow = m_handler->transferScheduler().registerFlow(m_hostId, priority);
+    m_flowPriority = priority;
+}
+
+void Connection::writeScheduled(const QByteArray &data)
+{
+    if (m_flow == -1) {
+        m_socket->write(data);
+        return;
+    }
+
+    // Listings wait for their share, and nothing overtakes what is already waiting
+    if (m_flowPriority != TransferScheduler::Interactive &&
+            (m_flowPriority == TransferScheduler::Listing || !m_outgoing.isEmpty())) {
+        m_outgoing += data;
+        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::sendOutgoing, Qt::UniqueConnection);
+        sendOutgoing();
+        return;
+    }
+
+    // Interactive traffic is always let through, but counted. Anything
+    // queued in front of it has to go first, so it goes right away too.
+    const QByteArray outgoing = m_outgoing + data;
+    m_outgoing.clear();
+    m_handler->transferScheduler().request(m_flow, outgoing.size());
+    m_socket->write(outgoing);
+}
+
+void Connection::retrySendLater(int delay)
+{
+    if (m_retryPending) {
+        return;
+    }
+    m_retryPending = true;
+
+    QTimer::singleShot(delay, this, [this]() {
+        m_retryPending = false;
+        onBytesWritten(0);
+    });
+}
+
+void Connection::accept(qintptr socketDescriptor)
+{
+    m_setupTimer.start();
+
+    if (!m_socket->setSocketDescriptor(socketDescriptor)) {
+        qWarning() << "Failed to set descriptor" << socketDescriptor;
+        deleteLater();
+        return;
+    }
+
+    m_isServer = true;
+    m_socket->startServerEncryption();
+}
+
+void Connection::cancel()
+{
+    m_socket->close();
 }
 
 bool Connection::isConnected() const
 {
-    return m_socket->isEncrypted() && m_host.trusted;
+    return m_socket->isEncrypted() && m_handler->hosts().isTrusted(m_hostId);
 }
 
 void Connection::onEncrypted()
 {
-    m_host.certificate = m_socket->peerCertificate();
+    const QSslCertificate peerCertificate = m_socket->peerCertificate();
 
     m_timeoutTimer->stop();
 
-    if (!m_handler->isTrusted(m_host)) {
+    if (m_type == FetchCertificate) {
+        // The handshake is all we wanted, the handler checks it against the announced fingerprint
+        emit certificateReceived(m_expectedFingerprint, peerCertificate);
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    const QByteArray fingerprint = Host::fingerprintOf(peerCertificate);
+    if (m_type == Incoming) {
+        m_hostId = m_handler->hosts().find(fingerprint);
+    } else if (fingerprint != m_expectedFingerprint) {
+        qWarning() << "Host presented a different certificate than the one we know";
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    if (!m_handler->hosts().isTrusted(m_hostId)) {
         qWarning() << "Connected to host with untrusted certificate";
-        qDebug().noquote() << m_socket->peerCertificate().toText();
+        qDebug().noquote() << peerCertificate.toText();
         m_socket->disconnectFromHost();
         return;
     }
-    qDebug() << "Encryption complete";
+    qDebug() << "Encryption complete after" << m_setupTimer.nsecsElapsed() / 1000000. << "ms";
 
-    m_host.address = m_socket->peerAddress();
+    m_address = m_socket->peerAddress();
 
     emit connectionEstablished(this);
 
@@ -130,6 +345,16 @@ void Connection::onEncrypted()
         return;
     }
 
+    if (m_keepAlive) {
+        connect(m_socket, &QSslSocket::readyRead, this, &Connection::onReadyRead);
+        m_sessionReady = true;
+        if (!m_unsentRequests.isEmpty()) {
+            m_socket->write(m_unsentRequests);
+            m_unsentRequests.clear();
+        }
+        return;
+    }
+
     QJsonObject request;
 
     switch (m_type) {
@@ -141,16 +366,24 @@ void Connection::onEncrypted()
     case SendFile:
         request["command"] = "upload";
         request["path"] = m_remotePath;
-        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        if (!m_syncRoot.isEmpty()) {
+            request["sync"] = true;
+        }
+        // We want to hear when everything is in place on their side
+        request["ack"] = true;
+        // Start sending when the other side says it is ready
+        connect(m_socket, &QSslSocket::readyRead, this, &Connection::onReadyRead);
         break;
     case ReceiveFile:
         request["command"] = "download";
         request["path"] = m_remotePath;
+        request["sparse"] = true;
         connect(m_socket, &QSslSocket::readyRead, this, &Connection::onReadyRead);
         break;
 
     case SendMouseControl:
     case Incoming:
+    case FetchCertificate:
         return;
 
     default:
@@ -165,14 +398,41 @@ void Connection::onEncrypted()
 void Connection::onError()
 {
     qWarning() << "server error" << m_socket->errorString();
+    const bool neverConnected = m_socket->state() == QAbstractSocket::UnconnectedState;
     m_socket->disconnectFromHost();
+    if (neverConnected) {
+        onConnectFailed();
+    }
+}
+
+void Connection::onConnectFailed()
+{
+    // Sessions are kept around by whoever opened them, and they wait for
+    // disconnected() to let go. Without a connection it never comes.
+    if (!m_keepAlive || m_isServer) {
+        return;
+    }
+    emit disconnected();
+    deleteLater();
 }
 
 void Connection::onDisconnected()
 {
-    qDebug() << "Disconnected from" << m_host.address << "type" << m_type;
+    qDebug() << "Disconnected from" << m_address << "type" << m_type;
+
+    if (m_screenCapture) {
+        m_screenTimer->stop();
+        emit screenViewChanged(false);
+    }
 
     if (m_file) {
+        // Don't leave half an upload lying around
+        if (m_isServer && m_type == ReceiveFile && m_fileRemaining > 0) {
+            qWarning() << "Upload of" << m_file->fileName() << "interrupted, removing it";
+            m_largeIo.reset();
+            m_file->remove();
+        }
+        m_largeIo.finish();
         m_file->close();
         m_file->deleteLater();
         m_file = nullptr;
@@ -189,7 +449,7 @@ void Connection::sendMouseClickEvent(const QPoint &position, const MouseButton b
     request["y"] = position.y();
     request["mousebutton"] = int(button);
 
-    m_socket->write(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
+    writeScheduled(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
 }
 
 void Connection::sendMouseMoveEvent(const QPoint &position)
@@ -199,11 +459,35 @@ void Connection::sendMouseMoveEvent(const QPoint &position)
     request["x"] = position.x();
     request["y"] = position.y();
 
-    m_socket->write(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
+    writeScheduled(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
+}
+
+void Connection::sendKeyEvent(quint32 keysym, bool pressed)
+{
+    QJsonObject request;
+    request["command"] = "key";
+    request["keysym"] = qint64(keysym);
+    request["pressed"] = pressed;
+
+    writeScheduled(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
 }
 
-void Connection::handleMouseCommand(const QString &command, const QJsonObject &data)
+void Connection::handleInputCommand(const QString &command, const QJsonObject &data)
 {
+    // Straight to the injection thread, not through the GUI
+    InputInjector &injector = m_handler->inputInjector();
+
+    if (command == "key") {
+        const qint64 keysym = qint64(data["keysym"].toDouble());
+        if (keysym <= 0 || keysym > 0x1fffffff) {
+            qWarning() << "Invalid keysym" << keysym;
+            return;
+        }
+        injector.postKey(this, quint32(keysym), data["pressed"].toBool());
+        m_injectedKeys = true;
+        return;
+    }
+
     const QPoint position(data["x"].toInt(-1), data["y"].toInt(-1));
     if (position.x() < 0 || position.y() < 0) {
         qWarning() << "invalid position";
@@ -211,12 +495,13 @@ void Connection::handleMouseCommand(const QString &command, const QJsonObject &d
     }
 
     if (command == "mousemove") {
-        emit mouseMoveRequested(position);
+        injector.postMove(position);
         return;
     }
 
     if (command != "mouseclick") {
         qWarning() << "Unhandled mouse command" << command;
+        return;
     }
 
     const int button = data["mousebutton"].toInt(-1);
@@ -226,7 +511,7 @@ void Connection::handleMouseCommand(const QString &command, const QJsonObject &d
     case MiddleButton:
     case ScrollUp:
     case ScrollDown:
-        emit mouseClickRequested(position, MouseButton(button));
+        injector.postClick(position, MouseButton(button));
         break;
     default:
         qWarning() << "Unhandled mouse button" << button;
@@ -238,7 +523,7 @@ void Connection::handleMouseCommand(const QString &command, const QJsonObject &d
 
 void Connection::onReadyRead()
 {
-    if (!m_handler->isTrusted(m_host)) {
+    if (!m_handler->hosts().isTrusted(m_hostId)) {
         qWarning() << "Should not happen, but we got ready read for untrusted";
         qDebug().noquote() << m_socket->peerCertificate().toText();
         m_socket->disconnectFromHost();
@@ -246,25 +531,76 @@ void Connection::onReadyRead()
     }
 
     if (m_type == Incoming) {
-        if (!m_socket->canReadLine()) {
-            return;
+        // Mouse control sends a steady stream of commands, don't leave any waiting
+        while (m_type == Incoming && m_socket->canReadLine()) {
+            QJsonParseError parseError;
+            QJsonObject request = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
+            if (parseError.error != QJsonParseError::NoError) {
+                qWarning() << "Failed to parse json" << parseError.errorString();
+                m_socket->disconnectFromHost();
+                return;
+            }
+
+            const QString command = request["command"].toString();
+            if (command.startsWith("mouse") || command == "key") {
+                handleInputCommand(command, request);
+                continue;
+            }
+
+            // Only once whoever is sitting here has agreed to it
+            if (command == "screenview") {
+                if (!m_screenViewRequested) {
+                    m_screenViewRequested = true;
+                    emit screenViewRequested(this, m_handler->hosts().name(m_hostId));
+                }
+                continue;
+            }
+
+            // No reply, changes are pushed as they happen
+            if (command == "watch") {
+                startWatching(request["path"].toString(), request["sizes"].toBool());
+                continue;
+            }
+
+            handleCommand(command, request["path"].toString(), request);
         }
+        return;
+    }
 
-        QJsonParseError parseError;
-        QJsonObject request = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
-        if (parseError.error != QJsonParseError::NoError) {
-            qWarning() << "Failed to parse json" << parseError.errorString();
-            m_socket->disconnectFromHost();
-            return;
+    if (m_type == SendMouseControl) {
+        receiveScreenFrames();
+        return;
+    }
+
+    if (m_keepAlive) {
+        if (m_type == ReadRanges) {
+            receiveRanges();
+        } else {
+            receiveListings();
         }
+        return;
+    }
 
-        const QString command = request["command"].toString();
-        if (command.startsWith("mouse")) {
-            handleMouseCommand(command, request);
+    if (!m_isServer && !readStatus()) {
+        return;
+    }
+
+    if (m_type == SendFile && !m_isServer) {
+        if (m_uploadDone && m_peerAcks) {
+            receiveUploadAck();
             return;
         }
-
-        handleCommand(command, request["path"].toString());
+        if (m_socket->bytesAvailable() > 0) {
+            qWarning() << "Unexpected data while sending";
+            m_socket->disconnectFromHost();
+            return;
+        }
+        if (!m_sending) {
+            m_sending = true;
+            m_batchTimer.start();
+            connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+            onBytesWritten(0);
+        }
         return;
     }
 
@@ -283,6 +619,11 @@ void Connection::onReadyRead()
         return;
     }
 
+    if (m_type == ReceiveFile && m_isServer) {
+        receiveUpload();
+        return;
+    }
+
     if (m_type != ReceiveFile){
         qWarning() << "Unexpected readyread for connection type" << m_type;
         m_socket->disconnectFromHost();
@@ -305,100 +646,1390 @@ void Connection::onReadyRead()
         }
 
         qDebug() << "Opened" << m_localPath << "for writing";
+
+        if (LargeFileIo::isLarge(m_expectedSize)) {
+            m_largeIo.startWriting(m_file);
+        }
+    }
+
+    if (m_sparse) {
+        if (!writeSparse()) {
+            m_socket->disconnectFromHost();
+        }
+        return;
     }
 
     const qint64 bytesToRead = m_socket->bytesAvailable();
     m_file->write(m_socket->readAll());
-    emit bytesTransferred(bytesToRead);
+    if (m_largeIo.isActive()) {
+        m_largeIo.written();
+    }
+    countProgress(bytesToRead);
 }
 
-void Connection::onBytesWritten(qint64 bytes)
+void Connection::receiveListings()
 {
-    emit bytesTransferred(bytes);
+    forever {
+        // Between listings there can be changes to the watched directory
+        if (!m_gotStatus) {
+            if (!m_socket->canReadLine()) {
+                return;
+            }
 
-    if (m_socket->bytesToWrite() > 0) {
-        qDebug() << "Still" << m_socket->bytesToWrite() << "bytes to write";
-        return;
-    }
+            QJsonParseError parseError;
+            const QJsonObject response = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
+            if (parseError.error != QJsonParseError::NoError) {
+                qWarning() << "Failed to parse response" << parseError.errorString();
+                m_socket->disconnectFromHost();
+                return;
+            }
 
-    if (m_type == SendMouseControl) {
-        return;
-    }
+            if (response.contains("path")) {
+                receiveDirectoryChanges(response);
+                continue;
+            }
 
-    if (m_type == SendListing) {
-        qDebug() << "Finished sending list";
-        m_socket->disconnectFromHost();
-        return;
-    }
+            if (m_listingPaths.isEmpty()) {
+                qWarning() << "Got a listing we didn't ask for";
+                m_socket->disconnectFromHost();
+                return;
+            }
+            if (!applyStatus(response)) {
+                return;
+            }
+        }
 
-    if (m_type != SendFile) {
-        qWarning() << "Bytes written, but we're not sending a file!";
-        m_socket->disconnectFromHost();
-        return;
+        // Each listing ends with an empty line
+        bool complete = false;
+        while (!complete && m_socket->canReadLine()) {
+            const QString entry = QString::fromUtf8(m_socket->readLine()).trimmed();
+            if (entry.isEmpty()) {
+                complete = true;
+            } else {
+                m_listingEntries.append(entry);
+            }
+        }
+        if (!complete) {
+            return;
+        }
+
+        m_gotStatus = false;
+        const QStringList entries = m_listingEntries;
+        m_listingEntries.clear();
+        emit listingReceived(m_listingPaths.takeFirst(), entries);
     }
+}
 
-    if (!m_file) {
-        m_file = new QFile(m_localPath, this);
+void Connection::receiveRanges()
+{
+    forever {
+        if (m_rangeRemaining == -1) {
+            if (!m_socket->canReadLine()) {
+                return;
+            }
 
-        if (!m_file->exists()) {
-            qWarning() << "Local file does not exist" << m_localPath;
-            m_socket->disconnectFromHost();
+            QJsonParseError parseError;
+            const QJsonObject response = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
+            if (parseError.error != QJsonParseError::NoError || m_rangeRequests.isEmpty()) {
+                qWarning() << "Unexpected read response" << parseError.errorString();
+                m_socket->disconnectFromHost();
+                return;
+            }
+
+            // Not a failure, it is still there when they have room for us again
+            if (response["status"].toString() == "busy") {
+                const RangeRequest request = m_rangeRequests.takeFirst();
+                emit rangeBusy(request.path, request.offset, response["retryAfter"].toInt(1000));
+                continue;
+            }
+
+            // A missing file doesn't end the session, they might want another one
+            if (response["status"].toString() != "ok") {
+                const RangeRequest request = m_rangeRequests.takeFirst();
+                qWarning() << "Reading" << request.path << "failed:" << response["status"].toString();
+                emit rangeFailed(request.path, request.offset);
+                continue;
+            }
+
+            // We allocate for it up front, so not a byte more than we asked for
+            const qint64 length = qint64(response["length"].toDouble(-1));
+            if (length < 0 || length > m_rangeRequests.first().length) {
+                qWarning() << "Got" << length << "bytes of" << m_rangeRequests.first().path << ", asked for" << m_rangeRequests.first().length;
+                m_socket->disconnectFromHost();
+                return;
+            }
+
+            m_rangeFileSize = qint64(response["size"].toDouble());
+            m_rangeRemaining = length;
+            m_rangeData.clear();
+            m_rangeData.reserve(int(m_rangeRemaining));
+        }
+
+        if (m_rangeRemaining > 0) {
+            const QByteArray data = m_socket->read(m_rangeRemaining);
+            m_rangeData += data;
+            m_rangeRemaining -= data.size();
+            if (m_rangeRemaining > 0) {
+                return;
+            }
+        }
+
+        m_rangeRemaining = -1;
+        const RangeRequest request = m_rangeRequests.takeFirst();
+        const QByteArray data = m_rangeData;
+        m_rangeData.clear();
+        emit rangeReceived(request.path, request.offset, data, m_rangeFileSize);
+    }
+}
+
+void Connection::serveRange(const QString &path, const QJsonObject &request)
+{
+    // Read ahead waits its turn with the other transfers, the block the player is stuck on doesn't
+    const bool prefetch = request["prefetch"].toBool();
+
+    // Counts as a transfer like any other while it has answers outstanding
+    if (!m_admitted) {
+        int retryAfter = 0;
+        if (!m_handler->tryAdmitTransfer(m_hostId, &retryAfter)) {
+            sendRange(statusLine(QStringLiteral("busy"), retryAfter), prefetch);
             return;
         }
+        m_admitted = true;
+    }
 
-        if (!m_file->open(QIODevice::ReadOnly)) {
-            qWarning() << "Failed to open" << m_localPath << "for reading" << m_file->errorString();
-            m_socket->disconnectFromHost();
+    // Players read the same file over and over, keep it open between requests
+    if (m_file && m_file->fileName() != path) {
+        m_file->close();
+        m_file->deleteLater();
+        m_file = nullptr;
+    }
+    if (!m_file) {
+        m_file = new QFile(path, this);
+        if (!QFileInfo(path).isFile() || !m_file->open(QIODevice::ReadOnly)) {
+            qWarning() << "Failed to open" << path << "for reading" << m_file->errorString();
+            m_file->deleteLater();
+            m_file = nullptr;
+            sendRange(statusLine(QStringLiteral("notfound")), prefetch);
             return;
         }
+    }
 
-        qDebug() << "Opened" << m_localPath << "for reading";
+    const qint64 size = m_file->size();
+    const qint64 offset = qBound<qint64>(0, qint64(request["offset"].toDouble()), size);
+    const qint64 length = qBound<qint64>(0, qint64(request["length"].toDouble()), qMin(maxRangeLength, size - offset));
+
+    QByteArray data;
+    if (length > 0 && m_file->seek(offset)) {
+        data = m_file->read(length);
     }
 
-    if (m_file->atEnd()) {
-        qDebug() << "finished sending file";
-        m_socket->disconnectFromHost();
-        return;
+#ifdef Q_OS_LINUX
+    // Most likely asked for next, have it ready
+    if (offset + length < size) {
+        posix_fadvise(m_file->handle(), offset + length, rangeReadAhead, POSIX_FADV_WILLNEED);
     }
+#endif
 
-    m_socket->write(m_file->read(TRANSFER_BYTE_SIZE));
+    QJsonObject response;
+    response["size"] = size;
+    response["length"] = data.size();
+    sendRange(statusLine(QStringLiteral("ok"), 0, response) + data, prefetch);
 }
 
-void Connection::handleCommand(const QString &command, QString path)
+void Connection::sendRange(const QByteArray &response, bool prefetch)
 {
-    path = m_basePath + QDir::cleanPath(path);
-
-    m_localPath = path;
-
-    qDebug() << "Got command" << command << "for" << path;
+    const TransferScheduler::Priority priority = prefetch ? TransferScheduler::Bulk : TransferScheduler::Interactive;
+    if (m_flow == -1 || m_flowPriority != priority) {
+        startFlow(priority);
+    }
 
-    if (command == "list") {
-        QString retData;
-        const QDir dir(path);
-        const QFileInfoList files = dir.entryInfoList(QDir::Files | QDir::Dirs | QDir::NoDot, QDir::Name | QDir::DirsFirst | QDir::LocaleAware);
-        for (const QFileInfo &fi : files) {
-            retData += QString::number(fi.size()) + ':' + fi.fileName();
-            if (fi.isDir()) {
-                retData += '/';
-            }
-            retData += '\n';
-        }
-        m_socket->write(retData.toUtf8());
-        m_type = SendListing;
+    // Also gives the admission back when everything is out
+    connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::sendOutgoing, Qt::UniqueConnection);
 
-        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+    if (!prefetch) {
+        writeScheduled(response);
         return;
     }
 
-    if (command == "upload") {
-        m_type = ReceiveFile;
-    } else if (command == "download") {
+    m_outgoing += response;
+    sendOutgoing();
+}
+
+void Connection::sendOutgoing(qint64 written)
+{
+    // Read serving sizes its grants by how fast the socket drains, like sending files does
+    if (written > 0) {
+        updateChunkSize(written);
+    }
+
+    if (m_retryPending || m_socket->bytesToWrite() > 0) {
+        return;
+    }
+
+    // Everything is out, a paused player shouldn't keep downloads waiting
+    if (m_outgoing.isEmpty()) {
+        if (m_admitted) {
+            m_handler->releaseTransfer(m_hostId);
+            m_admitted = false;
+        }
+        return;
+    }
+
+    int retryDelay = 0;
+    const qint64 granted = m_handler->transferScheduler().request(m_flow, qMin<qint64>(m_outgoing.size(), m_chunkSizer.chunkSize()), &retryDelay);
+    if (granted <= 0) {
+        m_retryPending = true;
+        QTimer::singleShot(retryDelay, this, [this]() {
+            m_retryPending = false;
+            sendOutgoing();
+        });
+        return;
+    }
+
+    m_socket->write(m_outgoing.left(int(granted)));
+    m_outgoing.remove(0, int(granted));
+}
+
+void Connection::receiveDirectoryChanges(const QJsonObject &delta)
+{
+    const QString path = delta["path"].toString();
+    if (delta["relist"].toBool()) {
+        emit directoryNeedsRelist(path);
+        return;
+    }
+
+    QStringList entries;
+    for (const QJsonValue &entry : delta["entries"].toArray()) {
+        entries.append(entry.toString());
+    }
+    QStringList removed;
+    for (const QJsonValue &name : delta["removed"].toArray()) {
+        removed.append(name.toString());
+    }
+    emit directoryChanged(path, entries, removed);
+}
+
+void Connection::onBytesWritten(qint64 bytes)
+{
+    countProgress(bytes);
+
+    if (m_type == SendFile) {
+        updateChunkSize(bytes);
+    }
+
+    if (m_socket->bytesToWrite() > 0) {
+        qDebug() << "Still" << m_socket->bytesToWrite() << "bytes to write";
+        return;
+    }
+
+    // The rest of a listing, waiting for the scheduler
+    if (!m_outgoing.isEmpty()) {
+        return;
+    }
+
+    if (m_type == SendMouseControl) {
+        return;
+    }
+
+    if (m_type == SendListing || m_type == SendStatus) {
+        qDebug() << "Finished sending" << m_type;
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    if (m_type != SendFile) {
+        qWarning() << "Bytes written, but we're not sending a file!";
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    if (!m_isServer) {
+        sendUploadChunk();
+        return;
+    }
+
+    if (atEndOfFile()) {
+        qDebug() << "finished sending file";
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    if (m_flow == -1) {
+        startFlow(TransferScheduler::Bulk);
+    }
+
+    int retryDelay = 0;
+    const qint64 granted = m_handler->transferScheduler().request(m_flow, m_chunkSizer.chunkSize(), &retryDelay);
+    if (granted <= 0) {
+        retrySendLater(retryDelay);
+        return;
+    }
+
+    const QByteArray data = m_sparse ? readSparse(granted) : readFile(granted);
+    if (data.isEmpty()) {
+        qWarning() << "Failed to read" << m_localPath << m_file->errorString();
+        m_socket->abort();
+        return;
+    }
+    m_socket->write(data);
+}
+
+bool Connection::openForSending()
+{
+    m_file = new QFile(m_localPath, this);
+
+    if (!m_file->exists()) {
+        qWarning() << "Local file does not exist" << m_localPath;
+        return false;
+    }
+
+    if (!m_file->open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open" << m_localPath << "for reading" << m_file->errorString();
+        return false;
+    }
+
+    qDebug() << "Opened" << m_localPath << "for reading";
+    return true;
+}
+
+void Connection::startSparseSend()
+{
+    m_sparse = true;
+    m_sparseSize = m_file->size();
+    m_sparsePosition = 0;
+    m_sparseDataRemaining = 0;
+
+    qDebug() << "Sending" << m_file->fileName() << "as sparse records";
+}
+
+QByteArray Connection::readSparse(qint64 maxSize)
+{
+    QByteArray records;
+    while (m_sparseDataRemaining == 0 && m_sparsePosition < m_sparseSize) {
+        qint64 start = 0;
+        qint64 end = 0;
+        SparseFile::nextExtent(m_file, m_sparsePosition, m_sparseSize, &start, &end);
+
+        if (start > m_sparsePosition) {
+            records += SparseFile::recordHeader(SparseFile::Hole, start - m_sparsePosition);
+            countProgress(start - m_sparsePosition);
+            m_sparsePosition = start;
+        }
+        if (end > start) {
+            if (!m_file->seek(start)) {
+                return QByteArray();
+            }
+            records += SparseFile::recordHeader(SparseFile::Data, end - start);
+            m_sparseDataRemaining = end - start;
+        }
+    }
+
+    // Only a hole left at the end
+    if (m_sparseDataRemaining == 0) {
+        return records;
+    }
+
+    const QByteArray data = m_file->read(qMin(maxSize, m_sparseDataRemaining));
+    if (data.isEmpty()) {
+        return QByteArray();
+    }
+    m_sparseDataRemaining -= data.size();
+    m_sparsePosition += data.size();
+
+    return records + data;
+}
+
+bool Connection::writeSparse()
+{
+    while (m_fileRemaining > 0 && m_socket->bytesAvailable() > 0) {
+        if (m_recordRemaining == 0) {
+            if (m_socket->bytesAvailable() < SparseFile::recordHeaderSize) {
+                return true;
+            }
+
+            const QByteArray header = m_socket->read(SparseFile::recordHeaderSize);
+            const qint64 length = qFromBigEndian<qint64>(header.constData() + 1);
+            if (length <= 0 || length > m_fileRemaining) {
+                qWarning() << "Invalid sparse record length" << length;
+                return false;
+            }
+
+            if (header[0] == SparseFile::Hole) {
+                // Growing the file leaves a hole, carry on after it
+                const qint64 end = m_file->pos() + length;
+                if (!m_file->resize(end) || !m_file->seek(end)) {
+                    qWarning() << "Failed to leave a hole in" << m_file->fileName() << m_file->errorString();
+                    return false;
+                }
+                m_fileRemaining -= length;
+                countProgress(length);
+                continue;
+            }
+
+            if (header[0] != SparseFile::Data) {
+                qWarning() << "Unknown sparse record type" << header[0];
+                return false;
+            }
+            m_recordRemaining = length;
+            continue;
+        }
+
+        const QByteArray data = m_socket->read(qMin(m_socket->bytesAvailable(), m_recordRemaining));
+        if (m_file->write(data) != data.size()) {
+            qWarning() << "Failed to write to" << m_file->fileName() << m_file->errorString();
+            return false;
+        }
+        if (m_largeIo.isActive()) {
+            m_largeIo.written();
+        }
+        m_recordRemaining -= data.size();
+        m_fileRemaining -= data.size();
+        m_batchBytes += data.size();
+        countProgress(data.size());
+    }
+    return true;
+}
+
+void Connection::updateChunkSize(qint64 bytesWritten)
+{
+    if (!m_chunkSizer.onBytesWritten(bytesWritten, m_socket->socketDescriptor())) {
+        return;
+    }
+
+    m_socket->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, int(m_chunkSizer.sendBufferSize()));
+
+    qDebug() << "Chunk size" << m_chunkSizer.chunkSize() << "send buffer" << m_chunkSizer.sendBufferSize()
+             << "rtt" << m_chunkSizer.rtt() << "us, drain rate" << m_chunkSizer.drainRate() << "B/s";
+
+    emit sendStatsChanged(m_chunkSizer.chunkSize(), m_chunkSizer.sendBufferSize(), m_chunkSizer.rtt(), m_chunkSizer.drainRate());
+}
+
+QByteArray Connection::readFile(qint64 maxSize)
+{
+    if (m_sharedReader != -1) {
+        return m_handler->readCache().read(m_sharedReader, maxSize);
+    }
+    return m_largeIo.isActive() ? m_largeIo.read(maxSize) : m_file->read(maxSize);
+}
+
+bool Connection::atEndOfFile() const
+{
+    if (m_sparse) {
+        return m_sparsePosition >= m_sparseSize;
+    }
+    if (m_sharedReader != -1) {
+        return m_handler->readCache().atEnd(m_sharedReader);
+    }
+    return m_file->atEnd();
+}
+
+void Connection::handleCommand(const QString &command, QString path, const QJsonObject &request)
+{
+    const QString requested = path;
+    path = resolvePath(requested);
+    if (path.isEmpty()) {
+        qWarning() << "Refusing" << command << "for" << requested << "from" << m_address << ", outside our home directory";
+        // Sessions carry on with the next request, everything else hangs up once this is out
+        if (command == "read") {
+            sendRange(statusLine(QStringLiteral("notallowed")), request["prefetch"].toBool());
+            return;
+        }
+        if (!request["keepalive"].toBool()) {
+            m_type = SendStatus;
+            connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        }
+        sendStatus(QStringLiteral("notallowed"));
+        return;
+    }
+
+    m_localPath = path;
+
+    qDebug() << "Got command" << command << "for" << path;
+
+    // Any number of them on one connection, answered in order
+    if (command == "read") {
+        serveRange(path, request);
+        return;
+    }
+
+    if (command == "list") {
+        // Folders get "bytes,files[,stale|,partial]" instead of just a size if they want it
+        const bool withSizes = request["sizes"].toBool();
+
+        // Nothing above home to go up to
+        const QDir::Filters filters = path == QFileInfo(QDir::homePath()).canonicalFilePath() ? QDir::NoDotAndDotDot : QDir::NoDot;
+
+        QString retData;
+        const QDir dir(path);
+        const QFileInfoList files = dir.entryInfoList(QDir::Files | QDir::Dirs | filters, QDir::Name | QDir::DirsFirst | QDir::LocaleAware);
+        for (const QFileInfo &fi : files) {
+            retData += listingLine(fi, withSizes) + '\n';
+        }
+        // Speculative listings shouldn't slow down real transfers
+        startFlow(request["prefetch"].toBool() ? TransferScheduler::Bulk : TransferScheduler::Listing);
+        sendStatus(QStringLiteral("ok"));
+
+        if (request["keepalive"].toBool()) {
+            // Marked by an empty line, then wait for the next request
+            writeScheduled(retData.toUtf8() + '\n');
+            return;
+        }
+
+        m_type = SendListing;
+        writeScheduled(retData.toUtf8());
+
+        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        return;
+    }
+
+    if (command != "upload" && command != "download") {
+        qWarning() << "Unknown command" << command;
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    if (command == "upload" && !QFileInfo(path).isDir()) {
+        qWarning() << "Upload target is not a directory" << path;
+        m_type = SendStatus;
+        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        sendStatus(QStringLiteral("notadirectory"));
+        return;
+    }
+
+    // Replacing files is only allowed in the folders we have said others can sync to
+    m_syncUpload = command == "upload" && request["sync"].toBool();
+    if (m_syncUpload && !isSyncTarget(path)) {
+        qWarning() << "Refusing sync upload to" << path << ", not under sync/incoming";
+        m_type = SendStatus;
+        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        sendStatus(QStringLiteral("notallowed"));
+        return;
+    }
+
+    int retryAfter = 0;
+    if (!m_handler->tryAdmitTransfer(m_hostId, &retryAfter)) {
+        qDebug() << "Too busy, telling them to retry after" << retryAfter << "ms";
+        m_type = SendStatus;
+        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        sendStatus(QStringLiteral("busy"), retryAfter);
+        return;
+    }
+    m_admitted = true;
+
+    if (command == "upload") {
+        m_type = ReceiveFile;
+        m_fileRemaining = 0;
+        m_ackBatch = request["ack"].toBool();
+        m_batchTimer.start();
+
+        // Files can come as data and hole records, older versions take only raw data.
+        // Whether we confirm the batch at the end, older versions just hang up.
+        QJsonObject response;
+        response["sparse"] = true;
+        response["ack"] = true;
+        sendStatus(QStringLiteral("ok"), 0, response);
+    } else {
+        if (!openForSending()) {
+            m_type = SendStatus;
+            connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+            sendStatus(QStringLiteral("notfound"));
+            return;
+        }
+
+        // Only if they can take it, and only if there are holes to skip
+        QJsonObject response;
+        if (request["sparse"].toBool() && SparseFile::isSparse(m_file)) {
+            startSparseSend();
+            response["sparse"] = true;
+            response["size"] = m_sparseSize;
+        } else {
+            // Others downloading the same file at the same time read along with us
+            m_sharedReader = m_handler->readCache().registerReader(m_file);
+            if (m_sharedReader == -1 && LargeFileIo::isLarge(m_file->size())) {
+                m_largeIo.startReading(m_file);
+            }
+        }
+
         m_type = SendFile;
+        sendStatus(QStringLiteral("ok"), 0, response);
         connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
         onBytesWritten(0);
-    } else  {
-        qWarning() << "Unknown command" << command;
+    }
+}
+
+QString Connection::resolvePath(const QString &remotePath) const
+{
+    // Resolved where it exists, so neither .. nor a symlink gets them out.
+    // What doesn't exist can't be read or written to, only listed as empty.
+    QString path = QDir::cleanPath(m_basePath + remotePath);
+    QString home = QDir::cleanPath(QDir::homePath());
+    const QFileInfo info(path);
+    if (info.exists()) {
+        path = info.canonicalFilePath();
+        home = QFileInfo(home).canonicalFilePath();
+    }
+
+    if (path.isEmpty() || home.isEmpty() || (path != home && !path.startsWith(home + '/'))) {
+        return QString();
+    }
+    return path;
+}
+
+QString Connection::listingLine(const QFileInfo &info, bool withSizes)
+{
+    QString line;
+    if (withSizes && info.isDir() && info.fileName() != "..") {
+        qint64 bytes = 0;
+        qint64 fileCount = 0;
+        const DirectorySizes::Total total = m_handler->directorySizes().lookup(info.absoluteFilePath(), &bytes, &fileCount);
+        line = QString::number(bytes) + ',' + QString::number(fileCount);
+        if (total == DirectorySizes::Counting) {
+            line += QStringLiteral(",stale");
+        } else if (total == DirectorySizes::Partial) {
+            // Won't get any better, so they shouldn't keep asking
+            line += QStringLiteral(",partial");
+        }
+    } else {
+        line = QString::number(info.size());
+    }
+    line += ':' + info.fileName();
+    if (info.isDir()) {
+        line += '/';
+    }
+    return line;
+}
+
+void Connection::startWatching(const QString &remotePath, bool withSizes)
+{
+    const QString path = resolvePath(remotePath);
+    if (path.isEmpty()) {
+        qWarning() << "Refusing to watch" << remotePath << ", outside our home directory";
+        return;
+    }
+    if (!QFileInfo(path).isDir()) {
+        qWarning() << "Asked to watch something that isn't a directory" << path;
+        return;
+    }
+
+    if (!m_watcher) {
+        // Created here so it lives on our worker thread
+        m_watcher = new InotifyWatcher(this);
+        connect(m_watcher.data(), &InotifyWatcher::changed, this, [this](const QString &directory, const QString &name, InotifyWatcher::Change change, bool isDirectory) {
+            if (directory != m_watchedPath) {
+                return;
+            }
+            if (change == InotifyWatcher::DirectoryGone) {
+                qDebug() << "Watched directory" << directory << "went away";
+                m_watchTruncated = true;
+            } else {
+                m_watchChanges[name] = isDirectory;
+            }
+            if (!m_watchTimer->isActive()) {
+                m_watchTimer->start();
+            }
+        });
+        connect(m_watcher.data(), &InotifyWatcher::overflowed, this, [this]() {
+            m_watchTruncated = true;
+            m_watchTimer->start();
+        });
+
+        m_watchTimer = new QTimer(this);
+        m_watchTimer->setSingleShot(true);
+        m_watchTimer->setInterval(watchBatchDelay);
+        connect(m_watchTimer.data(), &QTimer::timeout, this, &Connection::sendDirectoryChanges);
+    }
+
+    // One directory at a time, the one they're looking at
+    if (!m_watchedPath.isEmpty()) {
+        m_watcher->removeDirectory(m_watchedPath);
+    }
+    m_watchChanges.clear();
+    m_watchTruncated = false;
+    m_watchTimer->stop();
+
+    m_watchedPath = QDir::cleanPath(path);
+    m_watchedRemotePath = remotePath;
+    m_watchSizes = withSizes;
+    if (!m_watcher->addDirectory(m_watchedPath)) {
+        m_watchedPath.clear();
+        return;
+    }
+    qDebug() << "Watching" << m_watchedPath << "for" << m_address;
+}
+
+void Connection::sendDirectoryChanges()
+{
+    QJsonObject delta;
+    delta["path"] = m_watchedRemotePath;
+
+    // Faster to just list it again
+    if (m_watchTruncated || m_watchChanges.count() > maxWatchBatch) {
+        delta["relist"] = true;
+    } else {
+        // Whatever happened in between, what matters is how it looks now
+        QJsonArray entries;
+        QJsonArray removed;
+        for (QHash<QString, bool>::const_iterator it = m_watchChanges.constBegin(); it != m_watchChanges.constEnd(); ++it) {
+            const QFileInfo info(m_watchedPath + '/' + it.key());
+            if (info.exists() || info.isSymLink()) {
+                entries.append(listingLine(info, m_watchSizes));
+            } else {
+                removed.append(it.value() ? it.key() + '/' : it.key());
+            }
+        }
+        delta["entries"] = entries;
+        delta["removed"] = removed;
+    }
+    m_watchChanges.clear();
+    m_watchTruncated = false;
+
+    writeScheduled(QJsonDocument(delta).toJson(QJsonDocument::Compact) + "\n");
+}
+
+void Connection::sendStatus(const QString &status, int retryAfter, QJsonObject response)
+{
+    writeScheduled(statusLine(status, retryAfter, response));
+}
+
+QByteArray Connection::statusLine(const QString &status, int retryAfter, QJsonObject response)
+{
+    response["status"] = status;
+    if (retryAfter > 0) {
+        response["retryAfter"] = retryAfter;
+    }
+    return QJsonDocument(response).toJson(QJsonDocument::Compact) + "\n";
+}
+
+bool Connection::readStatus()
+{
+    if (m_gotStatus) {
+        return true;
+    }
+
+    if (!m_socket->canReadLine()) {
+        return false;
+    }
+
+    QJsonParseError parseError;
+    const QJsonObject response = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
+    if (parseError.error != QJsonParseError::NoError) {
+        qWarning() << "Failed to parse status" << parseError.errorString();
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    return applyStatus(response);
+}
+
+bool Connection::applyStatus(const QJsonObject &response)
+{
+    const QString status = response["status"].toString();
+    if (status == "ok") {
+        m_gotStatus = true;
+
+        // Uploading, whether we may send records. Downloading, whether they are coming.
+        if (m_type == SendFile) {
+            m_peerTakesSparse = response["sparse"].toBool();
+            m_peerAcks = response["ack"].toBool();
+            return true;
+        }
+
+        // Data and hole records instead of the raw file
+        m_sparse = response["sparse"].toBool();
+        if (m_sparse) {
+            m_fileRemaining = qint64(response["size"].toDouble());
+        }
+        return true;
+    }
+
+    if (status == "busy") {
+        const int retryAfter = response["retryAfter"].toInt(1000);
+        qDebug() << m_address << "is busy, retry after" << retryAfter << "ms";
+        emit busy(retryAfter);
+    } else {
+        qWarning() << "Request failed:" << status;
+    }
+
+    m_socket->disconnectFromHost();
+    return false;
+}
+
+void Connection::sendUploadChunk()
+{
+    if (m_uploadDone) {
+        finishBatch();
+        if (m_peerAcks) {
+            // They hang up after confirming, but not if they're stuck
+            m_timeoutTimer->setInterval(uploadAckTimeout);
+            m_timeoutTimer->start();
+            return;
+        }
         m_socket->disconnectFromHost();
         return;
     }
+
+    if (!m_file && !m_uploadInMemory && !openNextUpload()) {
+        // Nothing more to send, tell them so and hang up once it is out
+        QJsonObject trailer;
+        trailer["done"] = true;
+        m_uploadDone = true;
+        m_socket->write(QJsonDocument(trailer).toJson(QJsonDocument::Compact) + "\n");
+
+        // Older versions never tell us whether they stored it, this is the best we get
+        if (!m_peerAcks) {
+            emit uploadCompleted();
+        }
+        return;
+    }
+
+    if (m_fileRemaining == 0) {
+        if (m_file) {
+            m_largeIo.finish();
+            m_file->close();
+            m_file->deleteLater();
+            m_file = nullptr;
+        }
+        m_uploadInMemory = false;
+        m_batchFiles++;
+        m_uploadIndex++;
+
+        // Header for the next one goes right behind
+        sendUploadChunk();
+        return;
+    }
+
+    if (m_flow == -1) {
+        startFlow(TransferScheduler::Bulk);
+    }
+
+    int retryDelay = 0;
+    const qint64 granted = m_handler->transferScheduler().request(m_flow, qMin(m_fileRemaining, m_chunkSizer.chunkSize()), &retryDelay);
+    if (granted <= 0) {
+        retrySendLater(retryDelay);
+        return;
+    }
+
+    QByteArray data;
+    if (m_sparse) {
+        data = readSparse(granted);
+    } else if (!m_readAhead.isEmpty()) {
+        data = m_readAhead.left(int(granted));
+        m_readAhead.remove(0, data.size());
+    } else {
+        data = readFile(granted);
+    }
+
+    if (data.isEmpty()) {
+        // We promised the size in the header, so there's no way to recover
+        qWarning() << m_uploadPaths.value(m_uploadIndex) << "shrunk while uploading" << (m_file ? m_file->errorString() : QString());
+        m_socket->abort();
+        return;
+    }
+
+    if (m_sparse) {
+        m_fileRemaining = m_sparseSize - m_sparsePosition;
+    } else {
+        m_fileRemaining -= data.size();
+    }
+    m_batchBytes += data.size();
+    m_socket->write(data);
+
+    // Get the next file going while the end of this one drains
+    if (m_fileRemaining == 0) {
+        prefetchNextUpload();
+    }
+}
+
+bool Connection::openNextUpload()
+{
+    while (m_uploadIndex < m_uploadPaths.count()) {
+        const QString &path = m_uploadPaths[m_uploadIndex];
+
+        QByteArray contents;
+        if (m_smallFiles.isActive() && m_smallFiles.take(m_uploadIndex, &contents)) {
+            m_readAhead = contents;
+            m_fileRemaining = contents.size();
+            m_uploadInMemory = true;
+            m_sparse = false;
+            sendUploadHeader(path);
+            return true;
+        }
+
+        if (m_nextFile) {
+            m_file = m_nextFile;
+            m_nextFile = nullptr;
+        } else {
+            m_file = new QFile(path, this);
+            if (!m_file->open(QIODevice::ReadOnly)) {
+                qWarning() << "Failed to open" << path << "for reading, skipping it" << m_file->errorString();
+                m_file->deleteLater();
+                m_file = nullptr;
+                m_uploadIndex++;
+                continue;
+            }
+        }
+
+        m_fileRemaining = m_file->size();
+        if (m_readAhead.size() > m_fileRemaining) {
+            m_readAhead.truncate(int(m_fileRemaining));
+        }
+
+        m_sparse = false;
+        if (m_peerTakesSparse && SparseFile::isSparse(m_file)) {
+            // The read ahead might be mostly zeros, start over with the records
+            m_readAhead.clear();
+            startSparseSend();
+        } else if (LargeFileIo::isLarge(m_fileRemaining)) {
+            m_largeIo.startReading(m_file);
+        }
+
+        sendUploadHeader(path);
+        return true;
+    }
+
+    return false;
+}
+
+void Connection::sendUploadHeader(const QString &path)
+{
+    QJsonObject header;
+    header["name"] = m_syncRoot.isEmpty() ? QFileInfo(path).fileName() : QDir(m_syncRoot).relativeFilePath(path);
+    header["size"] = m_fileRemaining;
+    if (m_sparse) {
+        header["sparse"] = true;
+    }
+
+    m_socket->write(QJsonDocument(header).toJson(QJsonDocument::Compact) + "\n");
+
+    emit fileStarted(QFileInfo(path).fileName(), m_uploadIndex, m_uploadPaths.count());
+}
+
+void Connection::prefetchNextUpload()
+{
+    // Already reading ahead
+    if (m_smallFiles.isActive()) {
+        return;
+    }
+
+    if (m_nextFile || m_uploadIndex + 1 >= m_uploadPaths.count()) {
+        return;
+    }
+
+    const QString &path = m_uploadPaths[m_uploadIndex + 1];
+    QFile *file = new QFile(path, this);
+    if (!file->open(QIODevice::ReadOnly)) {
+        // openNextUpload() will complain and skip it
+        delete file;
+        return;
+    }
+
+#ifdef Q_OS_LINUX
+    // Let the kernel start pulling it in while we're busy with this one
+    posix_fadvise(file->handle(), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+    m_readAhead = file->read(qMin(uploadReadAhead, file->size()));
+    m_nextFile = file;
+}
+
+void Connection::receiveUpload()
+{
+    for (;;) {
+        if (!m_file && !startReceivingFile()) {
+            return;
+        }
+
+        if (m_sparse) {
+            if (!writeSparse()) {
+                m_socket->disconnectFromHost();
+                return;
+            }
+        } else if (const qint64 available = qMin(m_socket->bytesAvailable(), m_fileRemaining)) {
+            const QByteArray data = m_socket->read(available);
+            if (m_file->write(data) != data.size()) {
+                qWarning() << "Failed to write to" << m_file->fileName() << m_file->errorString();
+                m_socket->disconnectFromHost();
+                return;
+            }
+            if (m_largeIo.isActive()) {
+                m_largeIo.written();
+            }
+            m_fileRemaining -= data.size();
+            m_batchBytes += data.size();
+            countProgress(data.size());
+        }
+
+        if (m_fileRemaining > 0) {
+            return;
+        }
+
+        qDebug() << "Received" << m_file->fileName();
+        m_largeIo.finish();
+        m_file->close();
+        if (!m_syncTarget.isEmpty() && !replaceFile(m_file->fileName(), m_syncTarget)) {
+            qWarning() << "Failed to replace" << m_syncTarget << "with what we received";
+            m_file->remove();
+            m_batchFailed++;
+        } else {
+            m_batchFiles++;
+        }
+        m_file->deleteLater();
+        m_file = nullptr;
+    }
+}
+
+void Connection::receiveUploadAck()
+{
+    if (!m_socket->canReadLine()) {
+        return;
+    }
+
+    QJsonParseError parseError;
+    const QJsonObject ack = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
+    if (parseError.error != QJsonParseError::NoError) {
+        qWarning() << "Failed to parse upload confirmation" << parseError.errorString();
+    } else if (ack["status"].toString() != "done" || ack["failed"].toInt() > 0) {
+        qWarning() << m_address << "failed to store" << ack["failed"].toInt() << "of the files we sent";
+    } else {
+        emit uploadCompleted();
+    }
+
+    m_socket->disconnectFromHost();
+}
+
+bool Connection::startReceivingFile()
+{
+    if (!m_socket->canReadLine()) {
+        return false;
+    }
+
+    QJsonParseError parseError;
+    const QJsonObject header = QJsonDocument::fromJson(m_socket->readLine(), &parseError).object();
+    if (parseError.error != QJsonParseError::NoError) {
+        qWarning() << "Failed to parse upload header" << parseError.errorString();
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    if (header["done"].toBool()) {
+        finishBatch();
+        if (!m_ackBatch) {
+            m_socket->disconnectFromHost();
+            return false;
+        }
+
+        // Everything is renamed into place by now, they only count it as sent on this
+        QJsonObject response;
+        response["files"] = m_batchFiles;
+        response["failed"] = m_batchFailed;
+        m_type = SendStatus;
+        connect(m_socket, &QSslSocket::bytesWritten, this, &Connection::onBytesWritten);
+        sendStatus(QStringLiteral("done"), 0, response);
+        return false;
+    }
+
+    const QString name = header["name"].toString();
+    const qint64 size = qint64(header["size"].toDouble(-1));
+
+    // Only plain names, they don't get to pick where it ends up. Syncs can
+    // go into subdirectories, but not out of the one they asked for.
+    bool validName = !name.isEmpty() && !name.contains('\\') && size >= 0;
+    const QStringList parts = name.split('/');
+    if (parts.count() > 1 && !m_syncUpload) {
+        validName = false;
+    }
+    for (const QString &part : parts) {
+        if (part.isEmpty() || part == "." || part == "..") {
+            validName = false;
+        }
+    }
+    if (!validName) {
+        qWarning() << "Invalid upload header" << header;
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    const QString path = m_localPath + '/' + name;
+
+    m_syncTarget.clear();
+    if (m_syncUpload) {
+        const QString directory = QFileInfo(path).absolutePath();
+        if (!QDir().mkpath(directory)) {
+            qWarning() << "Failed to create directory for" << path;
+            m_socket->disconnectFromHost();
+            return false;
+        }
+
+        // One of the directories on the way might be a symlink someone synced here earlier
+        if (!isSyncTarget(directory)) {
+            qWarning() << "Refusing to receive" << path << ", it resolves to outside of sync/incoming";
+            m_socket->disconnectFromHost();
+            return false;
+        }
+
+        // Written next to it and renamed over it when complete, so nobody sees half a file
+        m_syncTarget = path;
+        m_file = new QFile(directory + "/." + QFileInfo(path).fileName() + ".partial", this);
+    } else {
+        m_file = new QFile(path, this);
+
+        if (m_file->exists()) {
+            qWarning() << "Refusing to overwrite" << path;
+            m_file->deleteLater();
+            m_file = nullptr;
+            m_socket->disconnectFromHost();
+            return false;
+        }
+    }
+
+    if (!openForReceiving(m_file, m_syncUpload)) {
+        qWarning() << "Failed to open" << path << "for writing" << m_file->errorString();
+        m_file->deleteLater();
+        m_file = nullptr;
+        m_socket->disconnectFromHost();
+        return false;
+    }
+
+    m_fileRemaining = size;
+    m_sparse = header["sparse"].toBool();
+    m_recordRemaining = 0;
+    if (LargeFileIo::isLarge(size)) {
+        m_largeIo.startWriting(m_file);
+    }
+    qDebug() << "Receiving" << path << size << "bytes" << (m_sparse ? "as sparse records" : "");
+    return true;
+}
+
+bool Connection::isSyncTarget(const QString &path) const
+{
+    // Resolved, so a symlink can't point somewhere else
+    const QString target = QFileInfo(path).canonicalFilePath();
+    if (target.isEmpty()) {
+        return false;
+    }
+
+    const QStringList incoming = QSettings().value("sync/incoming").toStringList();
+    for (const QString &directory : incoming) {
+        const QString allowed = QFileInfo(m_basePath + QDir::cleanPath(directory)).canonicalFilePath();
+        if (!allowed.isEmpty() && (target == allowed || target.startsWith(allowed + '/'))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Connection::openForReceiving(QFile *file, bool replace)
+{
+    // Never through a symlink, whoever left it there could point it anywhere
+#ifdef Q_OS_LINUX
+    const int flags = O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC | (replace ? O_TRUNC : O_EXCL);
+    const int fd = ::open(QFile::encodeName(file->fileName()).constData(), flags, 0666);
+    if (fd < 0) {
+        qWarning() << "Failed to open" << file->fileName() << strerror(errno);
+        return false;
+    }
+    if (!file->open(fd, QIODevice::WriteOnly, QFileDevice::AutoCloseHandle)) {
+        ::close(fd);
+        return false;
+    }
+    return true;
+#else
+    if (QFileInfo(file->fileName()).isSymLink()) {
+        qWarning() << "Refusing to write through symlink" << file->fileName();
+        return false;
+    }
+    return file->open(replace ? QIODevice::WriteOnly : QIODevice::WriteOnly | QIODevice::NewOnly);
+#endif
+}
+
+bool Connection::replaceFile(const QString &from, const QString &to)
+{
+    // Atomic on POSIX, elsewhere it won't replace an existing file
+    if (std::rename(QFile::encodeName(from).constData(), QFile::encodeName(to).constData()) == 0) {
+        return true;
+    }
+    QFile::remove(to);
+    return QFile::rename(from, to);
+}
+
+void Connection::finishBatch()
+{
+    const qint64 elapsed = qMax<qint64>(1, m_batchTimer.elapsed());
+    qDebug() << (m_isServer ? "Received" : "Sent") << m_batchFiles << "files," << m_batchBytes << "bytes in" << elapsed << "ms,"
+             << (m_batchBytes / 1024. / 1024.) / (elapsed / 1000.) << "MB/s";
+}
+
+void Connection::startScreenView()
+{
+    connect(m_socket, &QSslSocket::readyRead, this, &Connection::onReadyRead, Qt::UniqueConnection);
+
+    QJsonObject request;
+    request["command"] = "screenview";
+    writeScheduled(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
+
+    m_screenStatsTimer.start();
+}
+
+void Connection::allowScreenView()
+{
+    if (!m_screenViewRequested || !m_socket->isEncrypted()) {
+        return;
+    }
+    serveScreenView();
+}
+
+void Connection::serveScreenView()
+{
+    if (m_screenCapture) {
+        return;
+    }
+
+    m_screenCapture = new ScreenCapture(this);
+    if (!m_screenCapture->open()) {
+        delete m_screenCapture;
+        return;
+    }
+    qDebug() << "Serving screen view" << m_screenCapture->size() << "to" << m_address;
+    emit screenViewChanged(true);
+
+    startFlow(TransferScheduler::Interactive);
+
+    m_screenTimer = new QTimer(this);
+    m_screenTimer->setInterval(1000 / ScreenCapture::frameRate);
+    connect(m_screenTimer.data(), &QTimer::timeout, this, &Connection::sendScreenFrame);
+    m_screenTimer->start();
+
+    m_screenStatsTimer.start();
+}
+
+void Connection::sendScreenFrame()
+{
+    // Frames are diffed against what the other side has, so rather than
+    // pile up on a slow link we wait until the last one is out
+    if (m_socket->bytesToWrite() > 0) {
+        return;
+    }
+
+    int dirtyTiles = 0;
+    const QByteArray frame = m_screenCapture->nextFrame(&dirtyTiles);
+    if (!frame.isEmpty()) {
+        writeScheduled(frame);
+
+        m_screenFrames++;
+        m_screenBytes += frame.size();
+        m_screenTiles += dirtyTiles;
+    }
+
+    logScreenStats(m_screenStatsTimer.elapsed());
+}
+
+void Connection::receiveScreenFrames()
+{
+    while (true) {
+        if (m_screenPayload < 0) {
+            if (!m_socket->canReadLine()) {
+                return;
+            }
+
+            QJsonParseError parseError;
+            const QByteArray line = m_socket->readLine();
+            m_screenHeader = QJsonDocument::fromJson(line, &parseError).object();
+            if (parseError.error != QJsonParseError::NoError) {
+                qWarning() << "Failed to parse screen frame header" << parseError.errorString();
+                m_socket->disconnectFromHost();
+                return;
+            }
+
+            m_screenPayload = 0;
+            for (const QJsonValue &tile : m_screenHeader["tiles"].toArray()) {
+                const int length = tile.toArray().at(2).toInt(-1);
+                if (length < 0) {
+                    qWarning() << "Invalid screen tile length" << tile;
+                    m_socket->disconnectFromHost();
+                    return;
+                }
+                m_screenPayload += length;
+            }
+            m_screenBytes += line.size();
+        }
+
+        if (m_socket->bytesAvailable() < m_screenPayload) {
+            return;
+        }
+
+        if (!applyScreenFrame()) {
+            m_socket->disconnectFromHost();
+            return;
+        }
+
+        m_screenFrames++;
+        m_screenBytes += m_screenPayload;
+        m_screenTiles += m_screenHeader["tiles"].toArray().count();
+        m_screenPayload = -1;
+
+        emit screenUpdated(m_screen);
+        logScreenStats(m_screenStatsTimer.elapsed());
+    }
+}
+
+bool Connection::applyScreenFrame()
+{
+    const QSize size(m_screenHeader["width"].toInt(), m_screenHeader["height"].toInt());
+    if (size.isEmpty() || size.width() > maxScreenSize || size.height() > maxScreenSize ||
+            m_screenHeader["tileSize"].toInt() != ScreenCapture::tileSize) {
+        qWarning() << "Invalid screen frame" << size << m_screenHeader["tileSize"];
+        return false;
+    }
+
+    if (m_screen.size() != size) {
+        m_screen = QImage(size, QImage::Format_RGB32);
+        if (m_screen.isNull()) {
+            qWarning() << "Failed to allocate screen image" << size;
+            return false;
+        }
+        m_screen.fill(Qt::black);
+    }
+
+    const int columns = (size.width() + ScreenCapture::tileSize - 1) / ScreenCapture::tileSize;
+    const int rows = (size.height() + ScreenCapture::tileSize - 1) / ScreenCapture::tileSize;
+    for (const QJsonValue &value : m_screenHeader["tiles"].toArray()) {
+        const QJsonArray tile = value.toArray();
+        const int column = tile.at(0).toInt(-1);
+        const int row = tile.at(1).toInt(-1);
+        if (column < 0 || column >= columns || row < 0 || row >= rows) {
+            qWarning() << "Screen tile outside of screen" << column << row << size;
+            return false;
+        }
+        const QRect rect = ScreenCapture::tileRect(column, row, size);
+        const QByteArray pixels = qUncompress(m_socket->read(tile.at(2).toInt()));
+
+        const int rowBytes = rect.width() * 4;
+        if (rect.isEmpty() || pixels.size() != rowBytes * rect.height()) {
+            qWarning() << "Invalid screen tile" << rect << pixels.size();
+            return false;
+        }
+
+        for (int y=0; y<rect.height(); y++) {
+            memcpy(m_screen.scanLine(rect.y() + y) + rect.x() * 4, pixels.constData() + y * rowBytes, size_t(rowBytes));
+        }
+    }
+
+    return true;
+}
+
+void Connection::logScreenStats(qint64 elapsed)
+{
+    if (elapsed < 5000) {
+        return;
+    }
+
+    const double seconds = elapsed / 1000.;
+    qDebug() << "Screen view:" << m_screenFrames / seconds << "fps,"
+             << (m_screenFrames ? m_screenBytes / m_screenFrames : 0) << "bytes and"
+             << (m_screenFrames ? m_screenTiles / m_screenFrames : 0) << "tiles per frame";
+
+    m_screenFrames = 0;
+    m_screenBytes = 0;
+    m_screenTiles = 0;
+    m_screenStatsTimer.restart();
 }
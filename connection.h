@@ -4,9 +4,19 @@
 #include <QObject>
 #include <QPointer>
 #include <QSslSocket>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QImage>
+#include <QJsonObject>
+#include <QHash>
 
-#include "host.h"
+#include "hosttable.h"
+#include "transferscheduler.h"
 #include "mousebutton.h"
+#include "largefileio.h"
+#include "smallfilereader.h"
+#include "chunksizer.h"
+#include "transferprogress.h"
 
 class QSslSocket;
 class QSslKey;
@@ -14,10 +24,27 @@ class QSslCertificate;
 class ConnectionHandler;
 class QFile;
 class QTimer;
+class ScreenCapture;
+class InotifyWatcher;
+class QFileInfo;
 
 class Connection : public QObject
 {
     Q_OBJECT
+
+    // How much of the next file in a batch to read while the current one drains
+    static constexpr qint64 uploadReadAhead = 256 * 1024;
+
+    static constexpr int watchBatchDelay = 250; // ms, changes to a watched directory are collected for this long
+    static constexpr int maxWatchBatch = 1000; // more changes than this and they just list it again
+
+    static constexpr qint64 maxRangeLength = 4 * 1024 * 1024; // most one read request gets
+    static constexpr qint64 rangeReadAhead = 4 * 1024 * 1024; // what the kernel is told to pull in after each range
+
+    static constexpr int uploadAckTimeout = 30000; // ms, for the receiver to confirm a batch after the last file
+
+    static constexpr int maxScreenSize = 16384; // px, widest or tallest remote screen we allocate for
+
 public:
     enum Type {
         Incoming,
@@ -25,50 +52,211 @@ public:
         SendListing,
         ReceiveFile,
         SendMouseControl,
-        SendFile
+        SendFile,
+        FetchCertificate,
+        SendStatus,
+        ReadRanges
     };
     Q_ENUM(Type)
 
     explicit Connection(ConnectionHandler *parent);
     ~Connection();
 
-    void download(const Host &host, const QString &remotePath, const QString &localPath);
-    void upload(const Host &host, const QString &remotePath, const QString &localPath);
-    void list(const Host &host, const QString &remotePath);
-    void initiateMouseControl(const Host &host);
+    void download(HostId host, const QString &remotePath, const QString &localPath, qint64 size = 0);
+    // With a sync root, names are sent relative to it and replace what the other side has
+    void upload(HostId host, const QString &remoteDirectory, const QStringList &localPaths, const QString &syncRoot = QString());
+    void list(HostId host, const QString &remotePath);
+
+    // Stays open for any number of listings, each answered with listingReceived()
+    void openListingSession(HostId host);
+    void requestListing(const QString &path, bool prefetch = false);
+
+    // Replaces what the session watches, changes come as directoryChanged()
+    void watchDirectory(const QString &path);
+
+    // Stays open for reading parts of files, each answered with rangeReceived(), rangeBusy() or rangeFailed().
+    // Prefetched ranges are sent as bulk traffic, the others as interactive.
+    void openReadSession(HostId host);
+    void requestRange(const QString &path, qint64 offset, qint64 length, bool prefetch = false);
+    void initiateMouseControl(HostId host);
+    void fetchCertificate(const QHostAddress &address, const QByteArray &fingerprint);
+    void accept(qintptr socketDescriptor);
 
     bool isConnected() const;
 
+    // Set before the connection is moved to its worker thread
+    void setProgressCounter(const QSharedPointer<TransferCounter> &counter) { m_progress = counter; }
+
     QSslSocket *socket() const { return m_socket; }
 
 public slots:
+    void cancel();
     void sendMouseClickEvent(const QPoint &position, const MouseButton button);
     void sendMouseMoveEvent(const QPoint &position);
+    void sendKeyEvent(quint32 keysym, bool pressed);
+    void startScreenView();
+
+    // The local user said yes to screenViewRequested()
+    void allowScreenView();
 
 signals:
     void listingReceived(const QString &path, const QStringList &name);
+
+    // Entries are listing lines for what was added or changed, removed are names
+    void directoryChanged(const QString &path, const QStringList &entries, const QStringList &removed);
+    void directoryNeedsRelist(const QString &path);
+
+    // fileSize is the whole file, data is short at the end of it
+    void rangeReceived(const QString &path, qint64 offset, const QByteArray &data, qint64 fileSize);
+    void rangeFailed(const QString &path, qint64 offset);
+
+    // The other side is serving too many transfers, ask for it again after retryAfter ms
+    void rangeBusy(const QString &path, qint64 offset, int retryAfter);
     void connectionEstablished(Connection *who);
+    void certificateReceived(const QByteArray &fingerprint, const QSslCertificate &certificate);
+
+    // Sessions also emit it, and delete themselves, when they fail to connect
     void disconnected();
-    void bytesTransferred(qint64 bytes);
+    void fileStarted(const QString &name, int index, int count);
+
+    // What the sending side settled on, rtt in microseconds and rate in bytes per second
+    void sendStatsChanged(qint64 chunkSize, qint64 sendBufferSize, int rtt, qint64 drainRate);
+
+    // The other side is serving too many transfers, try again later
+    void busy(int retryAfter);
+
+    // The receiver confirmed every file of an upload batch is in place,
+    // or with older versions, every file is sent
+    void uploadCompleted();
 
-    void mouseMoveRequested(const QPoint &position);
-    void mouseClickRequested(const QPoint &position, const MouseButton button);
+    // The whole remote screen, after applying the tiles that changed
+    void screenUpdated(const QImage &screen);
+
+    // Someone wants to see our screen, nothing is captured until allowScreenView()
+    void screenViewRequested(Connection *who, const QString &hostName);
+    void screenViewChanged(bool serving);
 
 private slots:
     void onEncrypted();
     void onError();
     void onDisconnected();
+    void onConnectFailed();
     void onReadyRead();
     void onBytesWritten(qint64 bytes);
 
 private:
-    void handleCommand(const QString &command, QString path);
-    void handleMouseCommand(const QString &command, const QJsonObject &data);
+    void connectToHost(HostId host);
+    void startFlow(TransferScheduler::Priority priority);
+    void retrySendLater(int delay);
+    void writeScheduled(const QByteArray &data);
+    void handleCommand(const QString &command, QString path, const QJsonObject &request);
+    void sendStatus(const QString &status, int retryAfter = 0, QJsonObject response = QJsonObject());
+    static QByteArray statusLine(const QString &status, int retryAfter = 0, QJsonObject response = QJsonObject());
+    bool readStatus();
+    bool applyStatus(const QJsonObject &response);
+    QByteArray readFile(qint64 maxSize);
+    bool atEndOfFile() const;
+    bool openForSending();
+    void startSparseSend();
+    QByteArray readSparse(qint64 maxSize);
+    bool writeSparse();
+    void updateChunkSize(qint64 bytesWritten);
+    void countProgress(qint64 bytes) { if (m_progress) m_progress->add(bytes); }
+    void sendUploadChunk();
+    bool openNextUpload();
+    void sendUploadHeader(const QString &path);
+    void prefetchNextUpload();
+    void receiveUpload();
+    void receiveUploadAck();
+    void receiveListings();
+    void receiveRanges();
+    void serveRange(const QString &path, const QJsonObject &request);
+    void sendRange(const QByteArray &response, bool prefetch);
+    void sendOutgoing(qint64 written = 0);
+    void sendSessionRequest(const QJsonObject &request);
+    void receiveDirectoryChanges(const QJsonObject &delta);
+    QString resolvePath(const QString &remotePath) const; // empty if outside our home directory
+    QString listingLine(const QFileInfo &info, bool withSizes);
+    void startWatching(const QString &remotePath, bool withSizes);
+    void sendDirectoryChanges();
+    bool startReceivingFile();
+    void finishBatch();
+    bool isSyncTarget(const QString &path) const;
+    static bool replaceFile(const QString &from, const QString &to);
+    static bool openForReceiving(QFile *file, bool replace);
+    void handleInputCommand(const QString &command, const QJsonObject &data);
+    void serveScreenView();
+    void sendScreenFrame();
+    void receiveScreenFrames();
+    bool applyScreenFrame();
+    void logScreenStats(qint64 elapsed);
 
     QPointer<QFile> m_file;
+    LargeFileIo m_largeIo;
+    int m_sharedReader = -1; // downloads read through the handler's SharedReadCache
+    ChunkSizer m_chunkSizer;
+    QSharedPointer<TransferCounter> m_progress;
+    qint64 m_expectedSize = 0;
+
+    // Batch uploads, one header line and the data for each file
+    QStringList m_uploadPaths;
+    int m_uploadIndex = 0;
+    QPointer<QFile> m_nextFile;
+    QByteArray m_readAhead;
+    SmallFileReader m_smallFiles;
+    bool m_uploadInMemory = false; // the whole file is in m_readAhead
+    qint64 m_fileRemaining = 0;
+    bool m_uploadDone = false;
+    QString m_syncRoot;
+    bool m_syncUpload = false; // receiving side, may create directories and replace files
+    QString m_syncTarget; // what the file being received replaces when it is complete
+    int m_batchFiles = 0;
+    int m_batchFailed = 0; // received, but couldn't be put in place
+    bool m_ackBatch = false; // receiving side, they want to hear that it is stored
+    bool m_peerAcks = false; // sending side, the receiver will confirm the batch
+    qint64 m_batchBytes = 0;
+    QElapsedTimer m_batchTimer;
+
+    // Listing sessions, answers come in the order they were asked for
+    bool m_keepAlive = false;
+    bool m_sessionReady = false;
+    QByteArray m_unsentRequests;
+    QStringList m_listingPaths;
+    QStringList m_listingEntries;
+
+    // Read sessions, the same way
+    struct RangeRequest {
+        QString path;
+        qint64 offset;
+        qint64 length;
+    };
+    QList<RangeRequest> m_rangeRequests;
+    QByteArray m_rangeData;
+    qint64 m_rangeRemaining = -1; // -1 until we have the status line
+    qint64 m_rangeFileSize = 0;
+    QByteArray m_outgoing; // serving side, read ahead and listings waiting for the scheduler
+
+    // What the other side is looking at, changes to it are pushed in batches
+    QPointer<InotifyWatcher> m_watcher;
+    QPointer<QTimer> m_watchTimer;
+    QString m_watchedPath;
+    QString m_watchedRemotePath;
+    bool m_watchSizes = false;
+    QHash<QString, bool> m_watchChanges; // name -> is a directory
+    bool m_watchTruncated = false;
+
+    // Sparse files are sent as data and hole records, see SparseFile
+    bool m_sparse = false;
+    bool m_peerTakesSparse = false; // the receiver of our upload said it understands records
+    qint64 m_sparseSize = 0;
+    qint64 m_sparsePosition = 0;
+    qint64 m_sparseDataRemaining = 0; // of the data record being sent
+    qint64 m_recordRemaining = 0; // of the data record being received
 
     QPointer<QSslSocket> m_socket = nullptr;
-    Host m_host;
+    HostId m_hostId = InvalidHostId;
+    QHostAddress m_address;
+    QByteArray m_expectedFingerprint;
     QPointer<ConnectionHandler> m_handler;
     Type m_type = Incoming;
     QString m_remotePath;
@@ -76,6 +264,29 @@ private:
     QString m_basePath;
 
     QPointer<QTimer> m_timeoutTimer;
+    QElapsedTimer m_setupTimer;
+
+    int m_flow = -1;
+    TransferScheduler::Priority m_flowPriority = TransferScheduler::Bulk;
+    bool m_retryPending = false;
+
+    bool m_isServer = false;
+    bool m_admitted = false;
+    bool m_gotStatus = false;
+    bool m_sending = false;
+    bool m_injectedKeys = false;
+
+    // Screen view, captured on the side being controlled
+    bool m_screenViewRequested = false;
+    QPointer<ScreenCapture> m_screenCapture;
+    QPointer<QTimer> m_screenTimer;
+    QJsonObject m_screenHeader;
+    qint64 m_screenPayload = -1; // -1 while waiting for a header
+    QImage m_screen;
+    QElapsedTimer m_screenStatsTimer;
+    int m_screenFrames = 0;
+    qint64 m_screenBytes = 0;
+    qint64 m_screenTiles = 0;
 };
 
 #endif // CONNECTION_H
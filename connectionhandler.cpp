@@ -2,18 +2,27 @@
 
 #include "common.h"
 #include "connection.h"
+#include "cipherpreference.h"
+#include "largefileio.h"
 
 #include <openssl/x509.h>
 #include <openssl/pem.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <memory>
+#include <cstring>
+#include <algorithm>
+#include <functional>
 
 #include <QMessageBox>
 #include <QSettings>
 #include <QHostInfo>
-#include <QNetworkInterface>
 #include <QSslSocket>
+#include <QThread>
+#include <QtEndian>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTextStream>
 
 extern "C" {
 #include <unistd.h>
@@ -27,10 +36,20 @@ ConnectionHandler::ConnectionHandler(QObject *parent) : QTcpServer(parent)
     if (m_certificate.isNull() || m_key.isNull()) {
         generateKey();
     }
+    m_digest = Host::fingerprintOf(m_certificate);
 
-    m_pingTimer.setInterval(1000);
-    connect(&m_pingTimer, &QTimer::timeout, this, &ConnectionHandler::sendPing);
-    m_pingTimer.start();
+    // KiB/s, 0 is unlimited
+    m_transferScheduler.setGlobalRate(settings.value("bandwidth/global", 0).toLongLong() * 1024);
+    m_transferScheduler.setPerHostRate(settings.value("bandwidth/perhost", 0).toLongLong() * 1024);
+
+    m_maxTransfers = settings.value("transfers/global", 20).toInt();
+    m_maxTransfersPerHost = settings.value("transfers/perhost", 4).toInt();
+
+    LargeFileIo::loadSettings();
+
+    connect(&m_beaconScheduler, &BeaconScheduler::sendBeacon, this, &ConnectionHandler::sendPing);
+    connect(&m_localAddresses, &LocalAddresses::changed, &m_beaconScheduler, &BeaconScheduler::onNetworkChanged);
+    connect(&m_inputInjector, &InputInjector::inputInjected, this, &ConnectionHandler::remoteInputActive);
 
     m_pingSocket.bind(PING_PORT, QUdpSocket::ShareAddress);
 
@@ -41,23 +60,42 @@ ConnectionHandler::ConnectionHandler(QObject *parent) : QTcpServer(parent)
     for (const QString &certhash : settings.childGroups()) {
         settings.beginGroup(certhash);
 
-        Host host;
+        Host host(QSslCertificate(settings.value("certificate").toByteArray()));
         host.name = settings.value("name").toString();
         host.address = QHostAddress(settings.value("address").toString());
-        host.certificate = QSslCertificate(settings.value("certificate").toByteArray());
         host.trusted = true;
-        m_trustedHosts.append(host);
+        if (!host.certificate.isNull()) {
+            m_hosts.insert(host);
+        }
 
         settings.endGroup();
     }
+    updateTrustedCertificates();
+
+    const int workerCount = qMax(1, QThread::idealThreadCount());
+    for (int i=0; i<workerCount; i++) {
+        QThread *worker = new QThread(this);
+        worker->setObjectName(QStringLiteral("Connection worker %1").arg(i));
+        worker->start();
+        m_workers.append(worker);
+        m_workerLoad.append(0);
+    }
 
     listen(QHostAddress::Any, TRANSFER_PORT);
 
-    QMetaObject::invokeMethod(this, &ConnectionHandler::sendPing);
+    m_beaconScheduler.start();
 }
 
 ConnectionHandler::~ConnectionHandler()
 {
+    // Connections still on them are deleted as they finish, while we are still here for them
+    for (QThread *worker : m_workers) {
+        worker->quit();
+    }
+    for (QThread *worker : m_workers) {
+        worker->wait();
+    }
+
     m_pingSocket.close();
 
     if (m_pingSocket.state() != QAbstractSocket::UnconnectedState) {
@@ -65,8 +103,14 @@ ConnectionHandler::~ConnectionHandler()
     }
 }
 
-void ConnectionHandler::trustHost(const Host &host)
+void ConnectionHandler::trustHost(HostId id)
 {
+    const Host host = m_hosts.host(id);
+    if (host.certificate.isNull()) {
+        qWarning() << "Asked to trust invalid host" << id;
+        return;
+    }
+
     QSettings settings;
     settings.beginGroup("trusted");
     settings.beginGroup(host.certificate.digest(QCryptographicHash::Sha3_224));
@@ -74,6 +118,10 @@ void ConnectionHandler::trustHost(const Host &host)
     settings.setValue("name", host.name);
     settings.setValue("address", host.address.toString());
     settings.setValue("certificate", host.certificate.toPem());
+
+    m_hosts.setTrusted(id, true);
+
+    updateTrustedCertificates();
 }
 
 const QSslCertificate &ConnectionHandler::ourCertificate() const
@@ -81,78 +129,325 @@ const QSslCertificate &ConnectionHandler::ourCertificate() const
     return m_certificate;
 }
 
-const QList<QSslCertificate> ConnectionHandler::trustedCertificates() const
+const QList<QSslCertificate> &ConnectionHandler::trustedCertificates() const
 {
-    QList<QSslCertificate> certs;
-    for (const Host &trustedHost : m_trustedHosts) {
-        certs.append(trustedHost.certificate);
-    }
+    return m_trustedCertificates;
+}
+
+void ConnectionHandler::updateTrustedCertificates()
+{
+    m_trustedCertificates = m_hosts.trustedCertificates();
+
+    updateSslConfiguration();
+}
+
+void ConnectionHandler::updateSslConfiguration()
+{
+    m_sslConfiguration = buildSslConfiguration(m_certificate, m_key, m_trustedCertificates);
+}
 
-    return certs;
+QSslConfiguration ConnectionHandler::buildSslConfiguration(const QSslCertificate &certificate, const QSslKey &key, const QList<QSslCertificate> &trusted)
+{
+    QSslConfiguration config = QSslConfiguration::defaultConfiguration();
+    config.setProtocol(QSsl::TlsV1_2OrLater);
+    config.setCiphers(CipherPreference::order(config.ciphers()));
+    // Whoever connects ordered them for their own CPU, a server with AES instructions would
+    // otherwise pick AES-GCM for a client without them
+    config.setSslOption(QSsl::SslOptionDisableServerCipherPreference, true);
+    config.setCaCertificates(trusted);
+    config.setLocalCertificate(certificate);
+    config.setPrivateKey(key);
+
+    return config;
 }
 
-bool ConnectionHandler::isTrusted(const Host &host) const
+namespace {
+
+// Accepts like we do, and times each handshake from there
+class HandshakeBenchmarkServer : public QTcpServer
+{
+public:
+    std::function<QSslConfiguration()> configuration;
+    std::function<void()> onHandshake;
+    QVector<qint64> timings; // usecs
+
+protected:
+    void incomingConnection(qintptr handle) override
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        QSslSocket *socket = new QSslSocket(this);
+        socket->setSslConfiguration(configuration());
+        socket->ignoreSslErrors();
+        if (!socket->setSocketDescriptor(handle)) {
+            qWarning() << "Failed to set descriptor" << handle;
+            delete socket;
+            return;
+        }
+        connect(socket, &QSslSocket::encrypted, this, [=]() {
+            timings.append(timer.nsecsElapsed() / 1000);
+            socket->disconnectFromHost();
+            socket->deleteLater();
+            onHandshake();
+        });
+        socket->startServerEncryption();
+    }
+};
+
+} // namespace
+
+bool ConnectionHandler::runHandshakeBenchmark()
 {
-    for (const Host &trustedHost : m_trustedHosts) {
-        if (trustedHost.certificate == host.certificate) {
-            return true;
+    // What every connection used to do for itself
+    auto loadConfiguration = []() {
+        QSettings settings;
+        const QSslCertificate certificate(settings.value("privcert").toByteArray());
+        const QSslKey key(settings.value("privkey").toByteArray(), QSsl::Ec);
+
+        QList<QSslCertificate> trusted;
+        settings.beginGroup("trusted");
+        for (const QString &certhash : settings.childGroups()) {
+            const QSslCertificate host(settings.value(certhash + "/certificate").toByteArray());
+            if (!host.isNull()) {
+                trusted.append(host);
+            }
         }
+        return buildSslConfiguration(certificate, key, trusted);
+    };
+
+    const QSslConfiguration shared = loadConfiguration();
+    if (shared.localCertificate().isNull() || shared.privateKey().isNull()) {
+        qWarning() << "No key to benchmark with, start it normally once first";
+        return false;
+    }
+
+    HandshakeBenchmarkServer server;
+    if (!server.listen(QHostAddress::LocalHost)) {
+        qWarning() << "Failed to listen on localhost" << server.errorString();
+        return false;
     }
 
-    return false;
+    struct Mode {
+        const char *name;
+        std::function<QSslConfiguration()> configuration;
+    };
+    const Mode modes[] = {
+        { "Shared configuration", [&]() { return shared; } },
+        { "Built per connection", loadConfiguration },
+    };
+
+    QTextStream out(stdout);
+    for (const Mode &mode : modes) {
+        server.configuration = mode.configuration;
+        server.timings.clear();
+
+        for (int i=0; i<benchmarkHandshakes; i++) {
+            QEventLoop loop;
+            server.onHandshake = [&]() { loop.quit(); };
+            QTimer::singleShot(benchmarkHandshakeTimeout, &loop, &QEventLoop::quit);
+
+            QSslSocket client;
+            client.setSslConfiguration(shared);
+            client.ignoreSslErrors();
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 15, 0))
+            connect(&client, &QAbstractSocket::errorOccurred, &loop, &QEventLoop::quit);
+#else
+            connect(&client, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), &loop, &QEventLoop::quit);
+#endif
+            client.connectToHostEncrypted(server.serverAddress().toString(), server.serverPort());
+            loop.exec();
+
+            if (server.timings.count() != i + 1) {
+                qWarning() << "Handshake failed" << client.errorString();
+                return false;
+            }
+            client.abort();
+        }
+
+        std::sort(server.timings.begin(), server.timings.end());
+        out << mode.name << ": "
+            << QString::number(server.timings.first() / 1000., 'f', 2) << " ms min, "
+            << QString::number(server.timings.at(server.timings.count() / 2) / 1000., 'f', 2) << " ms median, "
+            << QString::number(server.timings.last() / 1000., 'f', 2) << " ms max" << '\n';
+        out.flush();
+    }
+
+    return true;
 }
 
 void ConnectionHandler::onClientDisconnected()
 {
     m_activeConnections--;
+}
 
-    if (m_activeConnections < maxConnections && !isListening()) {
-        listen(QHostAddress::Any, TRANSFER_PORT);
+bool ConnectionHandler::tryAdmitTransfer(HostId host, int *retryAfter)
+{
+    QMutexLocker locker(&m_admissionMutex);
+
+    const int forHost = m_admittedPerHost.value(host);
+    if (m_admittedTransfers >= m_maxTransfers || forHost >= m_maxTransfersPerHost) {
+        // Rough guess, the more we're over the longer they should wait
+        *retryAfter = qMin(busyRetryDelay * (1 + forHost), 30000);
+        return false;
     }
+
+    m_admittedTransfers++;
+    m_admittedPerHost[host] = forHost + 1;
+    return true;
+}
+
+void ConnectionHandler::releaseTransfer(HostId host)
+{
+    QMutexLocker locker(&m_admissionMutex);
+
+    m_admittedTransfers--;
+    const int forHost = m_admittedPerHost.value(host) - 1;
+    if (forHost > 0) {
+        m_admittedPerHost[host] = forHost;
+    } else {
+        m_admittedPerHost.remove(host);
+    }
+}
+
+void ConnectionHandler::moveToWorker(Connection *connection)
+{
+    int index = 0;
+    for (int i=1; i<m_workers.count(); i++) {
+        if (m_workerLoad[i] < m_workerLoad[index]) {
+            index = i;
+        }
+    }
+
+    m_workerLoad[index]++;
+    connect(connection, &Connection::destroyed, this, [this, index]() {
+        m_workerLoad[index]--;
+    });
+
+    // Otherwise whatever is still open when we shut down is never destroyed
+    connect(m_workers[index], &QThread::finished, connection, &QObject::deleteLater);
+
+    connection->moveToThread(m_workers[index]);
 }
 
 void ConnectionHandler::incomingConnection(qintptr handle)
 {
     qDebug() << "Got incoming";
-    if (m_activeConnections > maxConnections) {
+
+    // Transfers over the limit get told to come back later, this is just so we don't run out of descriptors
+    if (m_activeConnections >= maxConnections) {
         qWarning() << "Too many open connections";
         ::close(handle);
-
-        if (isListening()) {
-            close();
-        }
         return;
     }
 
     Connection *connection = new Connection(this);
-    if (!connection->socket()->setSocketDescriptor(handle)) {
-        qWarning() << "Failed to set descriptor" << handle;
-        connection->deleteLater();
-        return;
-    }
 
-    connect(connection, &Connection::mouseMoveRequested, this, &ConnectionHandler::mouseMoveRequested);
-    connect(connection, &Connection::mouseClickRequested, this, &ConnectionHandler::mouseClickRequested);
     connect(connection, &Connection::destroyed, this, &ConnectionHandler::onClientDisconnected);
+    connect(connection, &Connection::screenViewRequested, this, &ConnectionHandler::screenViewRequested);
+    connect(connection, &Connection::screenViewChanged, this, &ConnectionHandler::screenViewChanged);
 
-    connection->socket()->startServerEncryption();
-    m_activeConnections++;
+    moveToWorker(connection);
+    QMetaObject::invokeMethod(connection, [connection, handle]() {
+        connection->accept(handle);
+    }, Qt::QueuedConnection);
 
-    if (m_activeConnections > maxConnections) {
-        qWarning() << "Reached max connections, not listening anymore";
-        close();
-        return;
-    }
+    m_activeConnections++;
 }
 
 void ConnectionHandler::sendPing()
 {
-    QByteArray datagram(PING_HEADER);
-    datagram += ';' + QSysInfo::machineHostName().toUtf8();
-    datagram += ';' + m_certificate.toDer().toBase64();
+    QByteArray datagram(PING_HEADER, sizeof(PING_HEADER));
+    datagram += char(PING_VERSION);
+
+    char interval[PING_INTERVAL_SIZE];
+    qToBigEndian<quint16>(quint16(qMin(m_beaconScheduler.interval(), 0xffff)), interval);
+    datagram += QByteArray(interval, PING_INTERVAL_SIZE);
+
+    datagram += m_digest;
+
+    QByteArray hostname = QSysInfo::machineHostName().toUtf8().left(PING_HOSTNAME_SIZE);
+    hostname.append(PING_HOSTNAME_SIZE - hostname.size(), '\0');
+    datagram += hostname;
+
+    Q_ASSERT(datagram.size() == PING_SIZE);
     m_pingSocket.writeDatagram(datagram, QHostAddress::Broadcast, PING_PORT);
 }
 
+void ConnectionHandler::fetchCertificate(const Host &host)
+{
+    if (m_pendingFetches.contains(host.fingerprint) || m_pendingFetches.count() >= maxCertificateFetches) {
+        return;
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // Make room from the ones long gone, but don't go through all of them for every beacon
+    if (m_hosts.count() >= maxHosts) {
+        if (now - m_lastEviction < evictionInterval) {
+            return;
+        }
+        m_lastEviction = now;
+        const QVector<HostId> evicted = m_hosts.evictExpired(now);
+        qDebug() << "Host table full, evicted" << evicted.count() << "hosts";
+        if (evicted.isEmpty()) {
+            return;
+        }
+
+        // Nothing may still be kept for them when the ids go to someone else
+        for (const HostId id : evicted) {
+            m_transferScheduler.forgetHost(id);
+        }
+        {
+            QMutexLocker locker(&m_admissionMutex);
+            for (const HostId id : evicted) {
+                m_admittedPerHost.remove(id);
+            }
+        }
+        emit hostsEvicted(evicted);
+        m_hosts.releaseEvicted();
+    }
+    if (now - m_failedFetches.value(host.fingerprint, 0) < fetchRetryDelay) {
+        return;
+    }
+
+    const QByteArray fingerprint = host.fingerprint;
+    m_pendingFetches.insert(fingerprint, host);
+
+    Connection *connection = new Connection(this);
+    connect(connection, &Connection::certificateReceived, this, &ConnectionHandler::onCertificateFetched);
+    connect(connection, &Connection::destroyed, this, [this, fingerprint]() {
+        if (m_pendingFetches.remove(fingerprint)) {
+            m_failedFetches.insert(fingerprint, QDateTime::currentMSecsSinceEpoch());
+        }
+    });
+    connection->fetchCertificate(host.address, fingerprint);
+}
+
+void ConnectionHandler::onCertificateFetched(const QByteArray &fingerprint, const QSslCertificate &certificate)
+{
+    Host host = m_pendingFetches.take(fingerprint);
+    if (host.fingerprint.isEmpty()) {
+        qWarning() << "Got certificate we didn't ask for";
+        return;
+    }
+
+    if (certificate.isNull() || Host::fingerprintOf(certificate) != fingerprint) {
+        qWarning() << "Certificate from" << host.address << "does not match the fingerprint it announced";
+        m_failedFetches.insert(fingerprint, QDateTime::currentMSecsSinceEpoch());
+        return;
+    }
+    m_failedFetches.remove(fingerprint);
+
+    host.certificate = certificate;
+    host.trusted = false; // we would have had it already
+    host.lastSeen = 0;
+
+    const HostId id = m_hosts.insert(host);
+
+    const QByteArray name = host.name.toUtf8();
+    onBeaconFrom(id, name.constData(), name.size(), host.address, host.beaconInterval);
+}
 
 using BN_ptr = std::unique_ptr<BIGNUM, decltype(&::BN_free)>;
 using EC_KEY_ptr = std::unique_ptr<EC_KEY, decltype(&::EC_KEY_free)>;
@@ -228,69 +523,71 @@ void ConnectionHandler::generateKey()
 
 void ConnectionHandler::onDatagram()
 {
-    QList<QHostAddress> ourAddresses = QNetworkInterface::allAddresses();
-    while (m_pingSocket.hasPendingDatagrams()) {
-        QByteArray datagram;
-        datagram.resize(m_pingSocket.pendingDatagramSize());
+    // One too big, so we can tell if it was truncated
+    char datagram[PING_SIZE + 1];
 
+    while (m_pingSocket.hasPendingDatagrams()) {
         QHostAddress sender;
-        m_pingSocket.readDatagram(datagram.data(), datagram.size(), &sender);
+        const qint64 size = m_pingSocket.readDatagram(datagram, sizeof(datagram), &sender);
 
-        if (!datagram.startsWith(PING_HEADER)) {
+        if (size < qint64(sizeof(PING_HEADER)) || memcmp(datagram, PING_HEADER, sizeof(PING_HEADER)) != 0) {
             qDebug() << "Invalid header";
             continue;
         }
 
-        // Convoluted because QHostAddress doesn't handle ipv6 stuff nicely by default
-        bool isOurs = false;
-        for (const QHostAddress &address : ourAddresses) {
-            if (address.isEqual(sender, QHostAddress::TolerantConversion)) {
-                isOurs = true;
-                break;
-            }
-        }
-
-        if (isOurs) {
+        if (m_localAddresses.contains(sender)) {
 //            qDebug() << "Got ping from ourselves";
             continue;
         }
 
-        datagram.remove(0, sizeof(PING_HEADER));
-
-        QList<QByteArray> parts = datagram.split(';');
-        if (parts.count() != 2) {
+        if (size != PING_SIZE || datagram[sizeof(PING_HEADER)] != char(PING_VERSION)) {
             qDebug() << "Invalid structure";
             continue;
         }
 
-        const QString hostname = QString::fromUtf8(parts[0]);
-        const QByteArray certEncoded = QByteArray::fromBase64(parts[1]);
+        m_beaconScheduler.onBeaconReceived();
 
-        Host host;
-        host.lastSeen = QDateTime::currentDateTime();
-        host.offline = false;
-        host.name = hostname;
-        host.address = sender;
-        host.certificate = QSslCertificate(certEncoded, QSsl::Der);
+        const char *interval = datagram + sizeof(PING_HEADER) + 1;
+        const char *fingerprint = interval + PING_INTERVAL_SIZE;
+        const char *hostname = fingerprint + PING_FINGERPRINT_SIZE;
+        const int hostnameLength = qstrnlen(hostname, PING_HOSTNAME_SIZE);
+        const int beaconInterval = qFromBigEndian<quint16>(interval);
 
-        if (host.certificate.isNull()) {
-            qDebug() << "Invalid certificate";
+        if (memcmp(fingerprint, m_digest.constData(), PING_FINGERPRINT_SIZE) == 0) {
             continue;
         }
 
-        if (m_trustedHosts.contains(host)) {
-            host.trusted = true;
+        const HostId id = m_hosts.find(fingerprint, PING_FINGERPRINT_SIZE);
+        if (id != InvalidHostId) {
+            onBeaconFrom(id, hostname, hostnameLength, sender, beaconInterval);
+            continue;
         }
 
-        emit pingFromHost(host);
+        // Unknown, go get the full certificate over TCP and announce the host when we have it
+        Host host;
+        host.name = QString::fromUtf8(hostname, hostnameLength);
+        host.address = sender;
+        host.fingerprint = QByteArray(fingerprint, PING_FINGERPRINT_SIZE);
+        host.beaconInterval = beaconInterval;
+        fetchCertificate(host);
+    }
+}
+
+void ConnectionHandler::onBeaconFrom(HostId id, const char *name, int nameLength, const QHostAddress &address, int beaconInterval)
+{
+    const int changes = m_hosts.updateSeen(id, name, nameLength, address, beaconInterval, QDateTime::currentMSecsSinceEpoch());
+
+    if (changes & HostTable::Returned) {
+        // New or came back, let everyone know quickly
+        m_beaconScheduler.onNetworkChanged();
 
-        if (host.trusted) {
-            // respond, do it here because we know it was an authenticated request so we can't be dosed
-            sendPing();
-            // Delay the next ping
-            m_pingTimer.start();
+        if (m_hosts.isTrusted(id)) {
+            // respond so it finds us quickly, only for trusted so we can't be dosed
+            m_beaconScheduler.requestReply();
         }
     }
+
+    emit pingFromHost(id, changes);
 }
 
 void ConnectionHandler::onClientError()
@@ -3,59 +3,134 @@
 
 #include <QSslCertificate>
 #include <QSslKey>
+#include <QSslConfiguration>
 #include <QUdpSocket>
 #include <QTimer>
 #include <QTcpServer>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QMutex>
 
+#include "beaconscheduler.h"
 #include "host.h"
-#include "mousebutton.h"
+#include "hosttable.h"
+#include "transferscheduler.h"
+#include "localaddresses.h"
+#include "inputinjector.h"
+#include "sharedreadcache.h"
+#include "directorysizes.h"
 
 class Connection;
 class QTcpServer;
+class QThread;
 
 class ConnectionHandler : public QTcpServer
 {
     Q_OBJECT
 
-    static constexpr int maxConnections = 20;
+    static constexpr int maxConnections = 256;
+    static constexpr int busyRetryDelay = 2000; // ms
+    static constexpr int maxCertificateFetches = 8;
+    static constexpr int maxHosts = 65536;
+    static constexpr int fetchRetryDelay = 30000; // ms
+    static constexpr int evictionInterval = 10000; // ms, between looking for hosts to evict when full
+    static constexpr int benchmarkHandshakes = 50; // per configuration
+    static constexpr int benchmarkHandshakeTimeout = 5000; // ms
 
 public:
     ConnectionHandler(QObject *parent);
     ~ConnectionHandler();
 
-    void trustHost(const Host &host);
+    void trustHost(HostId id);
+
+    HostTable &hosts() { return m_hosts; }
+    const HostTable &hosts() const { return m_hosts; }
+
+    TransferScheduler &transferScheduler() { return m_transferScheduler; }
+    InputInjector &inputInjector() { return m_inputInjector; }
+    SharedReadCache &readCache() { return m_readCache; }
+    DirectorySizes &directorySizes() { return m_directorySizes; }
+
+    // Limits how many transfers we serve at once, called from the workers
+    bool tryAdmitTransfer(HostId host, int *retryAfter);
+    void releaseTransfer(HostId host);
 
     const QSslCertificate &ourCertificate() const;
-    const QList<QSslCertificate> trustedCertificates() const;
+    const QList<QSslCertificate> &trustedCertificates() const;
+    const QSslConfiguration &sslConfiguration() const { return m_sslConfiguration; }
+
+
+    // Hands the connection over to the least loaded worker thread
+    void moveToWorker(Connection *connection);
 
-    const Host hostWithCert(const QSslCertificate &cert) const;
-    bool isTrusted(const Host &host) const;
+    // Times TLS handshakes over localhost from accept to encrypted, with the
+    // shared configuration and with one built for each connection
+    static bool runHandshakeBenchmark();
 
 protected:
     void incomingConnection(qintptr handle) override;
 
 signals:
-    void pingFromHost(const Host &host);
+    // changes is HostTable::SeenResult flags
+    void pingFromHost(HostId host, int changes);
 
-    void mouseMoveRequested(const QPoint &position);
-    void mouseClickRequested(const QPoint &position, const MouseButton button);
+    // Someone is controlling our mouse or keyboard, at most once a second
+    void remoteInputActive();
+
+    // From the incoming connections, see Connection
+    void screenViewRequested(Connection *who, const QString &hostName);
+    void screenViewChanged(bool serving);
+
+    // Evicted from the host table, drop whatever is kept for them. The ids
+    // are reused for other hosts as soon as this returns, so connect directly.
+    void hostsEvicted(const QVector<HostId> &ids);
 
 private slots:
     void sendPing();
     void onDatagram();
     void onClientError();
     void onClientDisconnected();
+    void onCertificateFetched(const QByteArray &fingerprint, const QSslCertificate &certificate);
 
 private:
     void generateKey();
+    void fetchCertificate(const Host &host);
+    void updateTrustedCertificates();
+    void updateSslConfiguration();
+    static QSslConfiguration buildSslConfiguration(const QSslCertificate &certificate, const QSslKey &key, const QList<QSslCertificate> &trusted);
+    void onBeaconFrom(HostId id, const char *name, int nameLength, const QHostAddress &address, int beaconInterval);
 
     QSslCertificate m_certificate;
     QSslKey m_key;
     QUdpSocket m_pingSocket;
-    QTimer m_pingTimer;
+    LocalAddresses m_localAddresses;
+    BeaconScheduler m_beaconScheduler;
     QByteArray m_digest;
-    QList<Host> m_trustedHosts;
+    HostTable m_hosts;
+    TransferScheduler m_transferScheduler;
+    InputInjector m_inputInjector;
+    SharedReadCache m_readCache;
+    DirectorySizes m_directorySizes;
+    QList<QSslCertificate> m_trustedCertificates;
+
+    // Handed to all new connections, rebuilt when our key or the trusted hosts change
+    QSslConfiguration m_sslConfiguration;
+
+    // Beacons from hosts we don't know the certificate of yet, keyed by fingerprint
+    QHash<QByteArray, Host> m_pendingFetches;
+    QHash<QByteArray, qint64> m_failedFetches; // fingerprint -> msecs since epoch
+    qint64 m_lastEviction = 0; // msecs since epoch
     int m_activeConnections = 0;
+
+    QMutex m_admissionMutex;
+    int m_maxTransfers = 20;
+    int m_maxTransfersPerHost = 4;
+    int m_admittedTransfers = 0;
+    QHash<HostId, int> m_admittedPerHost;
+
+    QVector<QThread*> m_workers;
+    QVector<int> m_workerLoad;
 };
 
 #endif // CONNECTIONHANDLER_H
@@ -0,0 +1,296 @@
+#include "directorysizes.h"
+
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QThread>
+#include <QRunnable>
+#include <QFile>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+#include <sys/stat.h>
+#endif
+
+// 0 if we can't tell, which counts as the same filesystem as anything else
+static quint64 deviceOf(const QString &path)
+{
+#ifdef Q_OS_LINUX
+    struct stat status;
+    if (lstat(QFile::encodeName(path).constData(), &status) == 0) {
+        return quint64(status.st_dev);
+    }
+#else
+    Q_UNUSED(path);
+#endif
+    return 0;
+}
+
+static int userWatchLimit()
+{
+    QFile limit(QStringLiteral("/proc/sys/fs/inotify/max_user_watches"));
+    if (!limit.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    bool ok = false;
+    const int watches = limit.readAll().trimmed().toInt(&ok);
+    return ok ? watches : -1;
+}
+
+class DirectorySizes::ScanTask : public QRunnable
+{
+public:
+    ScanTask(DirectorySizes *sizes, const QString &path) : m_sizes(sizes), m_path(path) {}
+
+    void run() override {
+        // Whoever is downloading comes first
+        QThread::currentThread()->setPriority(QThread::LowestPriority);
+        m_sizes->scan(m_path);
+    }
+
+private:
+    DirectorySizes *m_sizes;
+    QString m_path;
+};
+
+DirectorySizes::DirectorySizes(QObject *parent) : QObject(parent)
+{
+    m_pool.setMaxThreadCount(qBound(1, QThread::idealThreadCount() / 2, 4));
+
+    // The watches are shared with everything else the user runs
+    const int watches = userWatchLimit();
+    if (watches > 0) {
+        m_maxDirectories = qBound(1, watches / watchShare, maxDirectories);
+    }
+
+    m_rescanTimer.setSingleShot(true);
+    m_rescanTimer.setInterval(rescanDelay);
+    connect(&m_rescanTimer, &QTimer::timeout, this, &DirectorySizes::rescanDirty);
+
+    connect(&m_watcher, &InotifyWatcher::changed, this, &DirectorySizes::onChanged);
+    connect(&m_watcher, &InotifyWatcher::overflowed, this, &DirectorySizes::onOverflowed);
+}
+
+DirectorySizes::~DirectorySizes()
+{
+    // The tasks use us
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+DirectorySizes::Total DirectorySizes::lookup(const QString &path, qint64 *bytes, qint64 *files)
+{
+    const QString cleanPath = QDir::cleanPath(path);
+
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_directories.contains(cleanPath)) {
+        *bytes = 0;
+        *files = 0;
+        return schedule(cleanPath) ? Counting : Partial;
+    }
+
+    updateTotal(cleanPath);
+    const Directory &directory = *m_directories.constFind(cleanPath);
+    *bytes = directory.totalBytes;
+    *files = directory.totalFiles;
+    if (directory.totalPending) {
+        return Counting;
+    }
+    return directory.totalPartial ? Partial : Complete;
+}
+
+void DirectorySizes::scan(const QString &path)
+{
+    // Before reading, so nothing that happens in between is missed.
+    // Without a watch we would never hear that it needs counting again.
+    bool partial = !m_watcher.addDirectory(path);
+
+    const quint64 device = deviceOf(path);
+    qint64 bytes = 0;
+    qint64 files = 0;
+    QSet<QString> subdirectories;
+    QDirIterator it(path, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        if (info.isSymLink()) {
+            continue;
+        }
+        if (info.isDir()) {
+            // Mounts below us, network shares or the like, are left out
+            const quint64 subdirectoryDevice = deviceOf(info.absoluteFilePath());
+            if (device && subdirectoryDevice && subdirectoryDevice != device) {
+                partial = true;
+                continue;
+            }
+            subdirectories.insert(info.absoluteFilePath());
+        } else {
+            bytes += info.size();
+            files++;
+        }
+    }
+
+    QMutexLocker locker(&m_mutex);
+
+    QHash<QString, Directory>::iterator directory = m_directories.find(path);
+    if (directory == m_directories.end()) {
+        // Deleted while we were reading it
+        m_watcher.removeDirectory(path);
+        return;
+    }
+
+    const QSet<QString> previous = directory->subdirectories;
+    directory->bytes = bytes;
+    directory->files = files;
+    directory->scanned = true;
+
+    for (const QString &subdirectory : previous) {
+        if (!subdirectories.contains(subdirectory)) {
+            forget(subdirectory);
+        }
+    }
+    QSet<QString> tracked;
+    for (const QString &subdirectory : subdirectories) {
+        if (m_directories.contains(subdirectory) || schedule(subdirectory)) {
+            tracked.insert(subdirectory);
+        } else {
+            partial = true;
+        }
+    }
+
+    // Scheduling can grow the hash
+    directory = m_directories.find(path);
+    directory->subdirectories = tracked;
+    directory->partial = partial;
+
+    invalidate(path);
+}
+
+bool DirectorySizes::schedule(const QString &path)
+{
+    if (m_directories.count() >= m_maxDirectories) {
+        if (!m_warnedFull) {
+            qWarning() << "Tracking sizes of" << m_maxDirectories << "directories already, sizes above" << path << "will stay incomplete";
+            m_warnedFull = true;
+        }
+        return false;
+    }
+
+    m_directories.insert(path, Directory());
+    m_pool.start(new ScanTask(this, path));
+    return true;
+}
+
+void DirectorySizes::updateTotal(const QString &path)
+{
+    QHash<QString, Directory>::const_iterator directory = m_directories.constFind(path);
+    if (directory == m_directories.constEnd() || directory->totalValid) {
+        return;
+    }
+
+    qint64 bytes = directory->bytes;
+    qint64 files = directory->files;
+    bool pending = !directory->scanned;
+    bool partial = directory->partial;
+    const QSet<QString> subdirectories = directory->subdirectories;
+
+    for (const QString &subdirectory : subdirectories) {
+        updateTotal(subdirectory);
+
+        const QHash<QString, Directory>::const_iterator child = m_directories.constFind(subdirectory);
+        if (child == m_directories.constEnd()) {
+            partial = true;
+            continue;
+        }
+        bytes += child->totalBytes;
+        files += child->totalFiles;
+        pending = pending || child->totalPending;
+        partial = partial || child->totalPartial;
+    }
+
+    Directory &updated = m_directories[path];
+    updated.totalBytes = bytes;
+    updated.totalFiles = files;
+    updated.totalPending = pending;
+    updated.totalPartial = partial;
+    updated.totalValid = true;
+}
+
+void DirectorySizes::invalidate(QString path)
+{
+    forever {
+        QHash<QString, Directory>::iterator directory = m_directories.find(path);
+        if (directory == m_directories.end()) {
+            return;
+        }
+        directory->totalValid = false;
+
+        const int separator = path.lastIndexOf('/');
+        if (separator <= 0) {
+            return;
+        }
+        path.truncate(separator);
+    }
+}
+
+void DirectorySizes::forget(const QString &path)
+{
+    QHash<QString, Directory>::iterator directory = m_directories.find(path);
+    if (directory == m_directories.end()) {
+        return;
+    }
+
+    const QSet<QString> subdirectories = directory->subdirectories;
+    m_directories.erase(directory);
+    m_watcher.removeDirectory(path);
+
+    for (const QString &subdirectory : subdirectories) {
+        forget(subdirectory);
+    }
+}
+
+void DirectorySizes::onChanged(const QString &directory, const QString &name, InotifyWatcher::Change change, bool isDirectory)
+{
+    Q_UNUSED(name);
+    Q_UNUSED(isDirectory);
+
+    if (change == InotifyWatcher::DirectoryGone) {
+        QMutexLocker locker(&m_mutex);
+        forget(directory);
+
+        // So the parent isn't missing a piece until it is read again
+        const QString parent = directory.left(directory.lastIndexOf('/'));
+        const QHash<QString, Directory>::iterator parentDirectory = m_directories.find(parent);
+        if (parentDirectory != m_directories.end()) {
+            parentDirectory->subdirectories.remove(directory);
+        }
+        invalidate(parent);
+        return;
+    }
+
+    // Not restarted for every event, so a constant stream of writes still shows up
+    m_dirty.insert(directory);
+    if (!m_rescanTimer.isActive()) {
+        m_rescanTimer.start();
+    }
+}
+
+void DirectorySizes::onOverflowed()
+{
+    QMutexLocker locker(&m_mutex);
+    for (QHash<QString, Directory>::const_iterator it = m_directories.constBegin(); it != m_directories.constEnd(); ++it) {
+        m_dirty.insert(it.key());
+    }
+    m_rescanTimer.start();
+}
+
+void DirectorySizes::rescanDirty()
+{
+    QMutexLocker locker(&m_mutex);
+    for (const QString &path : m_dirty) {
+        if (m_directories.contains(path)) {
+            m_pool.start(new ScanTask(this, path));
+        }
+    }
+    m_dirty.clear();
+}
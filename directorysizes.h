@@ -0,0 +1,89 @@
+#ifndef DIRECTORYSIZES_H
+#define DIRECTORYSIZES_H
+
+#include <QObject>
+#include <QMutex>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QThreadPool>
+
+#include "inotifywatcher.h"
+
+/// Recursive size and file count of the directories we serve, for the
+/// listings. Every directory is read by itself on a thread pool, so big
+/// trees are walked in parallel, and only its own files are summed. The
+/// totals are added up from the cached tree when asked for. inotify keeps
+/// it current, a change only rereads the directory it happened in.
+/// Sizes are what a copy would transfer, not what du counts on disk.
+/// Only one filesystem is walked, mount points below are left out, and
+/// the tree is kept to a share of the inotify watches the user has.
+/// lookup() is called from the connection workers.
+class DirectorySizes : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int rescanDelay = 500; // ms, changes are collected for this long
+    static constexpr int maxDirectories = 500000;
+    static constexpr int watchShare = 4; // we take at most a quarter of fs.inotify.max_user_watches
+
+    enum Total {
+        Complete,
+        Counting, // asking again later gets more
+        Partial // all we'll ever know, parts of the tree are left out
+    };
+
+    explicit DirectorySizes(QObject *parent = nullptr);
+    ~DirectorySizes();
+
+    // Starts counting if we haven't yet. Unless it is Complete, bytes and
+    // files are what we know so far.
+    Total lookup(const QString &path, qint64 *bytes, qint64 *files);
+
+private slots:
+    void onChanged(const QString &directory, const QString &name, InotifyWatcher::Change change, bool isDirectory);
+    void onOverflowed();
+    void rescanDirty();
+
+private:
+    class ScanTask;
+
+    struct Directory {
+        qint64 bytes = 0; // of the files directly in it
+        qint64 files = 0;
+        QSet<QString> subdirectories;
+        bool scanned = false;
+        bool partial = false; // not watched, or subdirectories we left out
+
+        // For the whole tree below, cleared when anything in it changes
+        bool totalValid = false;
+        bool totalPending = false;
+        bool totalPartial = false;
+        qint64 totalBytes = 0;
+        qint64 totalFiles = 0;
+    };
+
+    // Called on the pool
+    void scan(const QString &path);
+
+    // The rest expect m_mutex to be held
+    bool schedule(const QString &path); // false if we're at the limit
+    void updateTotal(const QString &path);
+    void invalidate(QString path);
+    void forget(const QString &path);
+
+    InotifyWatcher m_watcher;
+    QThreadPool m_pool;
+
+    QMutex m_mutex;
+    QHash<QString, Directory> m_directories;
+    int m_maxDirectories = maxDirectories; // each one is a watch
+    bool m_warnedFull = false;
+
+    // Only touched on our thread
+    QSet<QString> m_dirty;
+    QTimer m_rescanTimer;
+};
+
+#endif // DIRECTORYSIZES_H
@@ -12,8 +12,7 @@ TEMPLATE = app
 LIBS += -lcrypto
 
 linux {
-    LIBS +=  -lX11 -lXtst
-    QT += x11extras
+    LIBS +=  -lX11 -lXtst -lXext
 }
 
 # The following define makes your compiler emit warnings if you use
@@ -38,7 +37,28 @@ SOURCES += \
     randomart.cpp \
     connectdialog.cpp \
     mainwindow.cpp \
-    transferdialog.cpp
+    transferdialog.cpp \
+    localaddresses.cpp \
+    beaconscheduler.cpp \
+    hostlistmodel.cpp \
+    hosttable.cpp \
+    transferscheduler.cpp \
+    transferqueue.cpp \
+    largefileio.cpp \
+    chunksizer.cpp \
+    cipherpreference.cpp \
+    transferprogress.cpp \
+    screencapture.cpp \
+    inputinjector.cpp \
+    sparsefile.cpp \
+    sharedreadcache.cpp \
+    listingprefetcher.cpp \
+    inotifywatcher.cpp \
+    directorysizes.cpp \
+    syncfolder.cpp \
+    smallfilereader.cpp \
+    remotefilecache.cpp \
+    mediaserver.cpp
 
 HEADERS += \
         machinelist.h \
@@ -49,4 +69,25 @@ HEADERS += \
     connectdialog.h \
     mainwindow.h \
     host.h \
-    transferdialog.h
+    transferdialog.h \
+    localaddresses.h \
+    beaconscheduler.h \
+    hostlistmodel.h \
+    hosttable.h \
+    transferscheduler.h \
+    transferqueue.h \
+    largefileio.h \
+    chunksizer.h \
+    cipherpreference.h \
+    transferprogress.h \
+    screencapture.h \
+    inputinjector.h \
+    sparsefile.h \
+    sharedreadcache.h \
+    listingprefetcher.h \
+    inotifywatcher.h \
+    directorysizes.h \
+    syncfolder.h \
+    smallfilereader.h \
+    remotefilecache.h \
+    mediaserver.h
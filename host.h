@@ -6,17 +6,32 @@
 
 struct Host {
     Host() = default;
-    Host(const QSslCertificate &cert) : certificate(cert) {}
+    Host(const QSslCertificate &cert) : certificate(cert), fingerprint(fingerprintOf(cert)) {}
     QString name;
     QHostAddress address;
     QSslCertificate certificate;
-    QDateTime lastSeen;
+    QByteArray fingerprint;
+    qint64 lastSeen = 0; // msecs since epoch
+    int beaconInterval = 1000; // ms, what the host told us to expect
     bool trusted = false;
     bool offline = true;
 
     bool operator ==(const Host &other) const {
         return certificate == other.certificate;
     }
+
+    // Missing a couple of beacons is fine, UDP is UDP
+    qint64 expiresAt() const {
+        return lastSeen + qMax(5000, beaconInterval * 3);
+    }
+    bool isExpired(qint64 now) const {
+        return now > expiresAt();
+    }
+
+    // What we put in the beacons, and what we index certificates by
+    static QByteArray fingerprintOf(const QSslCertificate &cert) {
+        return cert.digest(QCryptographicHash::Sha256);
+    }
 };
 
 static inline uint qHash(const Host &host) {
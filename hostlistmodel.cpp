@@ -0,0 +1,234 @@
+#include "hostlistmodel.h"
+
+#include <QDateTime>
+#include <QDebug>
+
+#include <algorithm>
+
+HostListModel::HostListModel(const HostTable *hosts, QObject *parent) : QAbstractListModel(parent),
+    m_hosts(hosts),
+    m_wheel(wheelSlots),
+    m_trustedIcon(QIcon::fromTheme("security-high")),
+    m_untrustedIcon(QIcon::fromTheme("security-low")),
+    m_offlineIcon(QIcon::fromTheme("network-offline"))
+{
+    m_wheelTimer.setInterval(wheelTick);
+    connect(&m_wheelTimer, &QTimer::timeout, this, &HostListModel::onWheelTick);
+}
+
+int HostListModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid()) {
+        return 0;
+    }
+
+    return m_entries.count();
+}
+
+QVariant HostListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_entries.count()) {
+        return QVariant();
+    }
+
+    const Entry &entry = m_entries[index.row()];
+
+    switch (role) {
+    case Qt::DisplayRole:
+        return QString(m_hosts->name(entry.id) + " (" + m_hosts->address(entry.id).toString() + ")");
+    case Qt::DecorationRole:
+        if (entry.offline) {
+            return m_offlineIcon;
+        }
+        return entry.trusted ? m_trustedIcon : m_untrustedIcon;
+    case Qt::ToolTipRole:
+        return QString::fromLatin1(m_hosts->fingerprint(entry.id).toHex());
+    default:
+        return QVariant();
+    }
+}
+
+void HostListModel::update(HostId id, int changes)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    const int row = rowOf(id);
+    if (row >= 0) {
+        Entry &entry = m_entries[row];
+        entry.expiresAt = m_hosts->expiresAt(id);
+
+        if (!entry.scheduled) {
+            schedule(&entry, now);
+        }
+
+        if (entry.offline) {
+            setOffline(row, false);
+        } else if (changes & HostTable::Changed) {
+            const QModelIndex changed = index(row);
+            emit dataChanged(changed, changed);
+        }
+        return;
+    }
+
+    Entry entry;
+    entry.id = id;
+    entry.trusted = m_hosts->isTrusted(id);
+    entry.expiresAt = m_hosts->expiresAt(id);
+
+    if (id >= m_rows.count()) {
+        const int oldSize = m_rows.count();
+        m_rows.resize(id + 1);
+        for (int i=oldSize; i<m_rows.count(); i++) {
+            m_rows[i] = -1;
+        }
+    }
+
+    const int newRow = m_entries.count();
+    beginInsertRows(QModelIndex(), newRow, newRow);
+    m_entries.append(entry);
+    m_rows[id] = newRow;
+    schedule(&m_entries.last(), now);
+    endInsertRows();
+
+    if (entry.trusted) {
+        m_onlineTrusted++;
+    }
+
+    if (newRow == 0 || entry.trusted) {
+        emit statusChanged();
+    }
+}
+
+void HostListModel::onTrustChanged(HostId id)
+{
+    const int row = rowOf(id);
+    if (row < 0) {
+        return;
+    }
+
+    Entry &entry = m_entries[row];
+    const bool trusted = m_hosts->isTrusted(id);
+    if (entry.trusted == trusted) {
+        return;
+    }
+
+    entry.trusted = trusted;
+    if (!entry.offline) {
+        m_onlineTrusted += trusted ? 1 : -1;
+        emit statusChanged();
+    }
+
+    const QModelIndex changed = index(row);
+    emit dataChanged(changed, changed);
+}
+
+void HostListModel::forget(const QVector<HostId> &ids)
+{
+    for (const HostId id : ids) {
+        const int row = rowOf(id);
+        if (row >= 0) {
+            remove(row);
+        }
+    }
+
+    // Or a tick would look at whoever gets the id next
+    for (QVector<HostId> &slot : m_wheel) {
+        const int before = slot.count();
+        slot.erase(std::remove_if(slot.begin(), slot.end(), [&ids](HostId id) {
+            return ids.contains(id);
+        }), slot.end());
+        m_scheduledCount -= before - slot.count();
+    }
+    if (m_scheduledCount == 0) {
+        m_wheelTimer.stop();
+    }
+}
+
+void HostListModel::schedule(Entry *entry, qint64 now)
+{
+    const qint64 ticks = qBound<qint64>(1, (entry->expiresAt - now + wheelTick - 1) / wheelTick, wheelSlots - 1);
+    m_wheel[(m_wheelPosition + ticks) % wheelSlots].append(entry->id);
+    entry->scheduled = true;
+
+    m_scheduledCount++;
+    if (!m_wheelTimer.isActive()) {
+        m_wheelTimer.start();
+    }
+}
+
+void HostListModel::onWheelTick()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    m_wheelPosition = (m_wheelPosition + 1) % wheelSlots;
+
+    // Swap out, because entries can get rescheduled into this slot
+    QVector<HostId> due;
+    due.swap(m_wheel[m_wheelPosition]);
+    m_scheduledCount -= due.count();
+
+    for (const HostId id : due) {
+        const int row = rowOf(id);
+        if (row < 0) {
+            continue;
+        }
+
+        Entry &entry = m_entries[row];
+        entry.scheduled = false;
+
+        if (entry.expiresAt > now) {
+            // Was updated, or was too far out for the wheel
+            schedule(&entry, now);
+            continue;
+        }
+
+        if (entry.offline) {
+            // Second time around, has been gone for a while
+            if (!entry.trusted) {
+                remove(row);
+            }
+            continue;
+        }
+
+        setOffline(row, true);
+
+        if (!entry.trusted) {
+            // Come back later to forget it
+            entry.expiresAt = now + forgetDelay;
+            schedule(&entry, now);
+        }
+    }
+
+    if (m_scheduledCount == 0) {
+        m_wheelTimer.stop();
+    }
+}
+
+void HostListModel::setOffline(int row, bool offline)
+{
+    Entry &entry = m_entries[row];
+    entry.offline = offline;
+
+    if (entry.trusted) {
+        m_onlineTrusted += offline ? -1 : 1;
+        emit statusChanged();
+    }
+
+    const QModelIndex changed = index(row);
+    emit dataChanged(changed, changed);
+}
+
+void HostListModel::remove(int row)
+{
+    beginRemoveRows(QModelIndex(), row, row);
+    m_rows[m_entries[row].id] = -1;
+    m_entries.remove(row);
+    for (int i=row; i<m_entries.count(); i++) {
+        m_rows[m_entries[i].id] = i;
+    }
+    endRemoveRows();
+
+    if (m_entries.isEmpty()) {
+        emit statusChanged();
+    }
+}
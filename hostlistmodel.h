@@ -0,0 +1,82 @@
+#ifndef HOSTLISTMODEL_H
+#define HOSTLISTMODEL_H
+
+#include <QAbstractListModel>
+#include <QTimer>
+#include <QVector>
+#include <QIcon>
+
+#include "hosttable.h"
+
+/// The hosts we have heard from, as rows of ids into the shared host table.
+/// Expiry is handled with a timer wheel, so neither a beacon nor a
+/// timer tick has to look at all the hosts.
+class HostListModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+    static constexpr int wheelSlots = 64;
+    static constexpr int wheelTick = 1000; // ms
+    static constexpr int forgetDelay = 10 * 60 * 1000; // ms, before offline untrusted hosts are dropped
+
+public:
+    explicit HostListModel(const HostTable *hosts, QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+    // changes is HostTable::SeenResult flags
+    void update(HostId id, int changes);
+    void onTrustChanged(HostId id);
+
+    // Evicted from the host table, the ids will be someone else's
+    void forget(const QVector<HostId> &ids);
+
+    HostId hostId(int row) const { return m_entries[row].id; }
+    bool isOffline(int row) const { return m_entries[row].offline; }
+    int count() const { return m_entries.count(); }
+    bool hasOnlineTrusted() const { return m_onlineTrusted > 0; }
+
+signals:
+    // Number of online trusted hosts went to or from zero, or the list went from empty
+    void statusChanged();
+
+private slots:
+    void onWheelTick();
+
+private:
+    struct Entry {
+        HostId id = InvalidHostId;
+        qint64 expiresAt = 0; // msecs since epoch
+        bool scheduled = false;
+        bool offline = false;
+        bool trusted = false;
+    };
+
+    int rowOf(HostId id) const {
+        return id >= 0 && id < m_rows.count() ? m_rows[id] : -1;
+    }
+    void schedule(Entry *entry, qint64 now);
+    void setOffline(int row, bool offline);
+    void remove(int row);
+
+    const HostTable *m_hosts;
+
+    QVector<Entry> m_entries;
+    QVector<int> m_rows; // host id -> row, -1 if not shown
+
+    // Each slot is one tick, holds the host ids to check when we get there.
+    // Entries further out than the wheel goes get checked and re-inserted on the way.
+    QVector<QVector<HostId>> m_wheel;
+    int m_wheelPosition = 0;
+    int m_scheduledCount = 0;
+    QTimer m_wheelTimer;
+
+    int m_onlineTrusted = 0;
+
+    QIcon m_trustedIcon;
+    QIcon m_untrustedIcon;
+    QIcon m_offlineIcon;
+};
+
+#endif // HOSTLISTMODEL_H
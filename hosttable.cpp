@@ -0,0 +1,181 @@
+#include "hosttable.h"
+
+#include <QDebug>
+
+#include <cstring>
+
+HostId HostTable::find(const QByteArray &fingerprint) const
+{
+    QReadLocker locker(&m_lock);
+    return m_ids.value(fingerprint, InvalidHostId);
+}
+
+HostId HostTable::insert(const Host &host)
+{
+    Q_ASSERT(!host.fingerprint.isEmpty());
+
+    QWriteLocker locker(&m_lock);
+
+    HostId id = m_ids.value(host.fingerprint, InvalidHostId);
+    if (id != InvalidHostId) {
+        return id;
+    }
+
+    Entry entry;
+    entry.host = host;
+    entry.rawName = host.name.toUtf8();
+    if (!m_freeIds.isEmpty()) {
+        id = m_freeIds.takeLast();
+        m_entries[id] = entry;
+    } else {
+        id = m_entries.count();
+        m_entries.append(entry);
+    }
+    m_ids.insert(host.fingerprint, id);
+
+    return id;
+}
+
+QVector<HostId> HostTable::evictExpired(qint64 now)
+{
+    QWriteLocker locker(&m_lock);
+
+    QVector<HostId> evicted;
+    for (HostId id = 0; id < m_entries.count(); id++) {
+        const Host &host = m_entries[id].host;
+        if (host.fingerprint.isEmpty() || host.trusted || now - host.expiresAt() < evictAfter) {
+            continue;
+        }
+        m_ids.remove(host.fingerprint);
+        m_entries[id] = Entry();
+        m_evictedIds.append(id);
+        evicted.append(id);
+    }
+    return evicted;
+}
+
+void HostTable::releaseEvicted()
+{
+    QWriteLocker locker(&m_lock);
+    m_freeIds += m_evictedIds;
+    m_evictedIds.clear();
+}
+
+int HostTable::updateSeen(HostId id, const char *name, int nameLength, const QHostAddress &address, int beaconInterval, qint64 now)
+{
+    QWriteLocker locker(&m_lock);
+    if (!isValid(id)) {
+        qWarning() << "Invalid host id" << id;
+        return Unchanged;
+    }
+
+    Entry &entry = m_entries[id];
+
+    int result = Unchanged;
+    if (entry.host.lastSeen == 0 || entry.host.isExpired(now)) {
+        result |= Returned;
+    }
+
+    // Compare before assigning, so the common case doesn't allocate
+    if (entry.rawName.size() != nameLength || memcmp(entry.rawName.constData(), name, nameLength) != 0) {
+        entry.rawName = QByteArray(name, nameLength);
+        entry.host.name = QString::fromUtf8(entry.rawName);
+        result |= Changed;
+    }
+
+    if (entry.host.address != address) {
+        entry.host.address = address;
+        result |= Changed;
+    }
+
+    entry.host.beaconInterval = beaconInterval;
+    entry.host.lastSeen = now;
+
+    return result;
+}
+
+void HostTable::setTrusted(HostId id, bool trusted)
+{
+    QWriteLocker locker(&m_lock);
+    if (!isValid(id)) {
+        qWarning() << "Invalid host id" << id;
+        return;
+    }
+    m_entries[id].host.trusted = trusted;
+}
+
+Host HostTable::host(HostId id) const
+{
+    QReadLocker locker(&m_lock);
+    if (!isValid(id)) {
+        return Host();
+    }
+    return m_entries[id].host;
+}
+
+QString HostTable::name(HostId id) const
+{
+    QReadLocker locker(&m_lock);
+    if (!isValid(id)) {
+        return QString();
+    }
+    return m_entries[id].host.name;
+}
+
+QHostAddress HostTable::address(HostId id) const
+{
+    QReadLocker locker(&m_lock);
+    if (!isValid(id)) {
+        return QHostAddress();
+    }
+    return m_entries[id].host.address;
+}
+
+QByteArray HostTable::fingerprint(HostId id) const
+{
+    QReadLocker locker(&m_lock);
+    if (!isValid(id)) {
+        return QByteArray();
+    }
+    return m_entries[id].host.fingerprint;
+}
+
+bool HostTable::isTrusted(HostId id) const
+{
+    QReadLocker locker(&m_lock);
+    return isValid(id) && m_entries[id].host.trusted;
+}
+
+bool HostTable::isExpired(HostId id, qint64 now) const
+{
+    QReadLocker locker(&m_lock);
+    return !isValid(id) || m_entries[id].host.isExpired(now);
+}
+
+qint64 HostTable::expiresAt(HostId id) const
+{
+    QReadLocker locker(&m_lock);
+    if (!isValid(id)) {
+        return 0;
+    }
+    return m_entries[id].host.expiresAt();
+}
+
+QList<QSslCertificate> HostTable::trustedCertificates() const
+{
+    QReadLocker locker(&m_lock);
+
+    QList<QSslCertificate> certs;
+    for (const Entry &entry : m_entries) {
+        if (entry.host.trusted) {
+            certs.append(entry.host.certificate);
+        }
+    }
+    return certs;
+}
+
+int HostTable::count() const
+{
+    QReadLocker locker(&m_lock);
+    return m_entries.count() - m_freeIds.count() - m_evictedIds.count();
+}
@@ -0,0 +1,75 @@
+#ifndef HOSTTABLE_H
+#define HOSTTABLE_H
+
+#include <QReadWriteLock>
+#include <QVector>
+#include <QHash>
+
+#include "host.h"
+
+using HostId = int;
+static constexpr HostId InvalidHostId = -1;
+
+/// Every host we know the certificate of, interned to a small stable id.
+/// Entries are updated in place, so ids can be passed around instead of
+/// Host copies. Untrusted hosts that have been gone for long enough that
+/// nothing shows them any more can be evicted. Their ids are only reused
+/// once everyone who keeps something per id has dropped it.
+/// Shared with the worker threads.
+class HostTable
+{
+public:
+    // Longer than the host list keeps offline untrusted hosts around
+    static constexpr qint64 evictAfter = 15 * 60 * 1000; // ms
+    enum SeenResult {
+        Unchanged = 0,
+        Changed = 1 << 0, // something that is shown changed
+        Returned = 1 << 1, // new, or had expired
+    };
+
+    HostId find(const QByteArray &fingerprint) const;
+
+    // Doesn't copy the fingerprint, for the beacon path
+    HostId find(const char *fingerprint, int size) const {
+        return find(QByteArray::fromRawData(fingerprint, size));
+    }
+
+    // Returns the existing id if we already know it
+    HostId insert(const Host &host);
+
+    // Drops untrusted hosts that expired more than evictAfter ago and returns
+    // their ids, which aren't handed out again until releaseEvicted()
+    QVector<HostId> evictExpired(qint64 now);
+    void releaseEvicted();
+
+    int updateSeen(HostId id, const char *name, int nameLength, const QHostAddress &address, int beaconInterval, qint64 now);
+    void setTrusted(HostId id, bool trusted);
+
+    Host host(HostId id) const;
+    QString name(HostId id) const;
+    QHostAddress address(HostId id) const;
+    QByteArray fingerprint(HostId id) const;
+    bool isTrusted(HostId id) const;
+    bool isExpired(HostId id, qint64 now) const;
+    qint64 expiresAt(HostId id) const;
+
+    QList<QSslCertificate> trustedCertificates() const;
+
+    int count() const;
+
+private:
+    struct Entry {
+        Host host;
+        QByteArray rawName; // as it was in the beacon, to compare without decoding
+    };
+
+    bool isValid(HostId id) const { return id >= 0 && id < m_entries.count(); }
+
+    mutable QReadWriteLock m_lock;
+    QHash<QByteArray, HostId> m_ids; // fingerprint -> id
+    QVector<Entry> m_entries; // indexed by id
+    QVector<HostId> m_evictedIds; // empty, but might still be referenced
+    QVector<HostId> m_freeIds; // evicted, empty until reused
+};
+
+#endif // HOSTTABLE_H
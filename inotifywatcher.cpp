@@ -0,0 +1,165 @@
+#include "inotifywatcher.h"
+
+#include <QSocketNotifier>
+#include <QFile>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+}
+#endif
+
+InotifyWatcher::InotifyWatcher(QObject *parent) : QObject(parent)
+{
+#ifdef Q_OS_LINUX
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd == -1) {
+        qWarning() << "Failed to create inotify instance" << strerror(errno);
+        return;
+    }
+
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier.data(), &QSocketNotifier::activated, this, &InotifyWatcher::onActivated);
+#endif
+}
+
+InotifyWatcher::~InotifyWatcher()
+{
+#ifdef Q_OS_LINUX
+    if (m_fd != -1) {
+        ::close(m_fd);
+    }
+#endif
+}
+
+bool InotifyWatcher::addDirectory(const QString &path)
+{
+#ifdef Q_OS_LINUX
+    if (m_fd == -1) {
+        return false;
+    }
+
+    const uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+            IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    const int wd = inotify_add_watch(m_fd, QFile::encodeName(path).constData(), mask);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            qWarning() << "Out of inotify watches, raise fs.inotify.max_user_watches. Not watching" << path;
+        } else if (errno != ENOENT) {
+            qWarning() << "Failed to watch" << path << strerror(errno);
+        }
+        return false;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_paths[wd] = path;
+    m_watches[path] = wd;
+    return true;
+#else
+    Q_UNUSED(path);
+    return false;
+#endif
+}
+
+void InotifyWatcher::removeDirectory(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_watches.contains(path)) {
+        return;
+    }
+    const int wd = m_watches.take(path);
+    m_paths.remove(wd);
+
+#ifdef Q_OS_LINUX
+    inotify_rm_watch(m_fd, wd);
+#endif
+}
+
+bool InotifyWatcher::isWatching(const QString &path) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_watches.contains(path);
+}
+
+int InotifyWatcher::watchCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_watches.count();
+}
+
+void InotifyWatcher::onActivated()
+{
+#ifdef Q_OS_LINUX
+    alignas(struct inotify_event) char buffer[64 * 1024];
+
+    forever {
+        const ssize_t length = ::read(m_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno != EAGAIN) {
+                qWarning() << "Failed to read inotify events" << strerror(errno);
+            }
+            return;
+        }
+
+        for (ssize_t offset = 0; offset < length; ) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                qWarning() << "inotify queue overflowed";
+                emit overflowed();
+                continue;
+            }
+
+            QString directory;
+            {
+                QMutexLocker locker(&m_mutex);
+                directory = m_paths.value(event->wd);
+
+                // The kernel has dropped the watch, the directory is gone or we removed it
+                if (event->mask & IN_IGNORED) {
+                    m_paths.remove(event->wd);
+                    if (m_watches.value(directory) == event->wd) {
+                        m_watches.remove(directory);
+                    }
+                    continue;
+                }
+            }
+            if (directory.isEmpty()) {
+                continue;
+            }
+
+            const QString name = event->len ? QFile::decodeName(event->name) : QString();
+            const bool isDirectory = event->mask & IN_ISDIR;
+
+            if (event->mask & IN_CREATE) {
+                emit changed(directory, name, Created, isDirectory);
+            }
+            if (event->mask & IN_DELETE) {
+                emit changed(directory, name, Deleted, isDirectory);
+            }
+            if (event->mask & IN_MODIFY) {
+                emit changed(directory, name, Modified, isDirectory);
+            }
+            if (event->mask & IN_CLOSE_WRITE) {
+                emit changed(directory, name, Written, isDirectory);
+            }
+            if (event->mask & IN_MOVED_FROM) {
+                emit changed(directory, name, MovedFrom, isDirectory);
+            }
+            if (event->mask & IN_MOVED_TO) {
+                emit changed(directory, name, MovedTo, isDirectory);
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                emit changed(directory, QString(), DirectoryGone, true);
+            }
+        }
+    }
+#endif
+}
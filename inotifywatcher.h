@@ -0,0 +1,61 @@
+#ifndef INOTIFYWATCHER_H
+#define INOTIFYWATCHER_H
+
+#include <QObject>
+#include <QMutex>
+#include <QHash>
+#include <QPointer>
+
+class QSocketNotifier;
+
+/// Thin wrapper around an inotify instance that reports changes as a
+/// directory and an entry name instead of watch descriptors. Each user
+/// has its own, so watches on the same directory don't step on each
+/// other. Watches can be added from any thread, changed() is emitted on
+/// the thread it lives on. Does nothing outside Linux.
+class InotifyWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Change {
+        Created,
+        Deleted,
+        Modified, // written to, can come in floods
+        Written, // closed after writing
+        MovedFrom,
+        MovedTo,
+        DirectoryGone // the watched directory itself, name is empty
+    };
+    Q_ENUM(Change)
+
+    explicit InotifyWatcher(QObject *parent = nullptr);
+    ~InotifyWatcher();
+
+    bool isValid() const { return m_fd != -1; }
+
+    // Watches a directory's entries, false if it can't (out of watches for example)
+    bool addDirectory(const QString &path);
+    void removeDirectory(const QString &path);
+    bool isWatching(const QString &path) const;
+    int watchCount() const;
+
+signals:
+    void changed(const QString &directory, const QString &name, InotifyWatcher::Change change, bool isDirectory);
+
+    // The kernel dropped events, anything could have changed
+    void overflowed();
+
+private slots:
+    void onActivated();
+
+private:
+    int m_fd = -1;
+    QPointer<QSocketNotifier> m_notifier;
+
+    mutable QMutex m_mutex;
+    QHash<int, QString> m_paths;
+    QHash<QString, int> m_watches;
+};
+
+#endif // INOTIFYWATCHER_H
@@ -0,0 +1,258 @@
+#include "inputinjector.h"
+
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+    #include <X11/Xlib.h>
+    #include <X11/extensions/XTest.h>
+#elif defined(Q_OS_WINDOWS)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#endif
+
+InputInjector::InputInjector(QObject *parent) : QThread(parent)
+{
+    m_clock.start();
+    start();
+}
+
+InputInjector::~InputInjector()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_wakeup.wakeOne();
+    }
+    wait();
+}
+
+void InputInjector::postMove(const QPoint &position)
+{
+    Event event;
+    event.type = Event::Move;
+    event.position = position;
+    post(event);
+}
+
+void InputInjector::postClick(const QPoint &position, MouseButton button)
+{
+    Event event;
+    event.type = Event::Click;
+    event.position = position;
+    event.button = button;
+    post(event);
+}
+
+void InputInjector::postKey(const void *source, quint32 keysym, bool pressed)
+{
+    Event event;
+    event.type = Event::Key;
+    event.source = source;
+    event.keysym = keysym;
+    event.pressed = pressed;
+    post(event);
+}
+
+void InputInjector::postReleaseKeys(const void *source)
+{
+    Event event;
+    event.type = Event::ReleaseKeys;
+    event.source = source;
+    post(event);
+}
+
+void InputInjector::post(Event event)
+{
+    event.received = m_clock.nsecsElapsed();
+
+    QMutexLocker locker(&m_mutex);
+    m_queue.append(event);
+    m_wakeup.wakeOne();
+}
+
+void InputInjector::run()
+{
+#ifdef Q_OS_LINUX
+    // Our own connection, Qt's belongs to the GUI thread
+    m_display = XOpenDisplay(nullptr);
+    if (!m_display) {
+        qWarning() << "Failed to open X display, remote input will be ignored";
+    }
+#endif
+
+    QVector<Event> events;
+    m_statsStart = m_clock.elapsed();
+
+    forever {
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.isEmpty() && !m_stopping) {
+                m_wakeup.wait(&m_mutex);
+            }
+            if (m_stopping) {
+                break;
+            }
+            events.swap(m_queue);
+        }
+
+        // Only the last of a run of moves matters
+        QVector<Event> batch;
+        batch.reserve(events.count());
+        for (const Event &event : events) {
+            if (event.type == Event::Move && !batch.isEmpty() && batch.last().type == Event::Move) {
+                batch.last() = event;
+            } else {
+                batch.append(event);
+            }
+        }
+
+        inject(batch);
+
+        recordLatency(events);
+        events.clear();
+    }
+
+#ifdef Q_OS_LINUX
+    if (m_display) {
+        XCloseDisplay(m_display);
+        m_display = nullptr;
+    }
+#endif
+}
+
+void InputInjector::inject(const QVector<Event> &events)
+{
+#ifdef Q_OS_LINUX
+    if (!m_display) {
+        return;
+    }
+
+    for (const Event &event : events) {
+        switch(event.type) {
+        case Event::Move:
+            XTestFakeMotionEvent(m_display, -1, event.position.x(), event.position.y(), CurrentTime);
+            break;
+        case Event::Click: {
+            unsigned int xButton = 0;
+            switch(event.button) {
+            case LeftButton:
+                xButton = Button1;
+                break;
+            case MiddleButton:
+                xButton = Button2;
+                break;
+            case RightButton:
+                xButton = Button3;
+                break;
+            case ScrollUp:
+                xButton = Button4;
+                break;
+            case ScrollDown:
+                xButton = Button5;
+                break;
+            }
+            XTestFakeMotionEvent(m_display, -1, event.position.x(), event.position.y(), CurrentTime);
+            XTestFakeButtonEvent(m_display, xButton, True, CurrentTime);
+            XTestFakeButtonEvent(m_display, xButton, False, CurrentTime);
+            break;
+        }
+        case Event::Key: {
+            const KeyCode keycode = XKeysymToKeycode(m_display, event.keysym);
+            if (!keycode) {
+                qWarning() << "No key for keysym" << QStringLiteral("0x%1").arg(event.keysym, 0, 16);
+                break;
+            }
+            if (event.pressed) {
+                m_pressedKeys[event.source].insert(keycode);
+            } else {
+                m_pressedKeys[event.source].remove(keycode);
+            }
+            XTestFakeKeyEvent(m_display, keycode, event.pressed ? True : False, CurrentTime);
+            break;
+        }
+        case Event::ReleaseKeys:
+            // A modifier left down would stick for whoever sits here
+            for (const unsigned char keycode : m_pressedKeys.take(event.source)) {
+                XTestFakeKeyEvent(m_display, keycode, False, CurrentTime);
+            }
+            break;
+        }
+    }
+
+    // Once for the whole batch
+    XFlush(m_display);
+#elif defined(Q_OS_WINDOWS)
+    for (const Event &event : events) {
+        if (event.type == Event::ReleaseKeys) {
+            continue;
+        }
+        if (event.type == Event::Key) {
+            qWarning() << "Keyboard input only available on X11";
+            continue;
+        }
+
+        SetCursorPos(event.position.x(), event.position.y());
+        if (event.type == Event::Move) {
+            continue;
+        }
+
+        INPUT input[2];
+        ZeroMemory(input, sizeof(input));
+        input[0].type = input[1].type = INPUT_MOUSE;
+        switch(event.button) {
+        case LeftButton:
+            input[0].mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
+            input[1].mi.dwFlags = MOUSEEVENTF_LEFTUP;
+            break;
+        case MiddleButton:
+            input[0].mi.dwFlags = MOUSEEVENTF_MIDDLEDOWN;
+            input[1].mi.dwFlags = MOUSEEVENTF_MIDDLEUP;
+            break;
+        case RightButton:
+            input[0].mi.dwFlags = MOUSEEVENTF_RIGHTDOWN;
+            input[1].mi.dwFlags = MOUSEEVENTF_RIGHTUP;
+            break;
+        default:
+            qWarning() << "unhandled button" << event.button;
+            continue;
+        }
+        SendInput(2, input, sizeof(INPUT));
+    }
+#else
+    Q_UNUSED(events);
+    qWarning() << "Remote input only available on Linux/X11 and windows";
+#endif
+}
+
+void InputInjector::recordLatency(const QVector<Event> &events)
+{
+    // From when the connection handed it to us until it was flushed to the X server
+    const qint64 now = m_clock.nsecsElapsed();
+    for (const Event &event : events) {
+        const qint64 latency = now - event.received;
+        m_latencyTotal += latency;
+        m_latencyMax = qMax(m_latencyMax, latency);
+    }
+    m_statsEvents += events.count();
+    m_statsBatches++;
+
+    const qint64 elapsed = m_clock.elapsed();
+    if (elapsed - m_lastActivity >= activityInterval) {
+        m_lastActivity = elapsed;
+        emit inputInjected();
+    }
+
+    if (elapsed - m_statsStart < statsInterval) {
+        return;
+    }
+    qDebug() << "Input injection:" << m_statsEvents << "events in" << m_statsBatches << "batches, latency"
+             << m_latencyTotal / m_statsEvents / 1000 << "us average" << m_latencyMax / 1000 << "us max";
+
+    m_statsStart = elapsed;
+    m_statsEvents = 0;
+    m_statsBatches = 0;
+    m_latencyTotal = 0;
+    m_latencyMax = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef INPUTINJECTOR_H
+#define INPUTINJECTOR_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QPoint>
+#include <QElapsedTimer>
+
+#include "mousebutton.h"
+
+struct _XDisplay;
+
+/// Replays remote mouse and keyboard input on its own thread, with its
+/// own X connection, so neither the UI nor file transfers delay it.
+/// Everything queued since the last wakeup is injected in one go and
+/// flushed once, with only the last of a run of pointer moves kept.
+/// Keys are tracked per source, so whatever a dropped connection left
+/// held down can be released.
+class InputInjector : public QThread
+{
+    Q_OBJECT
+
+public:
+    static constexpr int statsInterval = 10000; // ms
+    static constexpr int activityInterval = 1000; // ms, at most one inputInjected() per this
+
+    struct Event {
+        enum Type {
+            Move,
+            Click,
+            Key,
+            ReleaseKeys
+        };
+
+        Type type = Move;
+        const void *source = nullptr; // whoever sent it, only compared
+        QPoint position;
+        MouseButton button = LeftButton;
+        quint32 keysym = 0;
+        bool pressed = false;
+        qint64 received = 0; // ns, on our clock
+    };
+
+    explicit InputInjector(QObject *parent = nullptr);
+    ~InputInjector();
+
+    // Thread safe, called from the connection workers
+    void postMove(const QPoint &position);
+    void postClick(const QPoint &position, MouseButton button);
+    void postKey(const void *source, quint32 keysym, bool pressed);
+
+    // Lets go of every key the source still has down
+    void postReleaseKeys(const void *source);
+
+signals:
+    // Someone is controlling us, emitted at most once per activityInterval
+    void inputInjected();
+
+protected:
+    void run() override;
+
+private:
+    void post(Event event);
+    void inject(const QVector<Event> &events);
+    void recordLatency(const QVector<Event> &events);
+
+    QMutex m_mutex;
+    QWaitCondition m_wakeup;
+    QVector<Event> m_queue;
+    bool m_stopping = false;
+
+    QElapsedTimer m_clock;
+
+    // Only touched by the injection thread
+    _XDisplay *m_display = nullptr;
+    QHash<const void*, QSet<unsigned char>> m_pressedKeys; // keycodes held down per source
+    qint64 m_lastActivity = 0;
+    qint64 m_statsStart = 0;
+    int m_statsEvents = 0;
+    int m_statsBatches = 0;
+    qint64 m_latencyTotal = 0;
+    qint64 m_latencyMax = 0;
+};
+
+#endif // INPUTINJECTOR_H
@@ -0,0 +1,221 @@
+#include "largefileio.h"
+
+#include <QSettings>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+}
+#endif
+
+LargeFileIo::~LargeFileIo()
+{
+    reset();
+#ifdef Q_OS_LINUX
+    free(m_buffer);
+#endif
+}
+
+QAtomicInteger<qint64> LargeFileIo::s_threshold(0);
+QAtomicInt LargeFileIo::s_direct(0);
+
+void LargeFileIo::loadSettings()
+{
+#ifdef Q_OS_LINUX
+    QSettings settings;
+    s_threshold.storeRelaxed(qMax<qint64>(0, settings.value("io/largefilethreshold", 1024).toLongLong() * 1024 * 1024));
+    s_direct.storeRelaxed(settings.value("io/direct", false).toBool() ? 1 : 0);
+#endif
+}
+
+void LargeFileIo::reset()
+{
+#ifdef Q_OS_LINUX
+    if (m_direct && m_file && m_file->isOpen()) {
+        const int flags = fcntl(m_fd, F_GETFL);
+        if (flags >= 0) {
+            fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+        }
+    }
+#endif
+
+    m_file = nullptr;
+    m_fd = -1;
+    m_writing = false;
+    m_droppedOffset = 0;
+    m_syncOffset = 0;
+    m_previousSyncOffset = 0;
+    m_direct = false;
+    m_directOffset = 0;
+    m_leftover.clear();
+}
+
+void LargeFileIo::startReading(QFile *file)
+{
+    reset();
+
+    m_file = file;
+    m_fd = file->handle();
+    m_droppedOffset = file->pos();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (s_direct.loadRelaxed() && !enableDirect()) {
+        qDebug() << "Not using O_DIRECT for" << file->fileName();
+    }
+#endif
+}
+
+void LargeFileIo::startWriting(QFile *file)
+{
+    reset();
+
+    m_file = file;
+    m_fd = file->handle();
+    m_writing = true;
+    m_syncOffset = file->pos();
+    m_previousSyncOffset = m_syncOffset;
+}
+
+bool LargeFileIo::enableDirect()
+{
+#ifdef Q_OS_LINUX
+    if (m_file->pos() % directAlignment) {
+        return false;
+    }
+
+    if (!m_buffer) {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, directAlignment, directBufferSize) != 0) {
+            return false;
+        }
+        m_buffer = static_cast<char*>(buffer);
+    }
+
+    // Not all filesystems support it, tmpfs for example refuses
+    const int flags = fcntl(m_fd, F_GETFL);
+    if (flags < 0 || fcntl(m_fd, F_SETFL, flags | O_DIRECT) < 0) {
+        return false;
+    }
+
+    m_direct = true;
+    m_directOffset = m_file->pos();
+    return true;
+#else
+    return false;
+#endif
+}
+
+QByteArray LargeFileIo::read(qint64 maxSize)
+{
+    Q_ASSERT(m_file && !m_writing);
+
+    if (m_direct) {
+        return readDirect(maxSize);
+    }
+
+    const QByteArray data = m_file->read(maxSize);
+
+#ifdef Q_OS_LINUX
+    const qint64 position = m_file->pos();
+    if (position - m_droppedOffset >= dropWindow) {
+        posix_fadvise(m_fd, m_droppedOffset, position - m_droppedOffset, POSIX_FADV_DONTNEED);
+        m_droppedOffset = position;
+    }
+#endif
+
+    return data;
+}
+
+QByteArray LargeFileIo::readDirect(qint64 maxSize)
+{
+#ifdef Q_OS_LINUX
+    if (m_leftover.isEmpty()) {
+        // A short read means we hit the end, and the offset isn't aligned anymore
+        if (m_directOffset % directAlignment) {
+            return QByteArray();
+        }
+
+        const qint64 wanted = qMin(directBufferSize, (maxSize + directAlignment - 1) / directAlignment * directAlignment);
+        const ssize_t count = ::pread(m_fd, m_buffer, size_t(wanted), m_directOffset);
+        if (count < 0) {
+            qWarning() << "O_DIRECT read failed, falling back" << strerror(errno);
+            const int flags = fcntl(m_fd, F_GETFL);
+            if (flags >= 0) {
+                fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+            }
+            m_direct = false;
+            m_file->seek(m_directOffset);
+            return read(maxSize);
+        }
+
+        m_directOffset += count;
+        m_leftover = QByteArray(m_buffer, int(count));
+    }
+
+    const QByteArray data = m_leftover.left(int(maxSize));
+    m_leftover.remove(0, data.size());
+
+    // Keep QFile's idea of where we are right, so atEnd() and pos() work
+    m_file->seek(m_directOffset - m_leftover.size());
+
+    return data;
+#else
+    Q_UNUSED(maxSize);
+    return QByteArray();
+#endif
+}
+
+void LargeFileIo::written()
+{
+    Q_ASSERT(m_file && m_writing);
+
+#ifdef Q_OS_LINUX
+    // Includes what QFile still has buffered, that only has to go out when we sync
+    const qint64 position = m_file->pos();
+    if (position - m_syncOffset < syncWindow) {
+        return;
+    }
+
+    if (!m_file->flush()) {
+        return;
+    }
+
+    // Start writeback of this window, and wait for the one before it which
+    // has had a whole window's worth of time to get to disk, then drop it
+    sync_file_range(m_fd, m_syncOffset, position - m_syncOffset, SYNC_FILE_RANGE_WRITE);
+    if (m_syncOffset > m_previousSyncOffset) {
+        const qint64 length = m_syncOffset - m_previousSyncOffset;
+        sync_file_range(m_fd, m_previousSyncOffset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(m_fd, m_previousSyncOffset, length, POSIX_FADV_DONTNEED);
+    }
+
+    m_previousSyncOffset = m_syncOffset;
+    m_syncOffset = position;
+#endif
+}
+
+void LargeFileIo::finish()
+{
+    if (!m_file) {
+        return;
+    }
+
+#ifdef Q_OS_LINUX
+    if (m_writing) {
+        m_file->flush();
+        sync_file_range(m_fd, m_previousSyncOffset, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(m_fd, m_previousSyncOffset, 0, POSIX_FADV_DONTNEED);
+    } else {
+        posix_fadvise(m_fd, m_droppedOffset, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+
+    reset();
+}
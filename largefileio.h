@@ -0,0 +1,76 @@
+#ifndef LARGEFILEIO_H
+#define LARGEFILEIO_H
+
+#include <QPointer>
+#include <QFile>
+#include <QAtomicInteger>
+
+/// Reads and writes huge files without pushing everything else out of
+/// the page cache. Readers hint sequential access and drop what they have
+/// passed, writers push finished data to disk a window at a time and drop
+/// it. Can read with O_DIRECT if enabled in the settings.
+/// Only does anything special on Linux, elsewhere it is plain QFile I/O.
+class LargeFileIo
+{
+    Q_DISABLE_COPY(LargeFileIo)
+
+public:
+    static constexpr qint64 dropWindow = 16 * 1024 * 1024; // how far behind we drop read pages
+    static constexpr qint64 syncWindow = 8 * 1024 * 1024; // how much written data we let pile up
+    static constexpr qint64 directBufferSize = 1024 * 1024;
+    static constexpr qint64 directAlignment = 4096;
+
+    LargeFileIo() = default;
+    ~LargeFileIo();
+
+    // Reads io/largefilethreshold (MiB) and io/direct, again whenever they are changed
+    static void loadSettings();
+
+    // If a file of this size should be handled by us
+    static bool isLarge(qint64 size) { return s_threshold.loadRelaxed() > 0 && size >= s_threshold.loadRelaxed(); }
+
+    // If large files should be read with O_DIRECT
+    static bool directEnabled() { return s_direct.loadRelaxed(); }
+
+    // Take over an opened file from its current position
+    void startReading(QFile *file);
+    void startWriting(QFile *file);
+
+    // Like QFile::read(), reads from the file passed to startReading()
+    QByteArray read(qint64 maxSize);
+
+    // Call after writing to the file passed to startWriting()
+    void written();
+
+    // Flush and drop whatever is left, call before closing the file
+    void finish();
+
+    // Stop managing the file without flushing or dropping anything
+    void reset();
+
+    bool isActive() const { return m_file; }
+
+private:
+    // Checked for every file, so not read from the settings every time
+    static QAtomicInteger<qint64> s_threshold; // bytes, 0 is never
+    static QAtomicInt s_direct;
+
+    bool enableDirect();
+    QByteArray readDirect(qint64 maxSize);
+
+    QPointer<QFile> m_file;
+    int m_fd = -1;
+    bool m_writing = false;
+
+    qint64 m_droppedOffset = 0;
+    qint64 m_syncOffset = 0; // start of the window currently being written back
+    qint64 m_previousSyncOffset = 0;
+
+    // O_DIRECT reads, always from an aligned offset into an aligned buffer
+    bool m_direct = false;
+    char *m_buffer = nullptr;
+    qint64 m_directOffset = 0;
+    QByteArray m_leftover;
+};
+
+#endif // LARGEFILEIO_H
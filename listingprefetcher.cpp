@@ -0,0 +1,309 @@
+#include "listingprefetcher.h"
+
+#include "connection.h"
+#include "connectionhandler.h"
+#include "transferqueue.h"
+
+#include <QDebug>
+
+ListingPrefetcher::ListingPrefetcher(ConnectionHandler *handler, TransferQueue *queue, QObject *parent) : QObject(parent),
+    m_handler(handler),
+    m_queue(queue)
+{
+    m_hoverTimer.setSingleShot(true);
+    m_hoverTimer.setInterval(hoverDelay);
+    connect(&m_hoverTimer, &QTimer::timeout, this, &ListingPrefetcher::startPrefetch);
+
+    m_idleTimer.setSingleShot(true);
+    m_idleTimer.setInterval(idleTimeout);
+    connect(&m_idleTimer, &QTimer::timeout, this, &ListingPrefetcher::onIdle);
+
+    // Its id is about to be someone else's
+    connect(handler, &ConnectionHandler::hostsEvicted, this, [this](const QVector<HostId> &ids) {
+        if (ids.contains(m_host)) {
+            setHost(InvalidHostId);
+        }
+    });
+}
+
+void ListingPrefetcher::setHost(HostId host)
+{
+    if (host != m_host) {
+        closeSession();
+        m_cache.clear();
+        m_hoverPath.clear();
+        m_wanted.clear();
+        m_watchedPath.clear();
+        m_host = host;
+    }
+
+    if (m_host == InvalidHostId) {
+        return;
+    }
+
+    // Connect and handshake while they are still looking
+    ensureSession();
+}
+
+void ListingPrefetcher::fetch(const QString &path)
+{
+    if (m_host == InvalidHostId) {
+        return;
+    }
+    m_wanted = path;
+    m_retried = false;
+
+    // Before listing, so nothing that happens in between is missed
+    m_watchedPath = path;
+    ensureSession();
+    syncWatch();
+
+    if (m_cache.contains(path) && m_cache[path].age.elapsed() > maxAge) {
+        m_cache.remove(path);
+    }
+
+    if (m_cache.contains(path)) {
+        const Listing &listing = m_cache[path];
+        emit listingReady(path, listing.entries);
+        if (listing.age.elapsed() < freshFor) {
+            m_wanted.clear();
+            return;
+        }
+    }
+
+    send(path, false);
+}
+
+void ListingPrefetcher::hovered(const QString &path)
+{
+    if (m_host == InvalidHostId || isCached(path) || m_requested.contains(path)) {
+        return;
+    }
+
+    // Only the last folder they rested on is worth it
+    m_hoverPath = path;
+    m_hoverTimer.start();
+}
+
+void ListingPrefetcher::invalidate(const QString &path)
+{
+    m_cache.remove(path);
+}
+
+void ListingPrefetcher::startPrefetch()
+{
+    if (m_hoverPath.isEmpty() || !m_prefetchPath.isEmpty()) {
+        return;
+    }
+    if (isCached(m_hoverPath) || m_requested.contains(m_hoverPath)) {
+        m_hoverPath.clear();
+        return;
+    }
+
+    // Never compete with real transfers
+    if (m_queue && m_queue->activeCount() > 0) {
+        return;
+    }
+    if (!takeBudget()) {
+        qDebug() << "Out of prefetch budget, not prefetching" << m_hoverPath;
+        return;
+    }
+
+    m_prefetchPath = m_hoverPath;
+    m_hoverPath.clear();
+    send(m_prefetchPath, true);
+}
+
+void ListingPrefetcher::onListingReceived(const QString &path, const QStringList &entries)
+{
+    m_requested.remove(path);
+
+    const bool changed = !m_cache.contains(path) || m_cache[path].entries != entries;
+
+    Listing &listing = m_cache[path];
+    listing.entries = entries;
+    listing.age.start();
+
+    if (m_cache.count() > maxCachedListings) {
+        QString oldest;
+        qint64 oldestAge = -1;
+        for (QHash<QString, Listing>::const_iterator it = m_cache.constBegin(); it != m_cache.constEnd(); ++it) {
+            if (it->age.elapsed() > oldestAge) {
+                oldest = it.key();
+                oldestAge = it->age.elapsed();
+            }
+        }
+        m_cache.remove(oldest);
+    }
+
+    if (path == m_wanted) {
+        m_wanted.clear();
+    }
+    if (path == m_prefetchPath) {
+        m_prefetchPath.clear();
+    }
+
+    if (changed) {
+        emit listingReady(path, entries);
+    }
+
+    if (!m_hoverPath.isEmpty()) {
+        startPrefetch();
+    }
+}
+
+void ListingPrefetcher::onSessionClosed()
+{
+    m_session = nullptr;
+    m_requested.clear();
+    m_prefetchPath.clear();
+    m_sessionWatches.clear();
+
+    // Not waiting for it to time out, but they still want their listing and changes
+    if (m_retried || (m_wanted.isEmpty() && m_watchedPath.isEmpty())) {
+        return;
+    }
+    m_retried = true;
+    ensureSession();
+    syncWatch();
+    if (!m_wanted.isEmpty()) {
+        send(m_wanted, false);
+    }
+}
+
+void ListingPrefetcher::onDirectoryChanged(const QString &path, const QStringList &entries, const QStringList &removed)
+{
+    if (m_cache.contains(path)) {
+        QSet<QString> gone;
+        for (const QString &name : removed) {
+            gone.insert(name);
+        }
+        for (const QString &entry : entries) {
+            gone.insert(entryName(entry));
+        }
+
+        QStringList &cached = m_cache[path].entries;
+        for (int i=cached.count() - 1; i>=0; i--) {
+            if (gone.contains(entryName(cached[i]))) {
+                cached.removeAt(i);
+            }
+        }
+        for (const QString &entry : entries) {
+            const QString name = entryName(entry);
+            int row = 0;
+            while (row < cached.count() && !nameLessThan(name, entryName(cached[row]))) {
+                row++;
+            }
+            cached.insert(row, entry);
+        }
+    }
+
+    emit listingChanged(path, entries, removed);
+}
+
+void ListingPrefetcher::onDirectoryNeedsRelist(const QString &path)
+{
+    invalidate(path);
+    if (path == m_watchedPath) {
+        fetch(path);
+    }
+}
+
+void ListingPrefetcher::onIdle()
+{
+    // The folder they're looking at is watched through it
+    if (!m_watchedPath.isEmpty()) {
+        return;
+    }
+    qDebug() << "Listing connection idle, closing it";
+    closeSession();
+}
+
+void ListingPrefetcher::ensureSession()
+{
+    m_idleTimer.start();
+
+    // Failed connection attempts never get as far as disconnected()
+    if (m_session && m_session->socket()->state() == QAbstractSocket::UnconnectedState) {
+        closeSession();
+    }
+    if (m_session) {
+        return;
+    }
+
+    m_session = new Connection(m_handler);
+    connect(m_session, &Connection::listingReceived, this, &ListingPrefetcher::onListingReceived);
+    connect(m_session, &Connection::disconnected, this, &ListingPrefetcher::onSessionClosed);
+    connect(m_session, &Connection::directoryChanged, this, &ListingPrefetcher::onDirectoryChanged);
+    connect(m_session, &Connection::directoryNeedsRelist, this, &ListingPrefetcher::onDirectoryNeedsRelist);
+    m_session->openListingSession(m_host);
+    syncWatch();
+}
+
+void ListingPrefetcher::syncWatch()
+{
+    if (!m_session || m_watchedPath.isEmpty() || m_sessionWatches == m_watchedPath) {
+        return;
+    }
+    m_session->watchDirectory(m_watchedPath);
+    m_sessionWatches = m_watchedPath;
+}
+
+void ListingPrefetcher::closeSession()
+{
+    m_requested.clear();
+    m_prefetchPath.clear();
+    m_sessionWatches.clear();
+
+    if (!m_session) {
+        return;
+    }
+    disconnect(m_session, nullptr, this, nullptr);
+    m_session->cancel();
+    m_session->deleteLater();
+    m_session = nullptr;
+}
+
+void ListingPrefetcher::send(const QString &path, bool prefetch)
+{
+    if (m_requested.contains(path)) {
+        return;
+    }
+
+    ensureSession();
+    m_requested.insert(path);
+    m_session->requestListing(path, prefetch);
+}
+
+bool ListingPrefetcher::takeBudget()
+{
+    if (!m_budgetWindow.isValid() || m_budgetWindow.elapsed() > 60000) {
+        m_budgetWindow.start();
+        m_budgetUsed = 0;
+    }
+    if (m_budgetUsed >= prefetchBudget) {
+        return false;
+    }
+    m_budgetUsed++;
+    return true;
+}
+
+bool ListingPrefetcher::isCached(const QString &path) const
+{
+    return m_cache.contains(path) && m_cache[path].age.elapsed() < maxAge;
+}
+
+QString ListingPrefetcher::entryName(const QString &entry)
+{
+    return entry.mid(entry.indexOf(':') + 1);
+}
+
+bool ListingPrefetcher::nameLessThan(const QString &a, const QString &b)
+{
+    // Folders first, then by name
+    const bool aIsDirectory = a.endsWith('/');
+    if (aIsDirectory != b.endsWith('/')) {
+        return aIsDirectory;
+    }
+    return QString::localeAwareCompare(a, b) < 0;
+}
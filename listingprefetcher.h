@@ -0,0 +1,103 @@
+#ifndef LISTINGPREFETCHER_H
+#define LISTINGPREFETCHER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+
+#include "hosttable.h"
+
+class Connection;
+class ConnectionHandler;
+class TransferQueue;
+
+/// Keeps a warm connection to the host being browsed and a cache of its
+/// listings, so moving around doesn't wait for a connect and handshake
+/// every time. Cached listings are shown right away and refreshed behind
+/// the scenes. Folders the mouse rests on are fetched ahead of time, one
+/// at a time, within a budget, and only while no transfers are running.
+/// The folder being looked at is watched, the other side pushes changes
+/// to it which are applied to the cache and passed on as they come.
+class ListingPrefetcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int idleTimeout = 60000; // ms before the warm connection is closed
+    static constexpr int freshFor = 5000; // ms a cached listing is trusted without asking again
+    static constexpr int maxAge = 300000; // ms, older listings are not shown at all
+    static constexpr int hoverDelay = 200; // ms the mouse has to rest on a folder
+    static constexpr int prefetchBudget = 30; // prefetched listings per minute
+    static constexpr int maxCachedListings = 256;
+
+    ListingPrefetcher(ConnectionHandler *handler, TransferQueue *queue, QObject *parent);
+
+    // Opens the warm connection, and throws away what we have from another host
+    void setHost(HostId host);
+
+    // Emits listingReady() right away if cached, and again if it changed when refreshed.
+    // Also watches it for changes, until something else is fetched.
+    void fetch(const QString &path);
+
+    // The mouse is over a folder
+    void hovered(const QString &path);
+
+    void invalidate(const QString &path);
+
+    // The name part of a listing line, and the order the other side sorts them in
+    static QString entryName(const QString &entry);
+    static bool nameLessThan(const QString &a, const QString &b);
+
+signals:
+    void listingReady(const QString &path, const QStringList &entries);
+
+    // What changed in a watched folder, entries are listing lines and removed are names
+    void listingChanged(const QString &path, const QStringList &entries, const QStringList &removed);
+
+private slots:
+    void onListingReceived(const QString &path, const QStringList &entries);
+    void onSessionClosed();
+    void onDirectoryChanged(const QString &path, const QStringList &entries, const QStringList &removed);
+    void onDirectoryNeedsRelist(const QString &path);
+    void startPrefetch();
+    void onIdle();
+
+private:
+    struct Listing {
+        QStringList entries;
+        QElapsedTimer age;
+    };
+
+    void ensureSession();
+    void closeSession();
+    void send(const QString &path, bool prefetch);
+    void syncWatch();
+    bool takeBudget();
+    bool isCached(const QString &path) const;
+
+    QPointer<ConnectionHandler> m_handler;
+    QPointer<TransferQueue> m_queue;
+    QPointer<Connection> m_session;
+    HostId m_host = InvalidHostId;
+
+    QHash<QString, Listing> m_cache;
+    QSet<QString> m_requested; // asked for on the current session, not answered yet
+    QString m_wanted; // what the user is waiting for
+    QString m_watchedPath; // what the user is looking at
+    QString m_sessionWatches; // what the current session was told to watch
+    bool m_retried = false;
+
+    QString m_hoverPath;
+    QString m_prefetchPath; // the one prefetch in flight
+    QTimer m_hoverTimer;
+    QTimer m_idleTimer;
+
+    QElapsedTimer m_budgetWindow;
+    int m_budgetUsed = 0;
+};
+
+#endif // LISTINGPREFETCHER_H
@@ -0,0 +1,111 @@
+#include "localaddresses.h"
+
+#include <QNetworkInterface>
+#include <QSocketNotifier>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+}
+#endif
+
+LocalAddresses::LocalAddresses(QObject *parent) : QObject(parent)
+{
+#ifdef Q_OS_LINUX
+    m_netlinkFd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (m_netlinkFd >= 0) {
+        sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+
+        if (::bind(m_netlinkFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            qWarning() << "Failed to bind netlink socket" << strerror(errno);
+            ::close(m_netlinkFd);
+            m_netlinkFd = -1;
+        }
+    } else {
+        qWarning() << "Failed to open netlink socket" << strerror(errno);
+    }
+
+    if (m_netlinkFd >= 0) {
+        m_notifier = new QSocketNotifier(m_netlinkFd, QSocketNotifier::Read, this);
+        connect(m_notifier, &QSocketNotifier::activated, this, &LocalAddresses::onNetlinkActivated);
+    }
+#endif
+
+    if (!m_notifier) {
+        m_fallbackTimer.setInterval(30000);
+        connect(&m_fallbackTimer, &QTimer::timeout, this, &LocalAddresses::refresh);
+        m_fallbackTimer.start();
+    }
+
+    refresh();
+}
+
+LocalAddresses::~LocalAddresses()
+{
+#ifdef Q_OS_LINUX
+    if (m_netlinkFd >= 0) {
+        delete m_notifier;
+        ::close(m_netlinkFd);
+    }
+#endif
+}
+
+void LocalAddresses::onNetlinkActivated()
+{
+#ifdef Q_OS_LINUX
+    bool changed = false;
+
+    char buffer[8192];
+    ssize_t length;
+    while ((length = ::recv(m_netlinkFd, buffer, sizeof(buffer), 0)) > 0) {
+        int remaining = int(length);
+        for (const nlmsghdr *header = reinterpret_cast<const nlmsghdr*>(buffer); NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+            if (header->nlmsg_type == RTM_NEWADDR || header->nlmsg_type == RTM_DELADDR) {
+                changed = true;
+            }
+        }
+    }
+
+    if (changed) {
+        refresh();
+    }
+#endif
+}
+
+void LocalAddresses::refresh()
+{
+    QSet<QHostAddress> addresses;
+    for (const QHostAddress &address : QNetworkInterface::allAddresses()) {
+        addresses.insert(normalized(address));
+    }
+
+    if (addresses == m_addresses) {
+        return;
+    }
+
+    m_addresses = addresses;
+    qDebug() << "Local addresses changed, have" << m_addresses.count();
+    emit changed();
+}
+
+QHostAddress LocalAddresses::normalized(const QHostAddress &address)
+{
+    // Convoluted because QHostAddress doesn't handle ipv6 stuff nicely by default
+    bool isIpv4 = false;
+    const quint32 ipv4 = address.toIPv4Address(&isIpv4);
+    if (isIpv4) {
+        return QHostAddress(ipv4);
+    }
+
+    QHostAddress ret(address);
+    ret.setScopeId(QString());
+    return ret;
+}
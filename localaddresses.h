@@ -0,0 +1,43 @@
+#ifndef LOCALADDRESSES_H
+#define LOCALADDRESSES_H
+
+#include <QObject>
+#include <QSet>
+#include <QHostAddress>
+#include <QTimer>
+
+class QSocketNotifier;
+
+/// Our own addresses, so we can ignore our own beacons cheaply.
+/// Only re-enumerated when the kernel tells us addresses changed.
+class LocalAddresses : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit LocalAddresses(QObject *parent = nullptr);
+    ~LocalAddresses();
+
+    bool contains(const QHostAddress &address) const {
+        return m_addresses.contains(normalized(address));
+    }
+
+signals:
+    void changed();
+
+private slots:
+    void onNetlinkActivated();
+    void refresh();
+
+private:
+    static QHostAddress normalized(const QHostAddress &address);
+
+    QSet<QHostAddress> m_addresses;
+    int m_netlinkFd = -1;
+    QSocketNotifier *m_notifier = nullptr;
+
+    // Only used if we don't get netlink notifications
+    QTimer m_fallbackTimer;
+};
+
+#endif // LOCALADDRESSES_H
@@ -1,16 +1,63 @@
 #include "mainwindow.h"
+#include "cipherpreference.h"
+#include "connectionhandler.h"
+#include "screencapture.h"
+#include "smallfilereader.h"
 
 #include <QApplication>
 #include <QStandardPaths>
 #include <QLockFile>
 #include <QMessageBox>
+#include <QCommandLineParser>
+#include <QScopedPointer>
+
+// The benchmarks are meant for headless machines as well, so they don't get a GUI
+static QCoreApplication *createApplication(int &argc, char *argv[])
+{
+    for (int i=1; i<argc; i++) {
+        if (qstrncmp(argv[i], "--benchmark-", 12) == 0) {
+            return new QCoreApplication(argc, argv);
+        }
+    }
+    return new QApplication(argc, argv);
+}
 
 int main(int argc, char *argv[])
 {
-    QApplication a(argc, argv);
+    QScopedPointer<QCoreApplication> app(createApplication(argc, argv));
+    QCoreApplication &a = *app;
     a.setOrganizationName("Martin Sandsmark");
     a.setApplicationName("homefilesharing");
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption benchmarkOption("benchmark-crypto", "Measure how fast the TLS ciphers are on this machine and exit");
+    parser.addOption(benchmarkOption);
+    QCommandLineOption screenBenchmarkOption("benchmark-screen", "Capture and encode the screen for a few seconds, print frames per second and bytes per frame and exit");
+    parser.addOption(screenBenchmarkOption);
+    QCommandLineOption smallFilesBenchmarkOption("benchmark-smallfiles", "Read a tree of small files with each reader, print files per second and exit. Creates 100k 4 KiB files if it doesn't exist", "directory");
+    parser.addOption(smallFilesBenchmarkOption);
+    QCommandLineOption handshakeBenchmarkOption("benchmark-handshake", "Time TLS handshakes over localhost from accept to encrypted, print min, median and max and exit");
+    parser.addOption(handshakeBenchmarkOption);
+    parser.process(a);
+
+    if (parser.isSet(benchmarkOption)) {
+        return CipherPreference::runBenchmark() ? 0 : 1;
+    }
+    if (parser.isSet(screenBenchmarkOption)) {
+        return ScreenCapture::runBenchmark() ? 0 : 1;
+    }
+    if (parser.isSet(smallFilesBenchmarkOption)) {
+        return SmallFileReader::runBenchmark(parser.value(smallFilesBenchmarkOption)) ? 0 : 1;
+    }
+    if (parser.isSet(handshakeBenchmarkOption)) {
+        return ConnectionHandler::runHandshakeBenchmark() ? 0 : 1;
+    }
+    if (!qobject_cast<QApplication*>(app.data())) {
+        // Something that starts like one of them, but isn't
+        parser.showHelp(1);
+    }
+
     const QString lockPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation) + "/" + a.applicationName() + ".lock";
     QLockFile lockFile(lockPath);
     lockFile.setStaleLockTime(1);
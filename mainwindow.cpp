@@ -4,9 +4,16 @@
 #include "connectdialog.h"
 #include "randomart.h"
 #include "transferdialog.h"
+#include "hostlistmodel.h"
+#include "transferqueue.h"
+#include "transferprogress.h"
+#include "listingprefetcher.h"
+#include "syncfolder.h"
+#include "mediaserver.h"
 
 #include <QSplitter>
 #include <QListWidget>
+#include <QListView>
 #include <QVBoxLayout>
 #include <QPushButton>
 #include <QMimeDatabase>
@@ -15,18 +22,16 @@
 #include <QFileDialog>
 #include <QCheckBox>
 #include <QSystemTrayIcon>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QLocale>
+#include <QTimer>
+#include <QProcess>
+#include <QDesktopServices>
+#include <QMessageBox>
 
-#ifdef Q_OS_LINUX
-    #include <QApplication>
-    #include <QDesktopWidget>
-    #include <X11/extensions/XTest.h>
-    #include <QX11Info>
-#elif Q_OS_WINDOWS
-    #ifndef WIN32_LEAN_AND_MEAN
-        #define WIN32_LEAN_AND_MEAN
-    #endif
-    #include <windows.h>
-#endif
+#include <QApplication>
+#include <QDesktopWidget>
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent)
 {
@@ -40,18 +45,103 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent)
     leftWidget->setLayout(new QVBoxLayout);
     splitter->addWidget(leftWidget);
 
-    m_list = new QListWidget;
+    m_connectionHandler = new ConnectionHandler(this);
+
+    m_hosts = new HostListModel(&m_connectionHandler->hosts(), this);
+    m_list = new QListView;
+    m_list->setModel(m_hosts);
+    m_list->setUniformItemSizes(true);
     m_trustButton = new QPushButton("Trust");
     m_trustButton->setEnabled(false);
 
-    m_fileList = new QListWidget;
-    splitter->addWidget(m_fileList);
+    QWidget *rightWidget = new QWidget;
+    rightWidget->setLayout(new QVBoxLayout);
+    splitter->addWidget(rightWidget);
+
+    m_fileList = new FileListWidget;
+    m_fileList->setAcceptDrops(true);
+    m_fileList->setDropIndicatorShown(true);
+    rightWidget->layout()->addWidget(m_fileList);
+
+    m_uploadButton = new QPushButton(tr("Upload files..."));
+    m_uploadButton->setEnabled(false);
+    rightWidget->layout()->addWidget(m_uploadButton);
+
+    m_playButton = new QPushButton(tr("Play in media player"));
+    m_playButton->setEnabled(false);
+    rightWidget->layout()->addWidget(m_playButton);
+
+    m_queueLabel = new QLabel(tr("Queued transfers:"));
+    m_queueList = new QListWidget;
+    m_queueList->setMaximumHeight(100);
+    rightWidget->layout()->addWidget(m_queueLabel);
+    rightWidget->layout()->addWidget(m_queueList);
+    m_queueLabel->hide();
+    m_queueList->hide();
+
+    m_transferProgress = new TransferProgress(this);
+    connect(m_transferProgress, &TransferProgress::updated, this, &MainWindow::updateTrayToolTip);
+
+    m_transferQueue = new TransferQueue(m_connectionHandler, this);
+    connect(m_transferQueue, &TransferQueue::queueChanged, this, &MainWindow::updateQueueList);
+    connect(m_transferQueue, &TransferQueue::transferStarted, this, [this](Connection *connection, const TransferQueue::Request &request) {
+        // Still on our thread here, it is moved to a worker right after
+        const QSharedPointer<TransferCounter> counter = m_transferProgress->track(request.size);
+        connection->setProgressCounter(counter);
+
+        // Sync folders push in the background, no window for each batch
+        if (!request.syncRoot.isEmpty()) {
+            return;
+        }
+
+        // Retries after the other side was busy keep the window they had
+        if (TransferDialog *dialog = m_transferDialogs.value(request.id)) {
+            dialog->setTransfer(connection, counter);
+            return;
+        }
+        TransferDialog *dialog = new TransferDialog(this, connection, counter, m_transferProgress);
+        const int id = request.id;
+        connect(dialog, &TransferDialog::cancelRequested, m_transferQueue, [this, id]() {
+            m_transferQueue->cancel(id);
+        });
+        m_transferDialogs.insert(request.id, dialog);
+    });
+    connect(m_transferQueue, &TransferQueue::transferFinished, this, [this](int id) {
+        const QPointer<TransferDialog> dialog = m_transferDialogs.take(id);
+        if (dialog) {
+            dialog->close();
+        }
+    });
+    connect(m_transferQueue, &TransferQueue::uploadFinished, this, [this](HostId host, const QString &directory) {
+        if (host != currentHost()) {
+            return;
+        }
+        m_listings->invalidate(directory);
+        if (directory == m_currentPath) {
+            updateFileList();
+        }
+    });
+
+    m_mediaServer = new MediaServer(m_connectionHandler, this);
+
+    // Pushed in the background as they change
+    SyncFolder::loadFromSettings(m_connectionHandler, m_transferQueue, this);
+
+    m_listings = new ListingPrefetcher(m_connectionHandler, m_transferQueue, this);
+    connect(m_listings, &ListingPrefetcher::listingReady, this, &MainWindow::onListingFinished);
+    connect(m_listings, &ListingPrefetcher::listingChanged, this, &MainWindow::onListingChanged);
+
+    // Fetch folders ahead of time when the mouse rests on them
+    m_fileList->setMouseTracking(true);
+    connect(m_fileList, &QListWidget::itemEntered, this, [this](QListWidgetItem *item) {
+        if (item->text().endsWith('/')) {
+            m_listings->hovered(m_currentPath + item->text());
+        }
+    });
 
     m_mouseControlButton = new QPushButton("Control remote mouse");
     m_mouseControlButton->setEnabled(false);
 
-    m_connectionHandler = new ConnectionHandler(this);
-
     RandomArt *ourRandomart = new RandomArt(m_connectionHandler->ourCertificate());
     QCheckBox *useIconsCheckbox = new QCheckBox(tr("Show icons"));
 
@@ -64,35 +154,60 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent)
     leftWidget->setMaximumWidth(ourRandomart->maximumWidth());
 
     connect(m_connectionHandler, &ConnectionHandler::pingFromHost, this, &MainWindow::onPingFromHost);
+    connect(m_connectionHandler, &ConnectionHandler::hostsEvicted, m_hosts, &HostListModel::forget);
     connect(m_trustButton, &QPushButton::clicked, this, &MainWindow::onTrustClicked);
     connect(m_mouseControlButton, &QPushButton::clicked, this, &MainWindow::onMouseControlClicked);
-    connect(m_list, &QListWidget::currentRowChanged, this, &MainWindow::onHostSelectionChanged);
+    connect(m_list->selectionModel(), &QItemSelectionModel::currentRowChanged, this, [this](const QModelIndex &current) {
+        onHostSelectionChanged(current.row());
+    });
+    connect(m_hosts, &HostListModel::statusChanged, this, &MainWindow::updateTrayIcon);
     connect(m_fileList, &QListWidget::itemDoubleClicked, this, &MainWindow::onFileItemDoubleClicked);
+    connect(m_fileList, &FileListWidget::filesDropped, this, [this](const QStringList &paths, const QString &directory) {
+        uploadFiles(paths, m_currentPath + directory);
+    });
+    connect(m_uploadButton, &QPushButton::clicked, this, &MainWindow::onUploadClicked);
+    connect(m_playButton, &QPushButton::clicked, this, &MainWindow::onPlayClicked);
+    connect(m_fileList, &QListWidget::currentItemChanged, this, [this](QListWidgetItem *item) {
+        m_playButton->setEnabled(item && !item->text().endsWith('/'));
+    });
     connect(useIconsCheckbox, &QCheckBox::stateChanged, ourRandomart, &RandomArt::setUseIcons);
 
     connect(m_tray, &QSystemTrayIcon::activated, this, [this]() { setVisible(!isVisible()); });
 
-    connect(m_connectionHandler, &ConnectionHandler::mouseClickRequested, this, &MainWindow::onMouseClickRequested);
-    connect(m_connectionHandler, &ConnectionHandler::mouseMoveRequested, this, [](const QPoint &position) {
-#ifdef Q_OS_LINUX
-        Display* display = QX11Info::display();
-        Q_ASSERT(display);
-        XTestFakeMotionEvent(display, -1, position.x(), position.y(), CurrentTime);
-        XFlush(display);
-#else
-        QCursor::setPos(position);
-#endif
+    connect(m_connectionHandler, &ConnectionHandler::remoteInputActive, this, [this]() {
+        m_mouseCommandTimer.restart();
+        updateTrayIcon();
+    });
+    connect(m_connectionHandler, &ConnectionHandler::screenViewRequested, this, &MainWindow::onScreenViewRequested);
+    connect(m_connectionHandler, &ConnectionHandler::screenViewChanged, this, [this](bool serving) {
+        m_screenViewers += serving ? 1 : -1;
+        updateTrayIcon();
     });
-    m_cleanupTimer = new QTimer(this);
-    m_cleanupTimer->setSingleShot(true);
-    m_cleanupTimer->setInterval(10000);
-    connect(m_cleanupTimer, &QTimer::timeout, this, &MainWindow::onCleanup);
+}
+
+void MainWindow::onScreenViewRequested(Connection *connection, const QString &hostName)
+{
+    // Lives on a worker thread, we only ever queue calls to it
+    const QPointer<Connection> who(connection);
+
+    QMessageBox *question = new QMessageBox(QMessageBox::Question, tr("Screen view"),
+                                            tr("%1 wants to see your screen while controlling the mouse. Allow it?").arg(hostName),
+                                            QMessageBox::Yes | QMessageBox::No, this);
+    question->setAttribute(Qt::WA_DeleteOnClose);
+    connect(question, &QMessageBox::finished, this, [who](int result) {
+        if (result == QMessageBox::Yes && who) {
+            QMetaObject::invokeMethod(who, &Connection::allowScreenView, Qt::QueuedConnection);
+        }
+    });
+
+    // If they have given up by the time it is answered, who is gone and nothing happens
+    question->open();
 }
 
 void MainWindow::onMouseControlClicked()
 {
-    int row = m_list->currentRow();
-    if (row < 0 || row >= m_visibleHosts.count()) {
+    int row = m_list->currentIndex().row();
+    if (row < 0 || row >= m_hosts->count()) {
         qWarning() << "Invalid selection" << row;
         return;
     }
@@ -120,8 +235,11 @@ void MainWindow::onMouseControlClicked()
 
         connect(mouseInputDialog, &MouseControlWindow::mouseMoved, mouseInputDialog->connection, &Connection::sendMouseMoveEvent);
         connect(mouseInputDialog, &MouseControlWindow::mouseClicked, mouseInputDialog->connection, &Connection::sendMouseClickEvent);
+        connect(mouseInputDialog, &MouseControlWindow::keyChanged, mouseInputDialog->connection, &Connection::sendKeyEvent);
+        connect(mouseInputDialog->connection, &Connection::screenUpdated, mouseInputDialog, &MouseControlWindow::onScreenUpdated);
+        mouseInputDialog->connection->startScreenView();
 
-        mouseInputDialog->setText("Press escape to cancel mouse control");
+        mouseInputDialog->setText("Press escape to cancel remote control");
         mouseInputDialog->setMouseTracking(true);
     });
 
@@ -130,209 +248,65 @@ void MainWindow::onMouseControlClicked()
     mouseInputDialog->setText("Connecting to host...");
 
     mouseInputDialog->show();
-    mouseInputDialog->connection->initiateMouseControl(m_visibleHosts[row]);
+    mouseInputDialog->connection->initiateMouseControl(m_hosts->hostId(row));
 }
 
-void MainWindow::onMouseClickRequested(const QPoint &position, const MouseButton button)
+void MainWindow::onPingFromHost(HostId host, int changes)
 {
-    m_mouseCommandTimer.restart();
-    updateTrayIcon();
-
-    QCursor::setPos(position);
-
-#ifdef Q_OS_LINUX
-    int xButton = 0;
-    switch(button) {
-    case LeftButton:
-        xButton = Button1;
-        break;
-    case MiddleButton:
-        xButton = Button2;
-        break;
-    case RightButton:
-        xButton = Button3;
-        break;
-    case ScrollUp:
-        xButton = Button4;
-        break;
-    case ScrollDown:
-        xButton = Button5;
-        break;
-    default:
-        qWarning() << "unhandled button" << button;
-        return;
-    }
-
-    Display* display = QX11Info::display();
-    Q_ASSERT(display);
-
-    XTestFakeButtonEvent(display, xButton, True, 0);
-    XTestFakeButtonEvent(display, xButton, False, 0);
-    XFlush(display);
-#elif Q_OS_WINDOWS
-    INPUT inputEvent;
-    ZeroMemory(&inputEvent, sizeof(inputEvent));
-    inputEvent.type = INPUT_MOUSE;
-
-    // Press
-    switch(button) {
-    case LeftButton:
-        inputEvent.mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
-        break;
-    case MidButton:
-        inputEvent.mi.dwFlags = MOUSEEVENTF_MIDDLEDOWN;
-        break;
-    case RightButton:
-        inputEvent.mi.dwFlags = MOUSEEVENTF_RIGHTDOWN;
-        break;
-    default:
-        qWarning() << "unhandled button" << button;
-        return;
-    }
-    SendInput(1, &inputEvent, sizeof(inputEvent));
-
-    // Release
-    switch(button) {
-    case LeftButton:
-        inputEvent.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-        break;
-    case MidButton:
-        inputEvent.mi.dwFlags = MOUSEEVENTF_MIDDLEUP;
-        break;
-    case RightButton:
-        inputEvent.mi.dwFlags = MOUSEEVENTF_RIGHTUP;
-        break;
-    default:
-        qWarning() << "unhandled button" << button;
-        return;
-    }
-    SendInput(1, &inputEvent, sizeof(inputEvent));
-#else
-    qWarning() << "Mouse stuff only available on Linux/X11 and windows";
-    Q_UNUSED(position);
-    Q_UNUSED(button);
-#endif
+    m_hosts->update(host, changes);
 }
 
-void MainWindow::onPingFromHost(const Host &host)
-{
-    QString displayName = host.name + " (" + host.address.toString() + ")";;
-    int index = m_visibleHosts.indexOf(host);
-    if (index >= 0) {
-        m_visibleHosts[index] = host;
-        m_visibleHosts[index].offline = false;
-        m_list->item(index)->setText(displayName);
-        m_list->item(index)->setIcon(host.trusted ? QIcon::fromTheme("security-high") : QIcon::fromTheme("security-low"));
-        if (!m_cleanupTimer->isActive()) {
-            m_cleanupTimer->start();
-        }
-        return;
-    }
-
-    Q_ASSERT(m_visibleHosts.count() == m_list->count());
-
-    if (m_visibleHosts.count() > 100) {
-        qWarning() << "Too many";
-        if (m_visibleHosts.last().trusted) {
-            // full with trusted hosts, can't do anything
-            return;
-        }
-        m_visibleHosts.removeLast();
-        delete m_list->takeItem(m_list->count() - 1);
-        Q_ASSERT(m_visibleHosts.count() == m_list->count());
-    }
-
-    // Insert before the first non-trusted
-    int insertPosition = 0;
-    for (int i=0; i<m_visibleHosts.count(); i++) {
-        if (!m_visibleHosts[i].trusted) {
-            break;
-        }
-    }
-
-    QListWidgetItem *item = new QListWidgetItem(displayName);
-    item->setIcon(host.trusted ? QIcon::fromTheme("security-high") : QIcon::fromTheme("security-low"));
-    m_list->insertItem(insertPosition, item);
-    m_visibleHosts.insert(insertPosition, host);
-
-    if (!m_cleanupTimer->isActive()) {
-        m_cleanupTimer->start();
-    }
-
-    updateTrayIcon();
-}
-
-void MainWindow::onCleanup()
-{
-    updateTrayIcon();
-
-    Q_ASSERT(m_visibleHosts.count() == m_list->count());
-
-    if (m_visibleHosts.isEmpty()) {
-        return;
-    }
-
-    bool anyActive = false;
-    for (int i=0; i<m_visibleHosts.size(); i++) {
-        if (m_visibleHosts[i].offline) {
-            continue;
-        }
-        if (m_visibleHosts[i].lastSeen.msecsTo(QDateTime::currentDateTime()) > 5000) {
-            m_visibleHosts[i].offline = true;
-            m_list->item(i)->setIcon(QIcon::fromTheme("network-offline"));
-            continue;
-        }
-        anyActive = true;
-    }
-
-    if (anyActive) {
-        m_cleanupTimer->start(10000);
-    }
-}
 void MainWindow::onTrustClicked()
 {
-    int row = m_list->currentRow();
-    if (row < 0 || row >= m_visibleHosts.count()) {
+    int row = m_list->currentIndex().row();
+    if (row < 0 || row >= m_hosts->count()) {
         qWarning() << "Invalid selection" << row;
         return;
     }
 
-    ConnectDialog *dialog = new ConnectDialog(m_visibleHosts[row]);
+    const HostId host = m_hosts->hostId(row);
+
+    ConnectDialog *dialog = new ConnectDialog(m_connectionHandler->hosts().host(host));
     if (dialog->exec() == QDialog::Rejected) {
         return;
     }
 
-    m_visibleHosts[row].trusted = true;
-    m_list->item(row)->setIcon(QIcon::fromTheme("security-high"));
-    m_connectionHandler->trustHost(m_visibleHosts[row]);
+    m_connectionHandler->trustHost(host);
+    m_hosts->onTrustChanged(host);
 }
 
 void MainWindow::onHostSelectionChanged(int row)
 {
-    if (row < 0 || row >= m_visibleHosts.count()) {
+    if (row < 0 || row >= m_hosts->count()) {
         qWarning() << "Invalid selection" << row;
         m_trustButton->setEnabled(false);
         m_mouseControlButton->setEnabled(false);
+        m_uploadButton->setEnabled(false);
+        m_listings->setHost(InvalidHostId);
         return;
     }
 
-    const Host &host = m_visibleHosts[row];
-
-    if (host.offline) {
+    if (m_hosts->isOffline(row)) {
         m_trustButton->setEnabled(false);
         m_mouseControlButton->setEnabled(false);
+        m_uploadButton->setEnabled(false);
         m_fileList->clear();
+        m_listings->setHost(InvalidHostId);
         return;
     }
 
-    if (!host.trusted) {
+    if (!m_connectionHandler->hosts().isTrusted(m_hosts->hostId(row))) {
         m_trustButton->setEnabled(true);
+        m_uploadButton->setEnabled(false);
+        m_listings->setHost(InvalidHostId);
         return;
     }
 
 
     m_trustButton->setEnabled(false);
     m_mouseControlButton->setEnabled(true);
+    m_uploadButton->setEnabled(true);
+    m_listings->setHost(m_hosts->hostId(row));
     m_currentPath = "/";
     updateFileList();
 }
@@ -342,31 +316,120 @@ void MainWindow::onListingFinished(const QString &path, const QStringList &names
     if (path != m_currentPath) {
         return;
     }
-    QMimeDatabase mimeDb;
-    QIcon folderIcon = QIcon::fromTheme(mimeDb.mimeTypeForName("inode/directory").iconName());
-    for (QString name : names) {
-        int separatorPos = name.indexOf(':');
-        if (separatorPos == -1) {
-            qDebug() << "Invalid line" << name;
+
+    // Only the folder sizes changed, don't throw away the selection and scroll position
+    bool sameNames = m_fileList->count() == names.count();
+    for (int i=0; sameNames && i<names.count(); i++) {
+        sameNames = m_fileList->item(i)->text() == ListingPrefetcher::entryName(names[i]);
+    }
+    if (!sameNames) {
+        m_fileList->clear();
+    }
+
+    bool hasStale = false;
+    for (int i=0; i<names.count(); i++) {
+        QListWidgetItem *item = sameNames ? m_fileList->item(i) : new QListWidgetItem(ListingPrefetcher::entryName(names[i]));
+        hasStale = updateFileItem(item, names[i]) || hasStale;
+        if (!sameNames) {
+            m_fileList->addItem(item);
         }
-        int size = name.left(separatorPos).toInt();
-        name = name.mid(separatorPos + 1);
+    }
 
-        QListWidgetItem *item = new QListWidgetItem(name);
-        if (name.endsWith('/')) {
-            item->setIcon(folderIcon);
-        } else {
-            item->setIcon(QIcon::fromTheme(mimeDb.mimeTypeForFile(name).iconName()));
-            item->setData(Qt::UserRole, size);
+    if (hasStale) {
+        scheduleStaleRefresh(path);
+    }
+}
+
+void MainWindow::onListingChanged(const QString &path, const QStringList &entries, const QStringList &removed)
+{
+    if (path != m_currentPath) {
+        return;
+    }
+
+    for (const QString &name : removed) {
+        qDeleteAll(m_fileList->findItems(name, Qt::MatchExactly));
+    }
+
+    bool hasStale = false;
+    for (const QString &entry : entries) {
+        const QString name = ListingPrefetcher::entryName(entry);
+        const QList<QListWidgetItem*> existing = m_fileList->findItems(name, Qt::MatchExactly);
+        if (!existing.isEmpty()) {
+            hasStale = updateFileItem(existing.first(), entry) || hasStale;
+            continue;
         }
 
-        m_fileList->addItem(item);
+        // Where the other side would have put it
+        int row = 0;
+        while (row < m_fileList->count() && !ListingPrefetcher::nameLessThan(name, m_fileList->item(row)->text())) {
+            row++;
+        }
+        QListWidgetItem *item = new QListWidgetItem(name);
+        hasStale = updateFileItem(item, entry) || hasStale;
+        m_fileList->insertItem(row, item);
+    }
+
+    if (hasStale) {
+        scheduleStaleRefresh(path);
+    }
+}
+
+bool MainWindow::updateFileItem(QListWidgetItem *item, const QString &entry)
+{
+    const int separatorPos = entry.indexOf(':');
+    if (separatorPos == -1) {
+        qDebug() << "Invalid line" << entry;
+    }
+    const QStringList sizeFields = entry.left(separatorPos).split(',');
+    const qint64 size = sizeFields.first().toLongLong();
+    const QString name = entry.mid(separatorPos + 1);
+
+    QMimeDatabase mimeDb;
+    if (!name.endsWith('/')) {
+        item->setIcon(QIcon::fromTheme(mimeDb.mimeTypeForFile(name).iconName()));
+        item->setData(Qt::UserRole, size);
+        return false;
+    }
+
+    item->setIcon(QIcon::fromTheme(mimeDb.mimeTypeForName("inode/directory").iconName()));
+
+    // Folders can come with their total size and file count
+    if (sizeFields.count() < 2) {
+        return false;
     }
+    const bool stale = sizeFields.count() > 2 && sizeFields[2] == "stale";
+    const bool partial = sizeFields.count() > 2 && sizeFields[2] == "partial";
+    QString toolTip = tr("%1 in %n file(s)", nullptr, sizeFields[1].toInt()).arg(QLocale().formattedDataSize(size));
+    if (stale) {
+        toolTip += tr(", still counting");
+    } else if (partial) {
+        toolTip += tr(" or more, not everything could be counted");
+    }
+    item->setToolTip(toolTip);
+    item->setData(Qt::UserRole, size);
+    return stale;
+}
+
+void MainWindow::scheduleStaleRefresh(const QString &path)
+{
+    // Ask again until the other side is done counting
+    if (m_staleRefreshPending) {
+        return;
+    }
+    m_staleRefreshPending = true;
+    QTimer::singleShot(staleRefreshInterval, this, [this, path]() {
+        m_staleRefreshPending = false;
+        if (path == m_currentPath) {
+            m_listings->invalidate(path);
+            m_listings->fetch(path);
+        }
+    });
 }
 
 void MainWindow::onFileItemDoubleClicked(QListWidgetItem *item)
 {
-    if (currentHost().offline) {
+    const int row = m_list->currentIndex().row();
+    if (row < 0 || row >= m_hosts->count() || m_hosts->isOffline(row)) {
         return;
     }
 
@@ -388,53 +451,128 @@ void MainWindow::onFileItemDoubleClicked(QListWidgetItem *item)
         return;
     }
 
-    Connection *connection = new Connection(m_connectionHandler);
-    new TransferDialog(this, connection, item->data(Qt::UserRole).toInt());
+    // Don't let small files get stuck behind big ones, if ordering by priority
+    const qint64 size = item->data(Qt::UserRole).toLongLong();
+    const int priority = size < smallFileSize ? 1 : 0;
 
-    connection->download(currentHost(), m_currentPath + filename, localPath);
+    m_transferQueue->enqueueDownload(m_hosts->hostId(row), m_currentPath + filename, localPath, size, priority);
 }
 
-Host MainWindow::currentHost()
+void MainWindow::onPlayClicked()
 {
-    int row = m_list->currentRow();
-    if (row < 0 || row >= m_visibleHosts.count()) {
-        qWarning() << "Invalid selection" << row;
-        return Host();
+    const int row = m_list->currentIndex().row();
+    QListWidgetItem *item = m_fileList->currentItem();
+    if (row < 0 || row >= m_hosts->count() || m_hosts->isOffline(row) || !item || item->text().endsWith('/')) {
+        return;
+    }
+
+    const QUrl url = m_mediaServer->urlFor(m_hosts->hostId(row), m_currentPath + item->text());
+    if (url.isEmpty()) {
+        return;
     }
 
-    return m_visibleHosts[row];
+    // Whatever is set up for http otherwise, usually a browser, which plays most things
+    const QString player = QSettings().value("stream/player").toString();
+    const bool started = player.isEmpty() ? QDesktopServices::openUrl(url) :
+            QProcess::startDetached(player, { url.toString(QUrl::FullyEncoded) });
+    if (!started) {
+        qWarning() << "Failed to open" << url << "in" << (player.isEmpty() ? QStringLiteral("the default handler") : player);
+    }
 }
 
-void MainWindow::updateFileList()
+void MainWindow::onUploadClicked()
 {
-    m_fileList->clear();
+    QSettings settings;
+    const QString lastPath = settings.value("lastuploadpath", QStandardPaths::writableLocation(QStandardPaths::DocumentsLocation)).toString();
 
-    if (m_currentConnection) {
-        disconnect(m_currentConnection, &Connection::listingReceived, this, nullptr);
-        m_currentConnection->deleteLater();
+    const QStringList paths = QFileDialog::getOpenFileNames(this, tr("Files to upload"), lastPath);
+    if (paths.isEmpty()) {
+        return;
     }
+    settings.setValue("lastuploadpath", QFileInfo(paths.first()).absolutePath());
 
-    m_currentConnection = new Connection(m_connectionHandler);
-    connect(m_currentConnection, &Connection::listingReceived, this, &MainWindow::onListingFinished);
-    m_currentConnection->list(currentHost(), m_currentPath);
+    uploadFiles(paths, m_currentPath);
+}
+
+void MainWindow::uploadFiles(const QStringList &paths, const QString &remoteDirectory)
+{
+    const int row = m_list->currentIndex().row();
+    if (row < 0 || row >= m_hosts->count() || m_hosts->isOffline(row)) {
+        return;
+    }
+    const HostId host = m_hosts->hostId(row);
+    if (!m_connectionHandler->hosts().isTrusted(host)) {
+        return;
+    }
+
+    // Everything goes over one connection, the other side gets them one after another
+    QStringList files;
+    qint64 totalSize = 0;
+    for (const QString &path : paths) {
+        const QFileInfo info(path);
+        if (!info.isFile()) {
+            qWarning() << "Can only upload plain files, skipping" << path;
+            continue;
+        }
+        files.append(info.absoluteFilePath());
+        totalSize += info.size();
+    }
+    if (files.isEmpty()) {
+        return;
+    }
+
+    m_transferQueue->enqueueUpload(host, remoteDirectory, files, totalSize);
+}
+
+void MainWindow::updateQueueList()
+{
+    m_queueList->clear();
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (const TransferQueue::Request &request : m_transferQueue->pending()) {
+        QString text = QFileInfo(request.remotePath).fileName();
+        if (!request.uploadPaths.isEmpty()) {
+            text = tr("%n file(s) to %1", nullptr, request.uploadPaths.count()).arg(request.remotePath);
+        }
+        if (request.notBefore > now) {
+            text += tr(" (busy, retrying in %1 s)").arg((request.notBefore - now + 999) / 1000);
+        } else {
+            text += tr(" (waiting)");
+        }
+        m_queueList->addItem(text);
+    }
+
+    const bool hasPending = m_queueList->count() > 0;
+    m_queueLabel->setVisible(hasPending);
+    m_queueList->setVisible(hasPending);
+}
+
+HostId MainWindow::currentHost()
+{
+    int row = m_list->currentIndex().row();
+    if (row < 0 || row >= m_hosts->count()) {
+        qWarning() << "Invalid selection" << row;
+        return InvalidHostId;
+    }
+
+    return m_hosts->hostId(row);
+}
+
+void MainWindow::updateFileList()
+{
+    m_fileList->clear();
+    m_listings->fetch(m_currentPath);
 }
 
 void MainWindow::updateTrayIcon()
 {
     QString trayIcon = "state-offline";
-    if (m_mouseCommandTimer.isValid() && m_mouseCommandTimer.elapsed() < 10000) {
+    if (m_screenViewers > 0 || (m_mouseCommandTimer.isValid() && m_mouseCommandTimer.elapsed() < 10000)) {
         trayIcon = "state-warning";
-    } else if (!m_visibleHosts.isEmpty()) {
+    } else if (m_hosts->hasOnlineTrusted()) {
+        trayIcon = "state-ok";
+    } else if (m_hosts->count() > 0) {
         trayIcon = "state-information";
-        for (const Host &host : m_visibleHosts) {
-            if (host.offline) {
-                continue;
-            }
-            if (host.trusted) {
-                trayIcon = "state-ok";
-                break;
-            }
-        }
     }
     if (trayIcon == m_trayIcon) {
         return;
@@ -443,3 +581,15 @@ void MainWindow::updateTrayIcon()
 
     m_tray->setIcon(QIcon::fromTheme(m_trayIcon));
 }
+
+void MainWindow::updateTrayToolTip()
+{
+    if (m_transferProgress->activeCount() == 0) {
+        m_tray->setToolTip(QString());
+        return;
+    }
+
+    m_tray->setToolTip(tr("%n transfer(s), %1/s, %2 left", nullptr, m_transferProgress->activeCount())
+                       .arg(QLocale().formattedDataSize(qint64(m_transferProgress->rate())))
+                       .arg(TransferProgress::formatEta(m_transferProgress->eta())));
+}
@@ -7,11 +7,24 @@
 #include <QMouseEvent>
 #include <QWheelEvent>
 #include <QElapsedTimer>
+#include <QListWidget>
+#include <QMimeData>
+#include <QDropEvent>
+#include <QUrl>
+#include <QGuiApplication>
+#include <QHash>
+#include <QSet>
 
 #include "connectionhandler.h"
 #include "connection.h"
 
-class QListWidget;
+class QListView;
+class HostListModel;
+class TransferQueue;
+class TransferProgress;
+class TransferDialog;
+class ListingPrefetcher;
+class MediaServer;
 class QListWidgetItem;
 class QPushButton;
 class QSystemTrayIcon;
@@ -23,70 +36,195 @@ class MouseControlWindow : public QLabel
 signals:
     void mouseMoved(const QPoint &position);
     void mouseClicked(const QPoint &position, const MouseButton button);
+    void keyChanged(quint32 keysym, bool pressed);
 
 public:
     QPointer<Connection> connection;
 
+public slots:
+    void onScreenUpdated(const QImage &screen) {
+        m_remoteSize = screen.size();
+        setPixmap(QPixmap::fromImage(screen).scaled(size(), Qt::KeepAspectRatio, Qt::FastTransformation));
+    }
 
 protected:
     void mouseMoveEvent(QMouseEvent *event) override {
-        emit mouseMoved(event->globalPos());
+        emit mouseMoved(remotePosition(event->pos(), event->globalPos()));
     }
     void mousePressEvent(QMouseEvent *event) override {
-        emit mouseClicked(event->globalPos(), MouseButton(event->button()));
+        emit mouseClicked(remotePosition(event->pos(), event->globalPos()), MouseButton(event->button()));
     }
     void wheelEvent(QWheelEvent *event) override {
+        const QPoint position = remotePosition(event->position().toPoint(), event->globalPosition().toPoint());
         if (event->angleDelta().y() > 0) {
-            emit mouseClicked(event->globalPosition().toPoint(), ScrollUp);
+            emit mouseClicked(position, ScrollUp);
         } else if (event->angleDelta().y() < 0) {
-            emit mouseClicked(event->globalPosition().toPoint(), ScrollDown);
+            emit mouseClicked(position, ScrollDown);
         }
     }
     void keyPressEvent(QKeyEvent *event) override {
         if (event->key() == Qt::Key_Escape) {
             close();
+            return;
+        }
+        sendKey(event, true);
+    }
+    void keyReleaseEvent(QKeyEvent *event) override {
+        if (event->key() != Qt::Key_Escape) {
+            sendKey(event, false);
+        }
+    }
+
+    // We won't see the releases for whatever is held down now
+    void focusOutEvent(QFocusEvent *event) override {
+        releaseKeys();
+        QLabel::focusOutEvent(event);
+    }
+    void closeEvent(QCloseEvent *event) override {
+        releaseKeys();
+        QLabel::closeEvent(event);
+    }
+
+private:
+    // The other side repeats held keys by itself
+    void sendKey(QKeyEvent *event, bool pressed) {
+        // On X11 the native key is the keysym
+        if (event->isAutoRepeat() || !event->nativeVirtualKey() || QGuiApplication::platformName() != "xcb") {
+            return;
+        }
+        const quint32 keysym = event->nativeVirtualKey();
+        if (pressed) {
+            m_pressedKeys.insert(keysym);
+        } else if (!m_pressedKeys.remove(keysym)) {
+            return;
+        }
+        emit keyChanged(keysym, pressed);
+    }
+
+    void releaseKeys() {
+        const QSet<quint32> pressed = m_pressedKeys;
+        m_pressedKeys.clear();
+        for (const quint32 keysym : pressed) {
+            emit keyChanged(keysym, false);
+        }
+    }
+
+    // Without a picture of the remote screen we just pass on where we are on ours
+    QPoint remotePosition(const QPoint &local, const QPoint &global) const {
+        if (m_remoteSize.isEmpty()) {
+            return global;
+        }
+        const QSize shown = m_remoteSize.scaled(size(), Qt::KeepAspectRatio);
+        const QPoint offset((width() - shown.width()) / 2, (height() - shown.height()) / 2);
+        const QPoint position = local - offset;
+        return QPoint(qBound(0, position.x() * m_remoteSize.width() / shown.width(), m_remoteSize.width() - 1),
+                      qBound(0, position.y() * m_remoteSize.height() / shown.height(), m_remoteSize.height() - 1));
+    }
+
+    QSize m_remoteSize;
+    QSet<quint32> m_pressedKeys; // keysyms sent as down and not up yet
+};
+
+/// Remote file listing that local files can be dropped on to upload them
+class FileListWidget : public QListWidget
+{
+    Q_OBJECT
+
+signals:
+    // Directory is the folder item they were dropped on, or empty
+    void filesDropped(const QStringList &paths, const QString &directory);
+
+protected:
+    void dragEnterEvent(QDragEnterEvent *event) override {
+        if (event->mimeData()->hasUrls()) {
+            event->acceptProposedAction();
         }
     }
+    void dragMoveEvent(QDragMoveEvent *event) override {
+        if (event->mimeData()->hasUrls()) {
+            event->acceptProposedAction();
+        }
+    }
+    void dropEvent(QDropEvent *event) override {
+        QStringList paths;
+        for (const QUrl &url : event->mimeData()->urls()) {
+            if (url.isLocalFile()) {
+                paths.append(url.toLocalFile());
+            }
+        }
+        if (paths.isEmpty()) {
+            return;
+        }
+
+        QString directory;
+        const QListWidgetItem *target = itemAt(event->pos());
+        if (target && target->text().endsWith('/')) {
+            directory = target->text();
+        }
+
+        event->acceptProposedAction();
+        emit filesDropped(paths, directory);
+    }
 };
 
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
+
+    static constexpr qint64 smallFileSize = 10 * 1024 * 1024;
+    static constexpr int staleRefreshInterval = 2000; // ms, while folder sizes are still being counted
+
 public:
     explicit MainWindow(QWidget *parent = nullptr);
 
 signals:
 
 private slots:
-    void onPingFromHost(const Host &host);
+    void onPingFromHost(HostId host, int changes);
     void onTrustClicked();
     void onHostSelectionChanged(int row);
     void onListingFinished(const QString &path, const QStringList &names);
+    void onListingChanged(const QString &path, const QStringList &entries, const QStringList &removed);
     void onFileItemDoubleClicked(QListWidgetItem *item);
-    void onCleanup();
+    void onUploadClicked();
+    void onPlayClicked();
+    void uploadFiles(const QStringList &paths, const QString &remoteDirectory);
 
     void onMouseControlClicked();
-    void onMouseClickRequested(const QPoint &position, const MouseButton button);
+    void onScreenViewRequested(Connection *connection, const QString &hostName);
 
     void updateTrayIcon();
+    void updateQueueList();
+    void updateTrayToolTip();
 
 private:
-    Host currentHost();
+    HostId currentHost();
     void updateFileList();
+    bool updateFileItem(QListWidgetItem *item, const QString &entry); // true if the size is still being counted
+    void scheduleStaleRefresh(const QString &path);
 
-    QListWidget *m_list;
+    QListView *m_list;
+    HostListModel *m_hosts;
     QPointer<ConnectionHandler> m_connectionHandler;
-    QList<Host> m_visibleHosts;
     QPushButton *m_trustButton;
     QPushButton *m_mouseControlButton;
-    QPointer<Connection> m_currentConnection;
+    QPushButton *m_uploadButton;
+    QPushButton *m_playButton;
 
-    QPointer<QTimer> m_cleanupTimer;
+    FileListWidget *m_fileList;
 
-    QListWidget *m_fileList;
+    TransferQueue *m_transferQueue;
+    TransferProgress *m_transferProgress;
+    QHash<int, QPointer<TransferDialog>> m_transferDialogs; // by queue request id
+    ListingPrefetcher *m_listings;
+    MediaServer *m_mediaServer;
+    QLabel *m_queueLabel;
+    QListWidget *m_queueList;
 
     QString m_currentPath;
+    bool m_staleRefreshPending = false;
     QElapsedTimer m_mouseCommandTimer;
+    int m_screenViewers = 0; // others looking at our screen right now
 
     QSystemTrayIcon *m_tray;
     QString m_trayIcon;
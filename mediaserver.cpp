@@ -0,0 +1,278 @@
+#include "mediaserver.h"
+
+#include "connectionhandler.h"
+#include "remotefilecache.h"
+
+#include <QTcpSocket>
+#include <QMimeDatabase>
+#include <QRandomGenerator>
+#include <QSettings>
+#include <QDebug>
+
+MediaServer::MediaServer(ConnectionHandler *handler, QObject *parent) : QTcpServer(parent),
+    m_handler(handler),
+    m_cache(new RemoteFileCache(handler, this))
+{
+    QByteArray token(16, Qt::Uninitialized);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(token.data()), token.size() / int(sizeof(quint32)));
+    m_token = token.toHex();
+
+    connect(this, &QTcpServer::newConnection, this, &MediaServer::onNewConnection);
+    connect(m_cache, &RemoteFileCache::blockReady, this, &MediaServer::onBlockReady);
+    connect(m_cache, &RemoteFileCache::readFailed, this, &MediaServer::onReadFailed);
+}
+
+QUrl MediaServer::urlFor(HostId host, const QString &path)
+{
+    if (!isListening() && !listen(QHostAddress::LocalHost, quint16(QSettings().value("stream/port", 0).toUInt()))) {
+        qWarning() << "Failed to listen for media players" << errorString();
+        return QUrl();
+    }
+
+    QString remotePath = path;
+    while (remotePath.startsWith('/')) {
+        remotePath.remove(0, 1);
+    }
+
+    QUrl url;
+    url.setScheme("http");
+    url.setHost(serverAddress().toString());
+    url.setPort(serverPort());
+    url.setPath('/' + QString::fromLatin1(m_token) + '/' + QString::fromLatin1(m_handler->hosts().fingerprint(host).toHex()) + '/' + remotePath,
+                QUrl::DecodedMode);
+    return url;
+}
+
+void MediaServer::onNewConnection()
+{
+    while (hasPendingConnections()) {
+        QTcpSocket *socket = nextPendingConnection();
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            readRequest(socket);
+        });
+        connect(socket, &QTcpSocket::bytesWritten, this, [this, socket]() {
+            pump(socket);
+        });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            m_streams.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void MediaServer::readRequest(QTcpSocket *socket)
+{
+    // One request per connection, anything after it is ignored
+    if (m_streams.contains(socket) || socket->state() != QAbstractSocket::ConnectedState) {
+        socket->readAll();
+        return;
+    }
+
+    const int headerEnd = socket->peek(maxRequestSize).indexOf("\r\n\r\n");
+    if (headerEnd == -1) {
+        if (socket->bytesAvailable() >= maxRequestSize) {
+            sendError(socket, 431, "Request Header Fields Too Large");
+        }
+        return;
+    }
+    const QList<QByteArray> lines = socket->read(headerEnd + 4).split('\n');
+
+    const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    if (requestLine.count() != 3) {
+        sendError(socket, 400, "Bad Request");
+        return;
+    }
+
+    Stream stream;
+    const QByteArray &method = requestLine[0];
+    if (method == "HEAD") {
+        stream.headOnly = true;
+    } else if (method != "GET") {
+        sendError(socket, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return;
+    }
+
+    // /token/fingerprint/path
+    QByteArray target = requestLine[1];
+    const int query = target.indexOf('?');
+    if (query != -1) {
+        target.truncate(query);
+    }
+    const QString path = QUrl::fromPercentEncoding(target);
+    const QString prefix = '/' + QString::fromLatin1(m_token) + '/';
+    const int fingerprintEnd = path.indexOf('/', prefix.length());
+    if (!path.startsWith(prefix) || fingerprintEnd == -1 || !m_handler) {
+        sendError(socket, 404, "Not Found");
+        return;
+    }
+
+    const QByteArray fingerprint = QByteArray::fromHex(path.mid(prefix.length(), fingerprintEnd - prefix.length()).toLatin1());
+    stream.host = m_handler->hosts().find(fingerprint);
+    if (stream.host == InvalidHostId || !m_handler->hosts().isTrusted(stream.host)) {
+        sendError(socket, 404, "Not Found");
+        return;
+    }
+    stream.path = path.mid(fingerprintEnd);
+
+    // Only single ranges, players don't ask for more. Without one they get it all.
+    for (int i=1; i<lines.count(); i++) {
+        const QByteArray line = lines[i].trimmed();
+        const int colon = line.indexOf(':');
+        if (colon == -1 || line.left(colon).trimmed().toLower() != "range") {
+            continue;
+        }
+        const QByteArray value = line.mid(colon + 1).trimmed();
+        if (!value.startsWith("bytes=") || value.contains(',')) {
+            continue;
+        }
+        const QByteArray spec = value.mid(6);
+        const int dash = spec.indexOf('-');
+        if (dash == -1) {
+            continue;
+        }
+
+        bool firstOk = false;
+        bool lastOk = false;
+        const qint64 first = spec.left(dash).toLongLong(&firstOk);
+        const qint64 last = spec.mid(dash + 1).toLongLong(&lastOk);
+        if (firstOk && first >= 0) {
+            stream.hasRange = true;
+            stream.rangeFirst = first;
+            stream.rangeLast = lastOk ? last : -1;
+        } else if (dash == 0 && lastOk && last > 0) {
+            stream.hasRange = true;
+            stream.suffixLength = last;
+        }
+    }
+
+    qDebug() << "Media player wants" << stream.path << "from" << m_handler->hosts().name(stream.host)
+             << (stream.hasRange ? "range" : "") << stream.rangeFirst << stream.rangeLast << stream.suffixLength;
+
+    m_streams.insert(socket, stream);
+    startResponse(socket);
+}
+
+void MediaServer::startResponse(QTcpSocket *socket)
+{
+    QHash<QTcpSocket*, Stream>::iterator it = m_streams.find(socket);
+    if (it == m_streams.end() || it->started) {
+        return;
+    }
+    Stream &stream = *it;
+
+    // Need the size for the headers, and the start of what they want is where we'll read anyway
+    const qint64 size = m_cache->fileSize(stream.host, stream.path);
+    if (size < 0) {
+        m_cache->read(stream.host, stream.path, qMax<qint64>(0, stream.rangeFirst));
+        return;
+    }
+
+    qint64 first = 0;
+    qint64 last = size - 1;
+    if (stream.hasRange) {
+        if (stream.suffixLength >= 0) {
+            first = qMax<qint64>(0, size - stream.suffixLength);
+        } else {
+            first = stream.rangeFirst;
+            if (stream.rangeLast >= 0) {
+                last = qMin(stream.rangeLast, size - 1);
+            }
+        }
+        if (first >= size || first > last) {
+            sendError(socket, 416, "Range Not Satisfiable", "Content-Range: bytes */" + QByteArray::number(size) + "\r\n");
+            return;
+        }
+    }
+
+    QByteArray header = stream.hasRange ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+    header += "Content-Type: " + QMimeDatabase().mimeTypeForFile(stream.path, QMimeDatabase::MatchExtension).name().toLatin1() + "\r\n";
+    header += "Content-Length: " + QByteArray::number(last - first + 1) + "\r\n";
+    header += "Accept-Ranges: bytes\r\n";
+    if (stream.hasRange) {
+        header += "Content-Range: bytes " + QByteArray::number(first) + '-' + QByteArray::number(last) + '/' + QByteArray::number(size) + "\r\n";
+    }
+    header += "Connection: close\r\n\r\n";
+    socket->write(header);
+
+    stream.started = true;
+    stream.position = first;
+    stream.end = last + 1;
+
+    if (stream.headOnly || stream.position >= stream.end) {
+        socket->disconnectFromHost();
+        return;
+    }
+    pump(socket);
+}
+
+void MediaServer::pump(QTcpSocket *socket)
+{
+    QHash<QTcpSocket*, Stream>::iterator it = m_streams.find(socket);
+    if (it == m_streams.end() || !it->started) {
+        return;
+    }
+    Stream &stream = *it;
+
+    while (stream.position < stream.end && socket->bytesToWrite() < maxBuffered) {
+        // Also keeps the read ahead going from where the player is
+        m_cache->read(stream.host, stream.path, stream.position);
+
+        const QByteArray data = m_cache->cached(stream.host, stream.path, stream.position);
+        if (data.isEmpty()) {
+            // Back here when it arrives
+            return;
+        }
+        const QByteArray part = data.left(int(qMin<qint64>(data.size(), stream.end - stream.position)));
+        socket->write(part);
+        stream.position += part.size();
+    }
+
+    if (stream.position >= stream.end) {
+        socket->disconnectFromHost();
+    }
+}
+
+void MediaServer::onBlockReady(HostId host, const QString &path)
+{
+    const QList<QTcpSocket*> sockets = m_streams.keys();
+    for (QTcpSocket *socket : sockets) {
+        const QHash<QTcpSocket*, Stream>::const_iterator it = m_streams.constFind(socket);
+        if (it == m_streams.constEnd() || it->host != host || it->path != path) {
+            continue;
+        }
+        if (it->started) {
+            pump(socket);
+        } else {
+            startResponse(socket);
+        }
+    }
+}
+
+void MediaServer::onReadFailed(HostId host, const QString &path)
+{
+    const QList<QTcpSocket*> sockets = m_streams.keys();
+    for (QTcpSocket *socket : sockets) {
+        const QHash<QTcpSocket*, Stream>::const_iterator it = m_streams.constFind(socket);
+        if (it == m_streams.constEnd() || it->host != host || (!path.isEmpty() && it->path != path)) {
+            continue;
+        }
+
+        // Too late to tell them nicely once the data has started
+        if (it->started) {
+            socket->abort();
+        } else if (path.isEmpty()) {
+            sendError(socket, 502, "Bad Gateway");
+        } else {
+            sendError(socket, 404, "Not Found");
+        }
+    }
+}
+
+void MediaServer::sendError(QTcpSocket *socket, int code, const QByteArray &reason, const QByteArray &extraHeaders)
+{
+    m_streams.remove(socket);
+
+    socket->write("HTTP/1.1 " + QByteArray::number(code) + ' ' + reason + "\r\n" +
+                  "Content-Length: 0\r\n" + extraHeaders + "Connection: close\r\n\r\n");
+    socket->disconnectFromHost();
+}
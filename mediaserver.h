@@ -0,0 +1,67 @@
+#ifndef MEDIASERVER_H
+#define MEDIASERVER_H
+
+#include <QTcpServer>
+#include <QPointer>
+#include <QHash>
+#include <QUrl>
+
+#include "hosttable.h"
+
+class QTcpSocket;
+class ConnectionHandler;
+class RemoteFileCache;
+
+/// Lets local media players play files straight off other hosts. Serves
+/// them over plain HTTP on the loopback interface, with Range support so
+/// players can seek, and reads them through a RemoteFileCache. The URLs
+/// have a random token in them so other users on this machine can't just
+/// browse our peers. One response per connection, players reconnect.
+class MediaServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    static constexpr qint64 maxBuffered = 1024 * 1024; // per player, written but not sent yet
+    static constexpr int maxRequestSize = 16 * 1024;
+
+    MediaServer(ConnectionHandler *handler, QObject *parent);
+
+    // Starts listening the first time, an empty URL if it can't
+    QUrl urlFor(HostId host, const QString &path);
+
+private slots:
+    void onNewConnection();
+    void onBlockReady(HostId host, const QString &path);
+    void onReadFailed(HostId host, const QString &path);
+
+private:
+    struct Stream {
+        HostId host = InvalidHostId;
+        QString path;
+        bool headOnly = false;
+
+        // As asked for, -1 where not given
+        bool hasRange = false;
+        qint64 rangeFirst = -1;
+        qint64 rangeLast = -1;
+        qint64 suffixLength = -1; // "the last n bytes"
+
+        bool started = false; // headers are out
+        qint64 position = 0;
+        qint64 end = 0;
+    };
+
+    void readRequest(QTcpSocket *socket);
+    void startResponse(QTcpSocket *socket);
+    void pump(QTcpSocket *socket);
+    void sendError(QTcpSocket *socket, int code, const QByteArray &reason, const QByteArray &extraHeaders = QByteArray());
+
+    QPointer<ConnectionHandler> m_handler;
+    RemoteFileCache *m_cache;
+    QByteArray m_token;
+
+    QHash<QTcpSocket*, Stream> m_streams; // once the request is read
+};
+
+#endif // MEDIASERVER_H
@@ -0,0 +1,310 @@
+#include "remotefilecache.h"
+
+#include "connection.h"
+#include "connectionhandler.h"
+
+#include <QDateTime>
+#include <QDebug>
+
+#include <algorithm>
+
+RemoteFileCache::RemoteFileCache(ConnectionHandler *handler, QObject *parent) : QObject(parent),
+    m_handler(handler)
+{
+    m_idleTimer.setSingleShot(true);
+    m_idleTimer.setInterval(idleTimeout);
+    connect(&m_idleTimer, &QTimer::timeout, this, &RemoteFileCache::closeSessions);
+
+    connect(handler, &ConnectionHandler::hostsEvicted, this, [this](const QVector<HostId> &ids) {
+        for (const HostId host : ids) {
+            forgetHost(host);
+        }
+    });
+}
+
+void RemoteFileCache::read(HostId host, const QString &path, qint64 offset)
+{
+    m_idleTimer.start();
+
+    const qint64 first = offset / blockSize;
+    qint64 last = first + readAheadBlocks;
+    const qint64 size = fileSize(host, path);
+    if (size >= 0) {
+        last = qMin(last, (size - 1) / blockSize);
+    }
+
+    m_wanted.insert(host, { host, path, first });
+
+    // Whatever was read ahead for somewhere else is not wanted any more
+    QList<BlockKey> &queue = m_queued[host];
+    queue.clear();
+    for (qint64 index = first; index <= last; index++) {
+        const BlockKey key = { host, path, index };
+        if (!m_blocks.contains(key) && !m_requested.contains(key)) {
+            queue.append(key);
+        }
+    }
+
+    pump(host);
+}
+
+QByteArray RemoteFileCache::cached(HostId host, const QString &path, qint64 offset)
+{
+    const QHash<BlockKey, Block>::iterator block = m_blocks.find({ host, path, offset / blockSize });
+    if (block == m_blocks.end()) {
+        return QByteArray();
+    }
+    block->lastUsed = ++m_useCounter;
+    return block->data.mid(int(offset % blockSize));
+}
+
+qint64 RemoteFileCache::fileSize(HostId host, const QString &path) const
+{
+    return m_sizes.value(qMakePair(host, path), -1);
+}
+
+void RemoteFileCache::pump(HostId host)
+{
+    if (!m_handler) {
+        return;
+    }
+
+    QList<BlockKey> &queue = m_queued[host];
+    int &inFlight = m_inFlight[host];
+    if (queue.isEmpty() || inFlight >= maxInFlight) {
+        return;
+    }
+
+    // They told us to come back later, we do once
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const qint64 retryAt = m_retryAt.value(host);
+    if (retryAt > now) {
+        if (!m_retryPending.contains(host)) {
+            m_retryPending.insert(host);
+            QTimer::singleShot(int(retryAt - now), this, [this, host]() {
+                m_retryPending.remove(host);
+                pump(host);
+            });
+        }
+        return;
+    }
+
+    if (!m_sessions.contains(host)) {
+        openSession(host);
+    }
+
+    while (!queue.isEmpty() && inFlight < maxInFlight) {
+        const BlockKey key = queue.takeFirst();
+        m_requested.insert(key);
+        inFlight++;
+        // Only the one the player is waiting for jumps ahead of other transfers
+        emit rangeRequested(host, key.path, key.index * blockSize, blockSize, !(key == m_wanted.value(host)));
+    }
+}
+
+void RemoteFileCache::openSession(HostId host)
+{
+    // Anything from a session we already let go of is ignored
+    const int id = ++m_lastSessionId;
+    m_sessions.insert(host, id);
+
+    Connection *session = new Connection(m_handler);
+    connect(session, &Connection::rangeReceived, this, [this, host, id](const QString &path, qint64 offset, const QByteArray &data, qint64 fileSize) {
+        if (m_sessions.value(host) == id) {
+            onRangeReceived(host, path, offset, data, fileSize);
+        }
+    });
+    connect(session, &Connection::rangeFailed, this, [this, host, id](const QString &path, qint64 offset) {
+        if (m_sessions.value(host) == id) {
+            onRangeFailed(host, path, offset);
+        }
+    });
+    connect(session, &Connection::rangeBusy, this, [this, host, id](const QString &path, qint64 offset, int retryAfter) {
+        if (m_sessions.value(host) == id) {
+            onRangeBusy(host, path, offset, retryAfter);
+        }
+    });
+    connect(session, &Connection::disconnected, this, [this, host, id]() {
+        if (m_sessions.value(host) == id) {
+            onSessionClosed(host);
+        }
+    });
+
+    // It can go away on its own at any time, so it is only ever reached through
+    // signals, which Qt drops when it is gone
+    connect(this, &RemoteFileCache::rangeRequested, session, [session, host](HostId to, const QString &path, qint64 offset, qint64 length, bool prefetch) {
+        if (to == host) {
+            session->requestRange(path, offset, length, prefetch);
+        }
+    });
+    connect(this, &RemoteFileCache::sessionsClosing, session, [session, host](HostId to) {
+        if (to != InvalidHostId && to != host) {
+            return;
+        }
+        session->cancel();
+        session->deleteLater();
+    });
+
+    // Keep the crypto work off our thread
+    m_handler->moveToWorker(session);
+    QMetaObject::invokeMethod(session, [session, host]() {
+        session->openReadSession(host);
+    }, Qt::QueuedConnection);
+}
+
+void RemoteFileCache::onRangeReceived(HostId host, const QString &path, qint64 offset, const QByteArray &data, qint64 fileSize)
+{
+    const BlockKey key = { host, path, offset / blockSize };
+    if (m_requested.remove(key)) {
+        m_inFlight[host]--;
+    }
+
+    // Changed on the other side, what we have of it is worthless
+    const QPair<HostId, QString> file = qMakePair(host, path);
+    if (m_sizes.contains(file) && m_sizes.value(file) != fileSize) {
+        qDebug() << path << "changed size, dropping what we have of it";
+        forgetFile(host, path);
+    }
+    m_sizes.insert(file, fileSize);
+
+    Block &block = m_blocks[key];
+    m_cachedBytes += data.size() - block.data.size();
+    block.data = data;
+    block.lastUsed = ++m_useCounter;
+    evict();
+
+    emit blockReady(host, path);
+    pump(host);
+}
+
+void RemoteFileCache::onRangeFailed(HostId host, const QString &path, qint64 offset)
+{
+    if (m_requested.remove({ host, path, offset / blockSize })) {
+        m_inFlight[host]--;
+    }
+
+    // No point reading further ahead in it
+    QList<BlockKey> &queue = m_queued[host];
+    queue.erase(std::remove_if(queue.begin(), queue.end(), [&path](const BlockKey &key) {
+        return key.path == path;
+    }), queue.end());
+
+    emit readFailed(host, path);
+    pump(host);
+}
+
+void RemoteFileCache::onRangeBusy(HostId host, const QString &path, qint64 offset, int retryAfter)
+{
+    const BlockKey key = { host, path, offset / blockSize };
+    if (m_requested.remove(key)) {
+        m_inFlight[host]--;
+    }
+
+    // Still wanted unless the player moved on in the meantime, and first in line then
+    const BlockKey wanted = m_wanted.value(host);
+    if (key.path == wanted.path && key.index >= wanted.index && key.index <= wanted.index + readAheadBlocks) {
+        QList<BlockKey> &queue = m_queued[host];
+        if (!queue.contains(key)) {
+            queue.prepend(key);
+        }
+    }
+
+    m_retryAt.insert(host, qMax(m_retryAt.value(host), QDateTime::currentMSecsSinceEpoch() + retryAfter));
+    pump(host);
+}
+
+void RemoteFileCache::onSessionClosed(HostId host)
+{
+    m_sessions.remove(host);
+    m_wanted.remove(host);
+    m_queued.remove(host);
+    m_inFlight.remove(host);
+
+    QSet<BlockKey>::iterator it = m_requested.begin();
+    while (it != m_requested.end()) {
+        if (it->host == host) {
+            it = m_requested.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    emit readFailed(host, QString());
+}
+
+void RemoteFileCache::forgetHost(HostId host)
+{
+    if (m_sessions.remove(host)) {
+        emit sessionsClosing(host);
+    }
+
+    QHash<BlockKey, Block>::iterator block = m_blocks.begin();
+    while (block != m_blocks.end()) {
+        if (block.key().host == host) {
+            m_cachedBytes -= block->data.size();
+            block = m_blocks.erase(block);
+        } else {
+            ++block;
+        }
+    }
+    QHash<QPair<HostId, QString>, qint64>::iterator size = m_sizes.begin();
+    while (size != m_sizes.end()) {
+        if (size.key().first == host) {
+            size = m_sizes.erase(size);
+        } else {
+            ++size;
+        }
+    }
+    QSet<BlockKey>::iterator requested = m_requested.begin();
+    while (requested != m_requested.end()) {
+        if (requested->host == host) {
+            requested = m_requested.erase(requested);
+        } else {
+            ++requested;
+        }
+    }
+    m_wanted.remove(host);
+    m_queued.remove(host);
+    m_inFlight.remove(host);
+    m_retryAt.remove(host);
+
+    // Whoever was streaming from it
+    emit readFailed(host, QString());
+}
+
+void RemoteFileCache::closeSessions()
+{
+    emit sessionsClosing(InvalidHostId);
+    m_sessions.clear();
+    m_wanted.clear();
+    m_requested.clear();
+    m_queued.clear();
+    m_inFlight.clear();
+}
+
+void RemoteFileCache::forgetFile(HostId host, const QString &path)
+{
+    QHash<BlockKey, Block>::iterator it = m_blocks.begin();
+    while (it != m_blocks.end()) {
+        if (it.key().host == host && it.key().path == path) {
+            m_cachedBytes -= it->data.size();
+            it = m_blocks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RemoteFileCache::evict()
+{
+    while (m_cachedBytes > maxCachedBytes && !m_blocks.isEmpty()) {
+        QHash<BlockKey, Block>::iterator oldest = m_blocks.begin();
+        for (QHash<BlockKey, Block>::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+            if (it->lastUsed < oldest->lastUsed) {
+                oldest = it;
+            }
+        }
+        m_cachedBytes -= oldest->data.size();
+        m_blocks.erase(oldest);
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef REMOTEFILECACHE_H
+#define REMOTEFILECACHE_H
+
+#include <QObject>
+#include <QPointer>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QPair>
+
+#include "hosttable.h"
+
+class Connection;
+class ConnectionHandler;
+
+/// Parts of files on other hosts, read over one session per host in
+/// fixed size blocks that are kept around, so seeking back and forth in a
+/// video mostly hits memory. The blocks after the one asked for are read
+/// ahead, but only a few are on their way at once, so a seek doesn't wait
+/// behind a long queue of them. Read ahead is sent as bulk traffic, only
+/// the block asked for goes first. Blocks the other side is too busy for are
+/// asked for again later. The least recently used blocks are dropped.
+class RemoteFileCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr qint64 blockSize = 256 * 1024;
+    static constexpr int readAheadBlocks = 16;
+    static constexpr int maxInFlight = 4; // blocks asked for per host
+    static constexpr qint64 maxCachedBytes = 128 * 1024 * 1024;
+    static constexpr int idleTimeout = 60000; // ms before unused sessions are closed
+
+    RemoteFileCache(ConnectionHandler *handler, QObject *parent);
+
+    // Gets the block with offset in it on its way if it isn't here, and the
+    // ones after it. Forgets about read ahead from earlier calls for the host.
+    void read(HostId host, const QString &path, qint64 offset);
+
+    // From offset to the end of its block, empty if we don't have it
+    QByteArray cached(HostId host, const QString &path, qint64 offset);
+
+    // -1 until some of it has been read
+    qint64 fileSize(HostId host, const QString &path) const;
+
+signals:
+    void blockReady(HostId host, const QString &path);
+
+    // An empty path means the session to the host is gone, and everything on it
+    void readFailed(HostId host, const QString &path);
+
+    // To the sessions on their worker threads
+    void rangeRequested(HostId host, const QString &path, qint64 offset, qint64 length, bool prefetch);
+    void sessionsClosing(HostId host); // all of them if invalid
+
+private slots:
+    void closeSessions();
+
+private:
+    struct BlockKey {
+        HostId host;
+        QString path;
+        qint64 index;
+
+        bool operator==(const BlockKey &other) const {
+            return host == other.host && index == other.index && path == other.path;
+        }
+    };
+    friend uint qHash(const BlockKey &key, uint seed) {
+        return qHash(key.path, seed) ^ qHash(key.index, seed) ^ uint(key.host);
+    }
+
+    struct Block {
+        QByteArray data;
+        quint64 lastUsed = 0;
+    };
+
+    void onRangeReceived(HostId host, const QString &path, qint64 offset, const QByteArray &data, qint64 fileSize);
+    void onRangeFailed(HostId host, const QString &path, qint64 offset);
+    void onRangeBusy(HostId host, const QString &path, qint64 offset, int retryAfter);
+    void onSessionClosed(HostId host);
+    void forgetFile(HostId host, const QString &path);
+    void forgetHost(HostId host);
+    void pump(HostId host);
+    void openSession(HostId host);
+    void evict();
+
+    QPointer<ConnectionHandler> m_handler;
+    QHash<HostId, int> m_sessions; // by id, the connections live on worker threads
+    int m_lastSessionId = 0;
+
+    QHash<BlockKey, Block> m_blocks;
+    qint64 m_cachedBytes = 0;
+    quint64 m_useCounter = 0;
+    QHash<QPair<HostId, QString>, qint64> m_sizes;
+
+    QHash<HostId, BlockKey> m_wanted; // what the last read() was for
+    QSet<BlockKey> m_requested; // asked for, not answered yet
+    QHash<HostId, QList<BlockKey>> m_queued; // wanted, not asked for yet
+    QHash<HostId, int> m_inFlight;
+    QHash<HostId, qint64> m_retryAt; // ms since epoch, after the other side said it was busy
+    QSet<HostId> m_retryPending;
+
+    QTimer m_idleTimer;
+};
+
+#endif // REMOTEFILECACHE_H
@@ -0,0 +1,328 @@
+#include "screencapture.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QMutex>
+#include <QDebug>
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+// Xlib's default handler exits, and XShmAttach fails with BadAccess when the
+// X server can't get at our memory, on a remote or forwarded display. The
+// handler is per process, so only one of us swaps it at a time.
+static QMutex s_errorHandlerMutex;
+static bool s_shmAttachFailed = false;
+
+static int onShmAttachError(Display *display, XErrorEvent *event)
+{
+    Q_UNUSED(display);
+    Q_UNUSED(event);
+    s_shmAttachFailed = true;
+    return 0;
+}
+#endif
+
+struct ScreenCapture::X11State
+{
+#ifdef Q_OS_LINUX
+    Display *display = nullptr;
+    Window root = 0;
+    XImage *image = nullptr;
+    XShmSegmentInfo shm = {};
+    bool useShm = false;
+#endif
+};
+
+ScreenCapture::ScreenCapture(QObject *parent) : QObject(parent),
+    m_x11(new X11State)
+{
+}
+
+ScreenCapture::~ScreenCapture()
+{
+#ifdef Q_OS_LINUX
+    if (m_x11->useShm) {
+        XShmDetach(m_x11->display, &m_x11->shm);
+        shmdt(m_x11->shm.shmaddr);
+    }
+    if (m_x11->image) {
+        // Don't let Xlib free() the shared memory
+        if (m_x11->useShm) {
+            m_x11->image->data = nullptr;
+        }
+        XDestroyImage(m_x11->image);
+    }
+    if (m_x11->display) {
+        XCloseDisplay(m_x11->display);
+    }
+#endif
+    delete m_x11;
+}
+
+bool ScreenCapture::open()
+{
+#ifdef Q_OS_LINUX
+    m_x11->display = XOpenDisplay(nullptr);
+    if (!m_x11->display) {
+        qWarning() << "Failed to open X display for screen capture";
+        return false;
+    }
+
+    const int screen = DefaultScreen(m_x11->display);
+    m_x11->root = RootWindow(m_x11->display, screen);
+    m_size = QSize(DisplayWidth(m_x11->display, screen), DisplayHeight(m_x11->display, screen));
+
+    if (!XShmQueryExtension(m_x11->display)) {
+        qDebug() << "No MIT-SHM, falling back to XGetImage";
+        return true;
+    }
+
+    XImage *image = XShmCreateImage(m_x11->display, DefaultVisual(m_x11->display, screen), DefaultDepth(m_x11->display, screen),
+                                    ZPixmap, nullptr, &m_x11->shm, m_size.width(), m_size.height());
+    if (!image) {
+        qWarning() << "Failed to create shared memory image";
+        return true;
+    }
+
+    m_x11->shm.shmid = shmget(IPC_PRIVATE, size_t(image->bytes_per_line) * image->height, IPC_CREAT | 0600);
+    if (m_x11->shm.shmid < 0) {
+        qWarning() << "Failed to allocate shared memory for screen capture";
+        XDestroyImage(image);
+        return true;
+    }
+
+    void *address = shmat(m_x11->shm.shmid, nullptr, 0);
+    if (address == reinterpret_cast<void*>(-1)) {
+        qWarning() << "Failed to attach shared memory for screen capture" << strerror(errno);
+        shmctl(m_x11->shm.shmid, IPC_RMID, nullptr);
+        XDestroyImage(image);
+        return true;
+    }
+    m_x11->shm.shmaddr = image->data = static_cast<char*>(address);
+    m_x11->shm.readOnly = False;
+
+    bool attached = false;
+    {
+        QMutexLocker locker(&s_errorHandlerMutex);
+        s_shmAttachFailed = false;
+        const XErrorHandler previousHandler = XSetErrorHandler(onShmAttachError);
+        attached = XShmAttach(m_x11->display, &m_x11->shm);
+        XSync(m_x11->display, False); // so the error, if any, arrives while our handler is in place
+        XSetErrorHandler(previousHandler);
+        attached = attached && !s_shmAttachFailed;
+    }
+
+    // Goes away by itself when both we and the X server let go
+    shmctl(m_x11->shm.shmid, IPC_RMID, nullptr);
+
+    if (!attached) {
+        qDebug() << "X server can't use our shared memory, falling back to XGetImage";
+        shmdt(address);
+        image->data = nullptr;
+        XDestroyImage(image);
+        return true;
+    }
+
+    m_x11->image = image;
+    m_x11->useShm = true;
+    return true;
+#else
+    qWarning() << "Screen capture is only available on X11";
+    return false;
+#endif
+}
+
+bool ScreenCapture::grab()
+{
+#ifdef Q_OS_LINUX
+    if (m_x11->useShm) {
+        if (!XShmGetImage(m_x11->display, m_x11->root, m_x11->image, 0, 0, AllPlanes)) {
+            qWarning() << "XShmGetImage failed";
+            return false;
+        }
+    } else {
+        if (m_x11->image) {
+            XDestroyImage(m_x11->image);
+        }
+        m_x11->image = XGetImage(m_x11->display, m_x11->root, 0, 0, m_size.width(), m_size.height(), AllPlanes, ZPixmap);
+        if (!m_x11->image) {
+            qWarning() << "XGetImage failed";
+            return false;
+        }
+    }
+
+    if (m_x11->image->bits_per_pixel != 32) {
+        qWarning() << "Unsupported screen depth" << m_x11->image->bits_per_pixel;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+QRect ScreenCapture::tileRect(int column, int row, const QSize &screen)
+{
+    const QRect tile(column * tileSize, row * tileSize, tileSize, tileSize);
+    return tile.intersected(QRect(QPoint(0, 0), screen));
+}
+
+bool ScreenCapture::tileDiffers(const uchar *current, const uchar *previous, int stride, const QRect &tile)
+{
+    const int rowBytes = tile.width() * 4;
+    const int offset = tile.y() * stride + tile.x() * 4;
+
+    for (int y=0; y<tile.height(); y++) {
+        const uchar *a = current + offset + y * stride;
+        const uchar *b = previous + offset + y * stride;
+        int i = 0;
+
+#ifdef __SSE2__
+        // 64 bytes at a time, or the differences together and test once
+        for (; i + 64 <= rowBytes; i += 64) {
+            const __m128i d0 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+            const __m128i d1 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 16)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 16)));
+            const __m128i d2 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 32)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 32)));
+            const __m128i d3 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 48)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 48)));
+            const __m128i any = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff) {
+                return true;
+            }
+        }
+#endif
+
+        if (memcmp(a + i, b + i, size_t(rowBytes - i)) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QByteArray ScreenCapture::nextFrame(int *dirtyTiles)
+{
+    if (dirtyTiles) {
+        *dirtyTiles = 0;
+    }
+
+#ifdef Q_OS_LINUX
+    if (!grab()) {
+        return QByteArray();
+    }
+
+    const uchar *current = reinterpret_cast<const uchar*>(m_x11->image->data);
+    const int stride = m_x11->image->bytes_per_line;
+    const int frameBytes = stride * m_size.height();
+
+    if (m_previous.size() != frameBytes) {
+        m_previous.resize(frameBytes);
+        m_hasPrevious = false;
+    }
+    uchar *previous = reinterpret_cast<uchar*>(m_previous.data());
+
+    const int columns = (m_size.width() + tileSize - 1) / tileSize;
+    const int rows = (m_size.height() + tileSize - 1) / tileSize;
+
+    QJsonArray tiles;
+    QByteArray payload;
+    QByteArray pixels;
+    for (int row=0; row<rows; row++) {
+        for (int column=0; column<columns; column++) {
+            const QRect tile = tileRect(column, row, m_size);
+            if (m_hasPrevious && !tileDiffers(current, previous, stride, tile)) {
+                continue;
+            }
+
+            // Pack the rows tightly, and remember what the other side has now
+            const int rowBytes = tile.width() * 4;
+            pixels.resize(rowBytes * tile.height());
+            for (int y=0; y<tile.height(); y++) {
+                const int offset = (tile.y() + y) * stride + tile.x() * 4;
+                memcpy(pixels.data() + y * rowBytes, current + offset, size_t(rowBytes));
+                memcpy(previous + offset, current + offset, size_t(rowBytes));
+            }
+
+            const QByteArray compressed = qCompress(pixels, compressionLevel);
+            tiles.append(QJsonArray({column, row, compressed.size()}));
+            payload += compressed;
+        }
+    }
+    m_hasPrevious = true;
+
+    if (tiles.isEmpty()) {
+        return QByteArray();
+    }
+
+    if (dirtyTiles) {
+        *dirtyTiles = tiles.count();
+    }
+
+    QJsonObject header;
+    header["frame"] = m_frameNumber++;
+    header["width"] = m_size.width();
+    header["height"] = m_size.height();
+    header["tileSize"] = tileSize;
+    header["tiles"] = tiles;
+
+    return QJsonDocument(header).toJson(QJsonDocument::Compact) + '\n' + payload;
+#else
+    return QByteArray();
+#endif
+}
+
+bool ScreenCapture::runBenchmark()
+{
+    ScreenCapture capture;
+    if (!capture.open()) {
+        return false;
+    }
+
+    QTextStream out(stdout);
+    out << "Screen " << capture.size().width() << "x" << capture.size().height()
+        << (capture.m_x11->useShm ? " with" : " without") << " MIT-SHM" << '\n';
+
+    QElapsedTimer timer;
+    timer.start();
+    const QByteArray first = capture.nextFrame();
+    out << "Full frame: " << first.size() << " bytes in " << timer.elapsed() << " ms" << '\n';
+    out.flush();
+
+    int captures = 0;
+    int changedFrames = 0;
+    qint64 bytes = 0;
+    qint64 tiles = 0;
+    timer.restart();
+    while (timer.elapsed() < 5000) {
+        int dirtyTiles = 0;
+        const QByteArray frame = capture.nextFrame(&dirtyTiles);
+        captures++;
+        if (!frame.isEmpty()) {
+            changedFrames++;
+            bytes += frame.size();
+            tiles += dirtyTiles;
+        }
+    }
+
+    const double seconds = timer.elapsed() / 1000.;
+    out << "Captured " << QString::number(captures / seconds, 'f', 1) << " fps, "
+        << changedFrames << " frames with changes, "
+        << (changedFrames ? bytes / changedFrames : 0) << " bytes and "
+        << (changedFrames ? tiles / changedFrames : 0) << " tiles per changed frame" << '\n';
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef SCREENCAPTURE_H
+#define SCREENCAPTURE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QSize>
+#include <QRect>
+
+/// Grabs the X11 screen (through MIT-SHM when the server has it) and
+/// encodes the tiles that changed since the last frame. A frame is a JSON
+/// header line listing the dirty tiles and their compressed sizes,
+/// followed by each tile's qCompress()ed RGB32 pixels, row by row.
+/// Uses its own display connection, so it can run on any thread.
+class ScreenCapture : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int tileSize = 64;
+    static constexpr int frameRate = 15;
+    static constexpr int compressionLevel = 1; // cheap, screen content compresses well anyway
+
+    explicit ScreenCapture(QObject *parent = nullptr);
+    ~ScreenCapture();
+
+    bool open();
+
+    // Empty if nothing changed, dirtyTiles is set to how many tiles are in it
+    QByteArray nextFrame(int *dirtyTiles = nullptr);
+
+    QSize size() const { return m_size; }
+
+    // Where a tile is, edge tiles are cut off by the screen size
+    static QRect tileRect(int column, int row, const QSize &screen);
+
+    // Runs for a few seconds against the local display and prints the numbers
+    static bool runBenchmark();
+
+private:
+    struct X11State;
+
+    bool grab();
+    static bool tileDiffers(const uchar *current, const uchar *previous, int stride, const QRect &tile);
+
+    X11State *m_x11 = nullptr;
+    QSize m_size;
+    QByteArray m_previous;
+    bool m_hasPrevious = false;
+    int m_frameNumber = 0;
+};
+
+#endif // SCREENCAPTURE_H
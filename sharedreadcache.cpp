@@ -0,0 +1,334 @@
+#include "sharedreadcache.h"
+#include "largefileio.h"
+
+#include <QFile>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+}
+#endif
+
+SharedReadCache::~SharedReadCache()
+{
+    for (const QSharedPointer<SharedFile> &file : m_files) {
+        closeFile(file.data());
+    }
+}
+
+int SharedReadCache::openDescriptor(QFile *file, bool large, bool *direct)
+{
+    *direct = false;
+
+#ifdef Q_OS_LINUX
+    // Our own descriptor, so it outlives whoever opened the file first
+    if (!large || !LargeFileIo::directEnabled()) {
+        return fcntl(file->handle(), F_DUPFD_CLOEXEC, 0);
+    }
+
+    // Opened again rather than duplicated, O_DIRECT on a duplicate would apply to the original as well
+    const QByteArray procPath = "/proc/self/fd/" + QByteArray::number(file->handle());
+    const int fd = ::open(procPath.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return fcntl(file->handle(), F_DUPFD_CLOEXEC, 0);
+    }
+
+    // Not all filesystems support it
+    const int flags = fcntl(fd, F_GETFL);
+    *direct = flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+    if (!*direct) {
+        qDebug() << "Not using O_DIRECT for" << file->fileName();
+    }
+    return fd;
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(large);
+    return -1;
+#endif
+}
+
+void SharedReadCache::closeFile(SharedFile *file)
+{
+#ifdef Q_OS_LINUX
+    ::close(file->fd);
+    free(file->directBuffer);
+    file->directBuffer = nullptr;
+#else
+    Q_UNUSED(file);
+#endif
+}
+
+int SharedReadCache::registerReader(QFile *file)
+{
+#ifdef Q_OS_LINUX
+    struct stat status;
+    if (fstat(file->handle(), &status) != 0 || !S_ISREG(status.st_mode)) {
+        return -1;
+    }
+
+    FileKey key;
+    key.device = status.st_dev;
+    key.inode = status.st_ino;
+
+    QMutexLocker locker(&m_mutex);
+
+    QSharedPointer<SharedFile> shared = m_files.value(key);
+    if (!shared) {
+        const bool large = LargeFileIo::isLarge(status.st_size);
+        bool direct = false;
+        const int fd = openDescriptor(file, large, &direct);
+        if (fd < 0) {
+            qWarning() << "Failed to duplicate descriptor for" << file->fileName() << strerror(errno);
+            return -1;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        shared.reset(new SharedFile);
+        shared->key = key;
+        shared->name = file->fileName();
+        shared->fd = fd;
+        shared->size = status.st_size;
+        shared->dropBehind = large;
+        shared->direct = direct;
+        m_files.insert(key, shared);
+    }
+
+    shared->readers++;
+    if (shared->readers > 1) {
+        qDebug() << "Sharing reads of" << shared->name << "between" << shared->readers << "downloads";
+    }
+
+    const int reader = m_nextReader++;
+    m_readers[reader].file = shared;
+    return reader;
+#else
+    Q_UNUSED(file);
+    return -1;
+#endif
+}
+
+void SharedReadCache::unregisterReader(int reader)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_readers.contains(reader)) {
+        return;
+    }
+    const QSharedPointer<SharedFile> file = m_readers.take(reader).file;
+
+    // Don't keep anything around for someone who isn't coming
+    QList<qint64> unwanted;
+    for (QMap<qint64, Block>::iterator it = file->blocks.begin(); it != file->blocks.end(); ++it) {
+        it->waiting.remove(reader);
+        if (it->waiting.isEmpty()) {
+            unwanted.append(it.key());
+        }
+    }
+    for (const qint64 offset : unwanted) {
+        freeBlock(file.data(), offset);
+    }
+
+    file->readers--;
+    if (file->readers > 0) {
+        return;
+    }
+
+    qDebug() << "Served" << file->servedBytes << "bytes of" << file->name << "from" << file->diskBytes << "bytes read from disk";
+
+    closeFile(file.data());
+    m_files.remove(file->key);
+}
+
+QByteArray SharedReadCache::read(int reader, qint64 maxSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_readers.contains(reader)) {
+        return QByteArray();
+    }
+    const QSharedPointer<SharedFile> file = m_readers[reader].file;
+
+    QByteArray result;
+    while (result.size() < maxSize) {
+        const qint64 position = m_readers[reader].position;
+        if (position >= file->size) {
+            break;
+        }
+        const qint64 offset = position - position % blockSize;
+
+        QByteArray data;
+        bool cached = file->blocks.contains(offset);
+        if (cached) {
+            data = file->blocks[offset].data;
+        } else {
+            // If someone else is reading this block already we get it when they're done
+            locker.unlock();
+            QMutexLocker readLocker(&file->readMutex);
+            locker.relock();
+
+            cached = file->blocks.contains(offset);
+            if (cached) {
+                data = file->blocks[offset].data;
+            } else {
+                locker.unlock();
+                data = readBlock(file.data(), offset);
+                locker.relock();
+
+                if (data.isEmpty()) {
+                    break;
+                }
+                file->diskBytes += data.size();
+
+                // If we're too far ahead of the rest they'll have to read it again themselves
+                if (file->blocks.count() < maxBlocksPerFile) {
+                    const qint64 end = offset + data.size();
+                    Block block;
+                    block.data = data;
+                    for (QHash<int, Reader>::const_iterator it = m_readers.constBegin(); it != m_readers.constEnd(); ++it) {
+                        if (it->file == file && it->position < end && end - it->position <= maxBlocksPerFile * blockSize) {
+                            block.waiting.insert(it.key());
+                        }
+                    }
+                    file->blocks.insert(offset, block);
+                    cached = true;
+                }
+            }
+        }
+
+        const QByteArray part = data.mid(int(position - offset), int(qMin<qint64>(maxSize - result.size(), data.size())));
+        if (part.isEmpty()) {
+            break;
+        }
+        result += part;
+
+        const qint64 newPosition = position + part.size();
+        m_readers[reader].position = newPosition;
+        if (newPosition >= offset + data.size()) {
+            if (cached) {
+                passed(file.data(), offset, reader);
+            } else if (file->dropBehind) {
+                // Nobody else gets it from us, so nothing else drops it
+#ifdef Q_OS_LINUX
+                posix_fadvise(file->fd, offset, data.size(), POSIX_FADV_DONTNEED);
+#endif
+            }
+        }
+    }
+
+    file->servedBytes += result.size();
+    return result;
+}
+
+bool SharedReadCache::atEnd(int reader) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_readers.contains(reader)) {
+        return true;
+    }
+    const Reader state = m_readers.value(reader);
+    return state.position >= state.file->size;
+}
+
+QByteArray SharedReadCache::readBlock(SharedFile *file, qint64 offset)
+{
+#ifdef Q_OS_LINUX
+    if (file->direct) {
+        return readBlockDirect(file, offset);
+    }
+
+    QByteArray data(int(qMin(blockSize, file->size - offset)), Qt::Uninitialized);
+    qint64 filled = 0;
+    while (filled < data.size()) {
+        const ssize_t count = ::pread(file->fd, data.data() + filled, size_t(data.size() - filled), offset + filled);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            qWarning() << "Failed to read" << file->name << "at" << offset << strerror(errno);
+            return QByteArray();
+        }
+        if (count == 0) {
+            // Someone truncated it under us
+            break;
+        }
+        filled += count;
+    }
+    data.truncate(int(filled));
+    return data;
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(offset);
+    return QByteArray();
+#endif
+}
+
+QByteArray SharedReadCache::readBlockDirect(SharedFile *file, qint64 offset)
+{
+#ifdef Q_OS_LINUX
+    // Blocks start aligned and are a multiple of the alignment, only the last one comes up short
+    static_assert(blockSize % LargeFileIo::directAlignment == 0, "O_DIRECT needs aligned reads");
+
+    if (!file->directBuffer) {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, LargeFileIo::directAlignment, blockSize) == 0) {
+            file->directBuffer = static_cast<char*>(buffer);
+        }
+    }
+
+    ssize_t count = -1;
+    if (file->directBuffer) {
+        do {
+            count = ::pread(file->fd, file->directBuffer, size_t(blockSize), offset);
+        } while (count < 0 && errno == EINTR);
+    }
+
+    if (count < 0) {
+        qWarning() << "O_DIRECT read of" << file->name << "failed, falling back" << strerror(errno);
+        const int flags = fcntl(file->fd, F_GETFL);
+        if (flags >= 0) {
+            fcntl(file->fd, F_SETFL, flags & ~O_DIRECT);
+        }
+        file->direct = false;
+        return readBlock(file, offset);
+    }
+
+    return QByteArray(file->directBuffer, int(qMin<qint64>(count, file->size - offset)));
+#else
+    Q_UNUSED(file);
+    Q_UNUSED(offset);
+    return QByteArray();
+#endif
+}
+
+void SharedReadCache::passed(SharedFile *file, qint64 offset, int reader)
+{
+    if (!file->blocks.contains(offset)) {
+        return;
+    }
+
+    Block &block = file->blocks[offset];
+    block.waiting.remove(reader);
+    if (block.waiting.isEmpty()) {
+        freeBlock(file, offset);
+    }
+}
+
+void SharedReadCache::freeBlock(SharedFile *file, qint64 offset)
+{
+    const int length = file->blocks.take(offset).data.size();
+
+#ifdef Q_OS_LINUX
+    if (file->dropBehind) {
+        posix_fadvise(file->fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+#else
+    Q_UNUSED(length);
+#endif
+}
@@ -0,0 +1,92 @@
+#ifndef SHAREDREADCACHE_H
+#define SHAREDREADCACHE_H
+
+#include <QMutex>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QSharedPointer>
+#include <QByteArray>
+#include <QString>
+
+class QFile;
+
+/// Lets concurrent downloads of the same file share one sequential read
+/// stream instead of each seeking around on their own. Files are keyed by
+/// device and inode, and read in blocks keyed by offset. A block is kept
+/// until every reader that was close enough behind to want it has passed
+/// it, and then freed. Large files are dropped from the page cache behind
+/// the readers, or read with O_DIRECT if that is enabled, like LargeFileIo.
+/// Called from the connection worker threads.
+/// Only shares anything on Linux, elsewhere registerReader() always fails.
+class SharedReadCache
+{
+    Q_DISABLE_COPY(SharedReadCache)
+
+public:
+    static constexpr qint64 blockSize = 1024 * 1024;
+    static constexpr int maxBlocksPerFile = 64; // how far the fastest reader may pull ahead of the others
+
+    SharedReadCache() = default;
+    ~SharedReadCache();
+
+    // Starts reading an opened file from the beginning, -1 if it can't be shared
+    int registerReader(QFile *file);
+    void unregisterReader(int reader);
+
+    // Like QFile::read() from where this reader is, empty at the end or on errors
+    QByteArray read(int reader, qint64 maxSize);
+
+    bool atEnd(int reader) const;
+
+private:
+    struct FileKey {
+        quint64 device = 0;
+        quint64 inode = 0;
+
+        bool operator==(const FileKey &other) const { return device == other.device && inode == other.inode; }
+    };
+    friend uint qHash(const FileKey &key, uint seed) { return qHash(key.device, seed) ^ qHash(key.inode, seed); }
+
+    struct Block {
+        QByteArray data;
+        QSet<int> waiting; // readers that haven't passed it yet
+    };
+
+    struct SharedFile {
+        FileKey key;
+        QString name;
+        int fd = -1;
+        qint64 size = 0;
+        bool dropBehind = false; // large files shouldn't linger in the page cache
+        bool direct = false; // fd has O_DIRECT set
+
+        QMutex readMutex; // held while reading from disk, so the others wait for it instead of seeking
+        char *directBuffer = nullptr; // aligned for O_DIRECT, guarded by readMutex
+
+        // The rest is guarded by m_mutex
+        QMap<qint64, Block> blocks;
+        int readers = 0;
+        qint64 diskBytes = 0;
+        qint64 servedBytes = 0;
+    };
+
+    struct Reader {
+        QSharedPointer<SharedFile> file;
+        qint64 position = 0;
+    };
+
+    static int openDescriptor(QFile *file, bool large, bool *direct);
+    static void closeFile(SharedFile *file);
+    QByteArray readBlock(SharedFile *file, qint64 offset);
+    QByteArray readBlockDirect(SharedFile *file, qint64 offset);
+    void passed(SharedFile *file, qint64 offset, int reader);
+    void freeBlock(SharedFile *file, qint64 offset);
+
+    mutable QMutex m_mutex;
+    QHash<FileKey, QSharedPointer<SharedFile>> m_files;
+    QHash<int, Reader> m_readers;
+    int m_nextReader = 0;
+};
+
+#endif // SHAREDREADCACHE_H
@@ -0,0 +1,689 @@
+#include "smallfilereader.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDirIterator>
+#include <QSettings>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QRunnable>
+#include <QHash>
+#include <QThread>
+#include <QDebug>
+
+#include <memory>
+#include <functional>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+}
+
+// Talked to directly, so we don't need liburing
+#if __has_include(<linux/io_uring.h>)
+extern "C" {
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+}
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+// Room for the open and statx of every file in flight, and the closes behind them
+static const unsigned ringEntries = SmallFileReader::queueDepth * 4;
+
+struct SmallFileReader::Ring
+{
+    ~Ring();
+
+    // Null if the kernel doesn't have io_uring or the operations we need (5.6)
+    static Ring *create();
+
+    // Null if the submission queue is full
+    io_uring_sqe *nextSqe();
+
+    // Hands everything the kernel hasn't taken yet to it, and waits for that many
+    // completions. 0 or the errno, EBUSY and EAGAIN mean completions have to be
+    // reaped before it can go on.
+    int submit(unsigned waitFor);
+
+    bool nextCqe(io_uring_cqe *cqe);
+
+    int fd = -1;
+    void *sqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    void *cqRing = MAP_FAILED;
+    size_t cqRingSize = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned *sqMask = nullptr;
+    unsigned *sqArray = nullptr;
+    unsigned sqEntries = 0;
+    unsigned queued = 0; // filled in but not submitted yet
+
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned *cqMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+};
+
+SmallFileReader::Ring::~Ring()
+{
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+SmallFileReader::Ring *SmallFileReader::Ring::create()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int ringFd = int(syscall(__NR_io_uring_setup, ringEntries, &params));
+    if (ringFd == -1) {
+        qDebug() << "No io_uring" << strerror(errno);
+        return nullptr;
+    }
+
+    std::unique_ptr<Ring> ring(new Ring);
+    ring->fd = ringFd;
+
+    // Older kernels don't know about IORING_REGISTER_PROBE either
+    QByteArray probeBuffer(int(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)), 0);
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(probeBuffer.data());
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        qDebug() << "io_uring is too old to probe" << strerror(errno);
+        return nullptr;
+    }
+    for (const int op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE }) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            qDebug() << "io_uring lacks operation" << op;
+            return nullptr;
+        }
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        ring->sqRingSize = ring->cqRingSize = qMax(ring->sqRingSize, ring->cqRingSize);
+    }
+
+    ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        qWarning() << "Failed to map io_uring submission queue" << strerror(errno);
+        return nullptr;
+    }
+    if (singleMap) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            qWarning() << "Failed to map io_uring completion queue" << strerror(errno);
+            return nullptr;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+    if (ring->sqes == MAP_FAILED) {
+        qWarning() << "Failed to map io_uring submission entries" << strerror(errno);
+        return nullptr;
+    }
+
+    char *sq = static_cast<char*>(ring->sqRing);
+    ring->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+
+    char *cq = static_cast<char*>(ring->cqRing);
+    ring->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return ring.release();
+}
+
+io_uring_sqe *SmallFileReader::Ring::nextSqe()
+{
+    // Only we move the tail, the kernel moves the head as it consumes
+    const unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    const unsigned tail = *sqTail + queued;
+    if (tail - head >= sqEntries) {
+        return nullptr;
+    }
+
+    const unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    queued++;
+    return sqe;
+}
+
+int SmallFileReader::Ring::submit(unsigned waitFor)
+{
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+
+    // Includes whatever a call that failed left behind
+    const unsigned toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (toSubmit == 0 && waitFor == 0) {
+        return 0;
+    }
+
+    while (syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) == -1) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+bool SmallFileReader::Ring::nextCqe(io_uring_cqe *cqe)
+{
+    const unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = cqes[head & *cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+class SmallFileReader::UringTask : public QRunnable
+{
+public:
+    UringTask(SmallFileReader *reader, Ring *ring) : m_reader(reader), m_ring(ring) {}
+
+    void run() override {
+        m_reader->runUring(m_ring);
+    }
+
+private:
+    SmallFileReader *m_reader;
+    Ring *m_ring;
+};
+
+void SmallFileReader::runUring(Ring *ring)
+{
+    std::unique_ptr<Ring> owner(ring);
+
+    enum Step : quint64 {
+        Open,
+        Stat,
+        Read,
+        Close
+    };
+
+    struct File {
+        int index;
+        QByteArray path;
+        struct statx stat;
+        int fd = -1;
+        int statResult = -1;
+        int waiting = 0; // the open and the statx go out together
+        QByteArray data;
+    };
+
+    QHash<int, File*> inFlight;
+    int closing = 0;
+    bool broken = false; // the kernel refused the ring, nothing more goes through it
+
+    std::function<bool()> reap;
+
+    // False if the ring is broken, waits out a full completion queue
+    auto submit = [&](unsigned waitFor) {
+        while (!broken) {
+            const int error = ring->submit(waitFor);
+            if (error == 0) {
+                return true;
+            }
+            if (error != EBUSY && error != EAGAIN) {
+                qWarning() << "io_uring_enter failed, reading the rest without it" << strerror(error);
+                broken = true;
+                break;
+            }
+            // The kernel won't take more until we make room for the completions
+            if (!reap()) {
+                QThread::msleep(1);
+            }
+        }
+        return false;
+    };
+
+    // The queue is flushed first if it is full, null if the ring is broken
+    auto nextSqe = [&]() -> io_uring_sqe* {
+        if (broken) {
+            return nullptr;
+        }
+        io_uring_sqe *sqe = ring->nextSqe();
+        if (!sqe && submit(0)) {
+            sqe = ring->nextSqe();
+        }
+        return sqe;
+    };
+
+    auto finish = [&](File *file, bool loaded) {
+        if (file->fd != -1) {
+            io_uring_sqe *sqe = nextSqe();
+            if (sqe) {
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = file->fd;
+                sqe->user_data = Close;
+                closing++;
+            } else {
+                ::close(file->fd);
+            }
+        }
+        finished(file->index, loaded ? file->data : QByteArray(), loaded);
+        inFlight.remove(file->index);
+        delete file;
+    };
+
+    // False if there was nothing to reap
+    reap = [&]() {
+        bool reaped = false;
+        io_uring_cqe cqe;
+        while (ring->nextCqe(&cqe)) {
+            reaped = true;
+            const Step step = Step(cqe.user_data & 3);
+            if (step == Close) {
+                closing--;
+                continue;
+            }
+
+            File *file = inFlight.value(int(cqe.user_data >> 2));
+            if (!file) {
+                continue;
+            }
+
+            if (step == Read) {
+                // Short if it shrank since the statx, what we got is what is sent
+                if (cqe.res >= 0) {
+                    file->data.truncate(cqe.res);
+                }
+                finish(file, cqe.res >= 0);
+                continue;
+            }
+
+            if (step == Open) {
+                file->fd = cqe.res >= 0 ? cqe.res : -1;
+            } else {
+                file->statResult = cqe.res;
+            }
+            if (--file->waiting > 0) {
+                continue;
+            }
+
+            const bool small = file->fd != -1 && file->statResult == 0 && S_ISREG(file->stat.stx_mode) &&
+                    qint64(file->stat.stx_size) <= maxFileSize;
+            if (!small || file->stat.stx_size == 0) {
+                finish(file, small);
+                continue;
+            }
+
+            file->data.resize(int(file->stat.stx_size));
+            io_uring_sqe *sqe = nextSqe();
+            if (!sqe) {
+                finish(file, false);
+                continue;
+            }
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = file->fd;
+            sqe->addr = quint64(quintptr(file->data.data()));
+            sqe->len = unsigned(file->data.size());
+            sqe->off = 0;
+            sqe->user_data = (quint64(file->index) << 2) | Read;
+        }
+        return reaped;
+    };
+
+    while (!broken) {
+        while (inFlight.count() < queueDepth) {
+            // Only block when there is nothing else to wait for
+            if (inFlight.isEmpty() && closing > 0) {
+                submit(0);
+                break;
+            }
+            const int index = claim(inFlight.isEmpty());
+            if (index == -1) {
+                break;
+            }
+
+            File *file = new File;
+            file->index = index;
+            file->path = QFile::encodeName(m_paths[index]);
+            file->waiting = 2;
+            inFlight.insert(index, file);
+
+            io_uring_sqe *open = nextSqe();
+            io_uring_sqe *stat = open ? nextSqe() : nullptr;
+            if (!stat) {
+                break;
+            }
+            open->opcode = IORING_OP_OPENAT;
+            open->fd = AT_FDCWD;
+            open->addr = quint64(quintptr(file->path.constData()));
+            open->open_flags = O_RDONLY | O_CLOEXEC;
+            open->user_data = (quint64(index) << 2) | Open;
+
+            stat->opcode = IORING_OP_STATX;
+            stat->fd = AT_FDCWD;
+            stat->addr = quint64(quintptr(file->path.constData()));
+            stat->len = STATX_TYPE | STATX_SIZE;
+            stat->off = quint64(quintptr(&file->stat));
+            stat->user_data = (quint64(index) << 2) | Stat;
+        }
+
+        if (broken || (inFlight.isEmpty() && closing == 0)) {
+            break;
+        }
+
+        if (submit(1)) {
+            reap();
+        }
+    }
+
+    if (!broken) {
+        return;
+    }
+
+    // Closing the ring cancels what is still in flight, only then are the buffers ours again.
+    // Those files are left to the caller to read, and we read the rest the plain way.
+    owner.reset();
+    for (File *file : qAsConst(inFlight)) {
+        if (file->fd != -1) {
+            ::close(file->fd);
+        }
+        finished(file->index, QByteArray(), false);
+        delete file;
+    }
+    inFlight.clear();
+
+    int index;
+    while ((index = claim(true)) != -1) {
+        readOne(index);
+    }
+}
+#endif
+
+class SmallFileReader::ReadTask : public QRunnable
+{
+public:
+    ReadTask(SmallFileReader *reader) : m_reader(reader) {}
+
+    void run() override {
+        int index;
+        while ((index = m_reader->claim(true)) != -1) {
+            m_reader->readOne(index);
+        }
+    }
+
+private:
+    SmallFileReader *m_reader;
+};
+
+SmallFileReader::~SmallFileReader()
+{
+    stop();
+}
+
+void SmallFileReader::start(const QStringList &paths, Backend backend)
+{
+    stop();
+
+    m_paths = paths;
+    m_status = QVector<Status>(paths.count(), Pending);
+    m_data = QVector<QByteArray>(paths.count());
+    m_nextIndex = 0;
+    m_taken = 0;
+    m_buffered = 0;
+    m_stopping = false;
+
+    if (backend == Automatic) {
+        backend = QSettings().value("io/uring", true).toBool() ? Uring : ThreadPool;
+    }
+    if (backend == Uring && startUring()) {
+        m_backend = Uring;
+        return;
+    }
+
+    m_backend = ThreadPool;
+    m_pool.setMaxThreadCount(poolThreads);
+    for (int i=0; i<poolThreads; i++) {
+        m_pool.start(new ReadTask(this));
+    }
+}
+
+bool SmallFileReader::startUring()
+{
+#ifdef HAVE_IO_URING
+    Ring *ring = Ring::create();
+    if (!ring) {
+        return false;
+    }
+    m_pool.setMaxThreadCount(1);
+    m_pool.start(new UringTask(this, ring));
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SmallFileReader::stop()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_spaceFree.wakeAll();
+        m_resultReady.wakeAll();
+    }
+
+    // The reads in flight write into our buffers
+    m_pool.waitForDone();
+
+    m_paths.clear();
+    m_status.clear();
+    m_data.clear();
+    m_buffered = 0;
+}
+
+bool SmallFileReader::take(int index, QByteArray *data)
+{
+    QMutexLocker locker(&m_mutex);
+    if (index < 0 || index >= m_status.count()) {
+        return false;
+    }
+
+    while (m_status[index] == Pending && !m_stopping) {
+        m_resultReady.wait(&m_mutex);
+    }
+
+    m_taken = index + 1;
+    m_spaceFree.wakeAll();
+
+    if (m_status[index] != Loaded) {
+        return false;
+    }
+    *data = m_data[index];
+    m_data[index].clear();
+    m_buffered -= data->size();
+    return true;
+}
+
+int SmallFileReader::claim(bool wait)
+{
+    QMutexLocker locker(&m_mutex);
+    forever {
+        if (m_stopping || m_nextIndex >= m_paths.count()) {
+            return -1;
+        }
+        if (m_nextIndex < m_taken + maxAhead && m_buffered < maxBuffered) {
+            return m_nextIndex++;
+        }
+        if (!wait) {
+            return -1;
+        }
+        m_spaceFree.wait(&m_mutex);
+    }
+}
+
+void SmallFileReader::finished(int index, const QByteArray &data, bool loaded)
+{
+    QMutexLocker locker(&m_mutex);
+    m_status[index] = loaded ? Loaded : NotLoaded;
+    m_data[index] = data;
+    m_buffered += data.size();
+    m_resultReady.wakeAll();
+}
+
+void SmallFileReader::readOne(int index)
+{
+    QFile file(m_paths[index]);
+    if (!file.open(QIODevice::ReadOnly) || file.isSequential() || file.size() > maxFileSize) {
+        finished(index, QByteArray(), false);
+        return;
+    }
+
+    const QByteArray data = file.read(file.size());
+    finished(index, data, data.size() == file.size());
+}
+
+// Makes the next run read from disk again. Only root can drop dentries and
+// inodes too, otherwise open() and stat() still hit the cache and only the
+// file data comes from disk. False in that case.
+static bool dropCaches(const QStringList &paths)
+{
+#ifdef Q_OS_LINUX
+    if (geteuid() == 0) {
+        ::sync();
+        // Unbuffered, so the write is what fails if the kernel refuses
+        QFile control(QStringLiteral("/proc/sys/vm/drop_caches"));
+        if (control.open(QIODevice::WriteOnly | QIODevice::Unbuffered) && control.write("3\n") == 2) {
+            return true;
+        }
+        qWarning() << "Failed to drop caches" << control.errorString();
+    }
+
+    for (const QString &path : paths) {
+        const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+#else
+    Q_UNUSED(paths);
+#endif
+    return false;
+}
+
+bool SmallFileReader::runBenchmark(const QString &directory)
+{
+    QTextStream out(stdout);
+
+    if (!QFileInfo::exists(directory)) {
+        out << "Creating " << benchmarkFiles << " files of " << benchmarkFileSize << " bytes in " << directory << '\n';
+        out.flush();
+
+        const QByteArray contents(benchmarkFileSize, 'x');
+        for (int i=0; i<benchmarkFiles; i++) {
+            // A thousand per directory, like a real tree
+            const QString subdirectory = directory + '/' + QString::number(i / 1000);
+            if (i % 1000 == 0 && !QDir().mkpath(subdirectory)) {
+                qWarning() << "Failed to create" << subdirectory;
+                return false;
+            }
+            QFile file(subdirectory + '/' + QString::number(i));
+            if (!file.open(QIODevice::WriteOnly) || file.write(contents) != contents.size()) {
+                qWarning() << "Failed to write" << file.fileName() << file.errorString();
+                return false;
+            }
+        }
+#ifdef Q_OS_LINUX
+        // Dirty pages can't be dropped
+        ::sync();
+#endif
+    }
+
+    QStringList paths;
+    QDirIterator it(directory, QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        paths.append(it.next());
+    }
+    if (paths.isEmpty()) {
+        qWarning() << "No files in" << directory;
+        return false;
+    }
+    out << paths.count() << " files" << '\n';
+    out.flush();
+
+    // -1 is plain QFile, one after another, like uploads did before
+    for (const int backend : { -1, int(ThreadPool), int(Uring) }) {
+        QString name = backend == -1 ? QStringLiteral("One at a time") : backend == ThreadPool ? QStringLiteral("Thread pool") : QStringLiteral("io_uring");
+
+        for (const bool cold : { true, false }) {
+            bool dataOnly = false;
+            if (cold) {
+                dataOnly = !dropCaches(paths);
+            }
+
+            QElapsedTimer timer;
+            timer.start();
+            int loaded = 0;
+            qint64 bytes = 0;
+            if (backend == -1) {
+                for (const QString &path : paths) {
+                    QFile file(path);
+                    if (file.open(QIODevice::ReadOnly)) {
+                        bytes += file.readAll().size();
+                        loaded++;
+                    }
+                }
+            } else {
+                SmallFileReader reader;
+                reader.start(paths, Backend(backend));
+                if (reader.backend() != backend) {
+                    name = QStringLiteral("io_uring (unavailable, thread pool)");
+                }
+                for (int i=0; i<paths.count(); i++) {
+                    QByteArray data;
+                    if (reader.take(i, &data)) {
+                        bytes += data.size();
+                        loaded++;
+                    }
+                }
+            }
+            const double seconds = qMax<qint64>(1, timer.elapsed()) / 1000.;
+
+            out << name << (!cold ? ", warm: " : dataOnly ? ", cold data (run as root for cold metadata): " : ", cold: ") << QString::number(loaded / seconds, 'f', 0) << " files/s, "
+                << QString::number(bytes / 1024. / 1024. / seconds, 'f', 1) << " MB/s" << '\n';
+            out.flush();
+        }
+    }
+
+    return true;
+}
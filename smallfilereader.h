@@ -0,0 +1,95 @@
+#ifndef SMALLFILEREADER_H
+#define SMALLFILEREADER_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QStringList>
+#include <QVector>
+#include <QByteArray>
+
+/// Reads whole small files ahead of a batch upload, many at a time, so a
+/// tree of tiny files isn't one open, stat, read and close after another
+/// on the connection's thread. On Linux the opens, statx and reads for
+/// many files go through one io_uring, elsewhere (or if the kernel is too
+/// old or io/uring is off) a few pool threads do them with plain syscalls.
+/// Files bigger than maxFileSize, and ones that fail, are left for the
+/// caller to read the usual way.
+class SmallFileReader
+{
+    Q_DISABLE_COPY(SmallFileReader)
+
+public:
+    enum Backend {
+        Automatic,
+        Uring,
+        ThreadPool
+    };
+
+    static constexpr qint64 maxFileSize = 256 * 1024;
+    static constexpr int minFiles = 16; // not worth it for fewer
+    static constexpr int queueDepth = 64; // files being read at once
+    static constexpr int maxAhead = 1024; // files read but not taken yet
+    static constexpr qint64 maxBuffered = 32 * 1024 * 1024;
+    static constexpr int poolThreads = 8;
+    static constexpr int benchmarkFiles = 100000;
+    static constexpr int benchmarkFileSize = 4096;
+
+    SmallFileReader() = default;
+    ~SmallFileReader();
+
+    // Starts reading the files in order
+    void start(const QStringList &paths, Backend backend = Automatic);
+
+    // Waits for the reads still in flight and throws away the rest
+    void stop();
+
+    bool isActive() const { return !m_paths.isEmpty(); }
+
+    // What start() ended up with
+    Backend backend() const { return m_backend; }
+
+    // Waits until the file at index has been read, false if it has to be read
+    // the usual way. Must be called for every index in order.
+    bool take(int index, QByteArray *data);
+
+    // Reads a directory of small files with each backend, creates it with
+    // benchmarkFiles files if it doesn't exist, and prints files per second
+    static bool runBenchmark(const QString &directory);
+
+private:
+    struct Ring;
+    class UringTask;
+    class ReadTask;
+
+    enum Status : char {
+        Pending,
+        Loaded,
+        NotLoaded
+    };
+
+    bool startUring();
+
+    // Called on the pool. claim() returns the next index to read, or -1. If
+    // waiting for room it only returns -1 when there is nothing left to read.
+    int claim(bool wait);
+    void finished(int index, const QByteArray &data, bool loaded);
+    void readOne(int index);
+    void runUring(Ring *ring);
+
+    QStringList m_paths;
+    Backend m_backend = Automatic;
+    QThreadPool m_pool;
+
+    QMutex m_mutex;
+    QWaitCondition m_resultReady;
+    QWaitCondition m_spaceFree;
+    QVector<Status> m_status;
+    QVector<QByteArray> m_data;
+    int m_nextIndex = 0;
+    int m_taken = 0;
+    qint64 m_buffered = 0;
+    bool m_stopping = false;
+};
+
+#endif // SMALLFILEREADER_H
@@ -0,0 +1,62 @@
+#include "sparsefile.h"
+
+#include <QFile>
+#include <QtEndian>
+
+#ifdef Q_OS_LINUX
+extern "C" {
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+}
+#endif
+
+bool SparseFile::isSparse(QFile *file)
+{
+#ifdef Q_OS_LINUX
+    struct stat info;
+    if (fstat(file->handle(), &info) < 0) {
+        return false;
+    }
+    return qint64(info.st_blocks) * 512 < qint64(info.st_size);
+#else
+    Q_UNUSED(file);
+    return false;
+#endif
+}
+
+void SparseFile::nextExtent(QFile *file, qint64 from, qint64 size, qint64 *start, qint64 *end)
+{
+#ifdef Q_OS_LINUX
+    const int fd = file->handle();
+
+    const off_t data = lseek(fd, from, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO) {
+            // Nothing but hole until the end
+            *start = *end = size;
+        } else {
+            // Filesystem can't tell us, treat the rest as data
+            *start = from;
+            *end = size;
+        }
+        return;
+    }
+
+    const off_t hole = lseek(fd, data, SEEK_HOLE);
+    *start = qMin<qint64>(data, size);
+    *end = hole < 0 ? size : qMin<qint64>(hole, size);
+#else
+    Q_UNUSED(file);
+    *start = from;
+    *end = size;
+#endif
+}
+
+QByteArray SparseFile::recordHeader(RecordType type, qint64 length)
+{
+    QByteArray header(recordHeaderSize, Qt::Uninitialized);
+    header[0] = type;
+    qToBigEndian<qint64>(length, header.data() + 1);
+    return header;
+}
@@ -0,0 +1,32 @@
+#ifndef SPARSEFILE_H
+#define SPARSEFILE_H
+
+#include <QByteArray>
+
+class QFile;
+
+/// Sparse files go over the wire as records instead of a raw stream, so
+/// holes don't cost anything to send or write. Each record is a type
+/// byte and a big endian 64 bit length, data records are followed by
+/// that many bytes, hole records by nothing.
+class SparseFile
+{
+public:
+    enum RecordType : char {
+        Data = 'D',
+        Hole = 'H'
+    };
+
+    static constexpr int recordHeaderSize = 1 + 8;
+
+    // If the file has fewer blocks allocated than its size needs
+    static bool isSparse(QFile *file);
+
+    // The first data extent at or after from, end is where the next hole starts.
+    // Both are size if there is only hole left.
+    static void nextExtent(QFile *file, qint64 from, qint64 size, qint64 *start, qint64 *end);
+
+    static QByteArray recordHeader(RecordType type, qint64 length);
+};
+
+#endif // SPARSEFILE_H
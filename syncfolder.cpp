@@ -0,0 +1,558 @@
+#include "syncfolder.h"
+
+#include "connectionhandler.h"
+#include "transferqueue.h"
+
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QFile>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDateTime>
+#include <QThread>
+#include <QRunnable>
+#include <QDebug>
+
+class SyncFolder::ScanTask : public QRunnable
+{
+public:
+    ScanTask(SyncFolder *folder, const QString &directory, bool forgetMissing) :
+        m_folder(folder), m_directory(directory), m_forgetMissing(forgetMissing) {}
+
+    void run() override {
+        QThread::currentThread()->setPriority(QThread::LowestPriority);
+        m_folder->scan(m_directory, m_forgetMissing);
+    }
+
+private:
+    SyncFolder *m_folder;
+    QString m_directory;
+    bool m_forgetMissing;
+};
+
+class SyncFolder::HashTask : public QRunnable
+{
+public:
+    HashTask(SyncFolder *folder, const FileState &file) : m_folder(folder), m_file(file) {}
+
+    void run() override {
+        QThread::currentThread()->setPriority(QThread::LowestPriority);
+        m_folder->hash(m_file);
+    }
+
+private:
+    SyncFolder *m_folder;
+    FileState m_file;
+};
+
+// What a sync upload is written to on the other side before it is renamed
+static bool isPartialUpload(const QString &name)
+{
+    return name.startsWith('.') && name.endsWith(QLatin1String(".partial"));
+}
+
+SyncFolder::SyncFolder(const QString &path, const QString &remotePath, const QList<QByteArray> &peers,
+                       ConnectionHandler *handler, TransferQueue *queue, QObject *parent) : QObject(parent),
+    m_path(QDir(path).absolutePath()),
+    m_remotePath(remotePath),
+    m_peers(peers),
+    m_handler(handler),
+    m_queue(queue)
+{
+    // One thread walks, the rest hash
+    m_pool.setMaxThreadCount(qBound(2, QThread::idealThreadCount(), 8));
+
+    m_quietTimer.setSingleShot(true);
+    connect(&m_quietTimer, &QTimer::timeout, this, &SyncFolder::processJournal);
+
+    m_retryTimer.setSingleShot(true);
+    m_retryTimer.setInterval(retryInterval);
+    connect(&m_retryTimer, &QTimer::timeout, this, &SyncFolder::push);
+
+    m_saveTimer.setSingleShot(true);
+    m_saveTimer.setInterval(saveDelay);
+    connect(&m_saveTimer, &QTimer::timeout, this, &SyncFolder::saveManifest);
+
+    connect(&m_watcher, &InotifyWatcher::changed, this, &SyncFolder::onChanged);
+    connect(&m_watcher, &InotifyWatcher::overflowed, this, &SyncFolder::onOverflowed);
+    connect(handler, &ConnectionHandler::pingFromHost, this, &SyncFolder::onPing);
+    connect(queue, &TransferQueue::transferFinished, this, &SyncFolder::onTransferFinished);
+
+    loadManifest();
+
+    // Only to find what changed while we weren't running, nothing is hashed that hasn't
+    m_scanning++;
+    m_pool.start(new ScanTask(this, m_path, true));
+}
+
+SyncFolder::~SyncFolder()
+{
+    // The tasks use us
+    m_pool.clear();
+    m_pool.waitForDone();
+
+    if (m_saveTimer.isActive()) {
+        saveManifest();
+    }
+}
+
+QList<SyncFolder*> SyncFolder::loadFromSettings(ConnectionHandler *handler, TransferQueue *queue, QObject *parent)
+{
+    QList<SyncFolder*> folders;
+
+    QSettings settings;
+    const int count = settings.beginReadArray("sync/folders");
+    for (int i=0; i<count; i++) {
+        settings.setArrayIndex(i);
+
+        const QString path = settings.value("path").toString();
+        if (path.isEmpty() || !QFileInfo(path).isDir()) {
+            qWarning() << "Sync folder" << path << "is not a directory, skipping it";
+            continue;
+        }
+
+        QList<QByteArray> peers;
+        for (const QString &peer : settings.value("peers").toStringList()) {
+            peers.append(QByteArray::fromHex(peer.toLatin1()));
+        }
+        if (peers.isEmpty()) {
+            qWarning() << "Sync folder" << path << "has no peers, skipping it";
+            continue;
+        }
+
+        const QString remotePath = settings.value("remote", QFileInfo(path).fileName()).toString();
+        qDebug() << "Syncing" << path << "to" << remotePath << "on" << peers.count() << "hosts";
+        folders.append(new SyncFolder(path, remotePath, peers, handler, queue, parent));
+    }
+    settings.endArray();
+
+    return folders;
+}
+
+void SyncFolder::scan(const QString &directory, bool forgetMissing)
+{
+    // Before reading, so nothing that happens in between is missed
+    m_watcher.addDirectory(directory);
+
+    QVector<FileState> files;
+    QDirIterator it(directory, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        if (info.isSymLink()) {
+            continue;
+        }
+        if (info.isDir()) {
+            m_watcher.addDirectory(info.absoluteFilePath());
+            continue;
+        }
+        if (!info.isFile() || isPartialUpload(info.fileName())) {
+            continue;
+        }
+        const FileState file = { relativePath(info.absolutePath(), info.fileName()), info.size(), info.lastModified().toMSecsSinceEpoch() };
+        files.append(file);
+    }
+
+    QMetaObject::invokeMethod(this, [this, directory, files, forgetMissing]() {
+        onScanned(directory, files, forgetMissing);
+    }, Qt::QueuedConnection);
+}
+
+void SyncFolder::onScanned(const QString &directory, const QVector<FileState> &files, bool forgetMissing)
+{
+    m_scanning--;
+
+    QSet<QString> seen;
+    for (const FileState &file : files) {
+        seen.insert(file.relativePath);
+
+        const Entry entry = m_manifest.value(file.relativePath);
+        if (entry.hash.isEmpty() || entry.size != file.size || entry.modified != file.modified) {
+            journal(file.relativePath);
+        }
+    }
+
+    // Gone while we weren't looking
+    if (forgetMissing) {
+        const QString prefix = directory == m_path ? QString() : relativePath(directory, QString()) + '/';
+        QHash<QString, Entry>::iterator it = m_manifest.begin();
+        while (it != m_manifest.end()) {
+            if (it.key().startsWith(prefix) && !seen.contains(it.key())) {
+                it = m_manifest.erase(it);
+                manifestChanged();
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Whatever the other side doesn't have yet, now that we know what is here
+    if (m_journal.isEmpty()) {
+        push();
+    }
+}
+
+void SyncFolder::hash(const FileState &file)
+{
+    const QString path = m_path + '/' + file.relativePath;
+
+    QByteArray result;
+    QFile input(path);
+    if (input.open(QIODevice::ReadOnly)) {
+        QCryptographicHash hasher(QCryptographicHash::Sha256);
+        QByteArray buffer(1024 * 1024, Qt::Uninitialized);
+        qint64 length;
+        while ((length = input.read(buffer.data(), buffer.size())) > 0) {
+            hasher.addData(buffer.constData(), int(length));
+        }
+        if (length == 0) {
+            result = hasher.result();
+        }
+    } else {
+        qWarning() << "Failed to open" << path << "for hashing" << input.errorString();
+    }
+
+    // Changed while we read it, the hash is of neither version. It is in the journal again.
+    const QFileInfo after(path);
+    if (after.size() != file.size || after.lastModified().toMSecsSinceEpoch() != file.modified) {
+        result.clear();
+    }
+
+    QMetaObject::invokeMethod(this, [this, file, result]() {
+        onHashed(file, result);
+    }, Qt::QueuedConnection);
+}
+
+void SyncFolder::onHashed(const FileState &file, const QByteArray &hash)
+{
+    m_hashing--;
+
+    if (!hash.isEmpty()) {
+        Entry &entry = m_manifest[file.relativePath];
+        if (entry.hash != hash) {
+            qDebug() << "Content changed" << file.relativePath;
+        }
+        entry.size = file.size;
+        entry.modified = file.modified;
+        entry.hash = hash;
+        manifestChanged();
+    }
+
+    if (m_hashing == 0) {
+        push();
+    }
+}
+
+void SyncFolder::onChanged(const QString &directory, const QString &name, InotifyWatcher::Change change, bool isDirectory)
+{
+    if (change == InotifyWatcher::DirectoryGone) {
+        // Its parent tells us what to forget
+        m_watcher.removeDirectory(directory);
+        return;
+    }
+
+    if (isPartialUpload(name)) {
+        return;
+    }
+
+    const QString path = relativePath(directory, name);
+
+    switch (change) {
+    case InotifyWatcher::Deleted:
+    case InotifyWatcher::MovedFrom:
+        forget(path);
+        break;
+    case InotifyWatcher::Created:
+    case InotifyWatcher::MovedTo:
+        if (isDirectory) {
+            // Might have come with files in it already
+            m_scanning++;
+            m_pool.start(new ScanTask(this, directory + '/' + name, false));
+            break;
+        }
+        journal(path);
+        break;
+    case InotifyWatcher::Modified:
+    case InotifyWatcher::Written:
+        if (!isDirectory) {
+            journal(path);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void SyncFolder::onOverflowed()
+{
+    // Missed something, compare everything against the manifest again
+    m_scanning++;
+    m_pool.start(new ScanTask(this, m_path, true));
+}
+
+void SyncFolder::onPing(HostId host, int changes)
+{
+    if (!(changes & HostTable::Returned) || !m_handler) {
+        return;
+    }
+    if (m_peers.contains(m_handler->hosts().fingerprint(host))) {
+        push();
+    }
+}
+
+void SyncFolder::journal(const QString &relativePath)
+{
+    m_journal.insert(relativePath);
+
+    if (!m_journalAge.isValid()) {
+        m_journalAge.start();
+    }
+
+    // Restarted by every change, but never pushed past maxDelay
+    const qint64 left = maxDelay - m_journalAge.elapsed();
+    m_quietTimer.start(int(qBound<qint64>(0, left, quietPeriod)));
+}
+
+void SyncFolder::forget(const QString &relativePath)
+{
+    const QString prefix = relativePath + '/';
+
+    QHash<QString, Entry>::iterator it = m_manifest.begin();
+    while (it != m_manifest.end()) {
+        if (it.key() == relativePath || it.key().startsWith(prefix)) {
+            it = m_manifest.erase(it);
+            manifestChanged();
+        } else {
+            ++it;
+        }
+    }
+
+    QSet<QString>::iterator journaled = m_journal.begin();
+    while (journaled != m_journal.end()) {
+        if (*journaled == relativePath || journaled->startsWith(prefix)) {
+            journaled = m_journal.erase(journaled);
+        } else {
+            ++journaled;
+        }
+    }
+}
+
+void SyncFolder::processJournal()
+{
+    m_journalAge.invalidate();
+
+    for (const QString &path : m_journal) {
+        const QFileInfo info(m_path + '/' + path);
+        if (!info.isFile() || info.isSymLink()) {
+            continue;
+        }
+
+        const FileState file = { path, info.size(), info.lastModified().toMSecsSinceEpoch() };
+
+        // Touched, or written with the same content and timestamp
+        const Entry entry = m_manifest.value(path);
+        if (!entry.hash.isEmpty() && entry.size == file.size && entry.modified == file.modified) {
+            continue;
+        }
+
+        m_hashing++;
+        m_pool.start(new HashTask(this, file));
+    }
+    m_journal.clear();
+
+    if (m_hashing == 0) {
+        push();
+    }
+}
+
+void SyncFolder::push()
+{
+    // Comes again when they are done
+    if (m_hashing > 0 || m_scanning > 0 || !m_handler || !m_queue) {
+        return;
+    }
+
+    const HostTable &hosts = m_handler->hosts();
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    bool waiting = false;
+    for (const QByteArray &peer : m_peers) {
+        Batch batch;
+        batch.peer = peer;
+        QStringList paths;
+        qint64 size = 0;
+
+        for (QHash<QString, Entry>::const_iterator it = m_manifest.constBegin(); it != m_manifest.constEnd(); ++it) {
+            if (it->hash.isEmpty() || it->pushed.value(peer) == it->hash || isInFlight(peer, it.key())) {
+                continue;
+            }
+            if (batch.files.count() >= maxFilesPerBatch) {
+                // The rest go when this batch is done
+                break;
+            }
+            batch.files.insert(it.key(), it->hash);
+            paths.append(m_path + '/' + it.key());
+            size += it->size;
+        }
+
+        if (batch.files.isEmpty()) {
+            continue;
+        }
+
+        // Only to hosts we trust and have heard from lately
+        const HostId host = hosts.find(peer);
+        if (host == InvalidHostId || !hosts.isTrusted(host) || hosts.isExpired(host, now)) {
+            waiting = true;
+            continue;
+        }
+
+        qDebug() << "Pushing" << batch.files.count() << "changed files from" << m_path << "to" << hosts.name(host);
+        const int id = m_queue->enqueueUpload(host, m_remotePath, paths, size, m_path);
+        m_inFlight.insert(id, batch);
+    }
+
+    if (waiting && !m_retryTimer.isActive()) {
+        m_retryTimer.start();
+    }
+}
+
+void SyncFolder::onTransferFinished(int id, bool completed)
+{
+    if (!m_inFlight.contains(id)) {
+        return;
+    }
+    const Batch batch = m_inFlight.take(id);
+
+    if (!completed) {
+        qWarning() << "Pushing" << batch.files.count() << "files from" << m_path << "failed, trying again later";
+        if (!m_retryTimer.isActive()) {
+            m_retryTimer.start();
+        }
+        return;
+    }
+
+    for (QHash<QString, QByteArray>::const_iterator it = batch.files.constBegin(); it != batch.files.constEnd(); ++it) {
+        QHash<QString, Entry>::iterator entry = m_manifest.find(it.key());
+        if (entry != m_manifest.end()) {
+            entry->pushed[batch.peer] = it.value();
+        }
+    }
+    manifestChanged();
+
+    // Anything that changed while it was being sent, or didn't fit in the batch
+    push();
+}
+
+bool SyncFolder::isInFlight(const QByteArray &peer, const QString &relativePath) const
+{
+    for (const Batch &batch : m_inFlight) {
+        if (batch.peer == peer && batch.files.contains(relativePath)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QString SyncFolder::relativePath(const QString &directory, const QString &name) const
+{
+    QString path = directory.mid(m_path.length() + 1);
+    if (!name.isEmpty()) {
+        if (!path.isEmpty()) {
+            path += '/';
+        }
+        path += name;
+    }
+    return path;
+}
+
+QString SyncFolder::manifestPath() const
+{
+    const QByteArray key = QCryptographicHash::hash((m_path + '\n' + m_remotePath).toUtf8(), QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/sync/" + QString::fromLatin1(key) + ".json";
+}
+
+void SyncFolder::loadManifest()
+{
+    QFile file(manifestPath());
+    if (!file.open(QIODevice::ReadOnly)) {
+        // First time, everything gets hashed
+        return;
+    }
+
+    QJsonParseError parseError;
+    const QJsonObject manifest = QJsonDocument::fromJson(file.readAll(), &parseError).object();
+    if (parseError.error != QJsonParseError::NoError) {
+        qWarning() << "Failed to parse sync manifest" << file.fileName() << parseError.errorString();
+        return;
+    }
+
+    const QJsonObject files = manifest["files"].toObject();
+    for (QJsonObject::const_iterator it = files.constBegin(); it != files.constEnd(); ++it) {
+        const QJsonObject object = it.value().toObject();
+
+        Entry entry;
+        entry.size = qint64(object["size"].toDouble(-1));
+        entry.modified = qint64(object["modified"].toDouble());
+        entry.hash = QByteArray::fromHex(object["hash"].toString().toLatin1());
+
+        const QJsonObject pushed = object["pushed"].toObject();
+        for (QJsonObject::const_iterator peer = pushed.constBegin(); peer != pushed.constEnd(); ++peer) {
+            entry.pushed.insert(QByteArray::fromHex(peer.key().toLatin1()), QByteArray::fromHex(peer.value().toString().toLatin1()));
+        }
+
+        m_manifest.insert(it.key(), entry);
+    }
+
+    qDebug() << "Loaded sync manifest for" << m_path << "with" << m_manifest.count() << "files";
+}
+
+void SyncFolder::manifestChanged()
+{
+    if (!m_saveTimer.isActive()) {
+        m_saveTimer.start();
+    }
+}
+
+void SyncFolder::saveManifest()
+{
+    m_saveTimer.stop();
+
+    QJsonObject files;
+    for (QHash<QString, Entry>::const_iterator it = m_manifest.constBegin(); it != m_manifest.constEnd(); ++it) {
+        QJsonObject object;
+        object["size"] = it->size;
+        object["modified"] = it->modified;
+        object["hash"] = QString::fromLatin1(it->hash.toHex());
+
+        QJsonObject pushed;
+        for (QHash<QByteArray, QByteArray>::const_iterator peer = it->pushed.constBegin(); peer != it->pushed.constEnd(); ++peer) {
+            pushed[QString::fromLatin1(peer.key().toHex())] = QString::fromLatin1(peer.value().toHex());
+        }
+        object["pushed"] = pushed;
+
+        files[it.key()] = object;
+    }
+
+    QJsonObject manifest;
+    manifest["path"] = m_path;
+    manifest["remote"] = m_remotePath;
+    manifest["files"] = files;
+
+    const QString path = manifestPath();
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    // Never half written, a broken manifest means hashing everything again
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to open" << path << "for writing" << file.errorString();
+        return;
+    }
+    file.write(QJsonDocument(manifest).toJson(QJsonDocument::Compact));
+    if (!file.commit()) {
+        qWarning() << "Failed to save sync manifest" << path << file.errorString();
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef SYNCFOLDER_H
+#define SYNCFOLDER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QThreadPool>
+
+#include "hosttable.h"
+#include "inotifywatcher.h"
+
+class ConnectionHandler;
+class TransferQueue;
+
+/// Keeps a local folder pushed to a few trusted hosts. inotify feeds a
+/// journal of paths that might have changed. Once things have been quiet
+/// for a moment they are hashed on a thread pool, and only files whose
+/// content really changed are sent to peers that don't have it yet.
+/// What was hashed and sent is kept in a manifest, so starting up again
+/// only hashes files whose size or modification time differ. Deleting
+/// files here doesn't delete them on the other side.
+class SyncFolder : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int quietPeriod = 1000; // ms without changes before a batch goes out
+    static constexpr int maxDelay = 10000; // ms, a steady trickle of changes still goes out this often
+    static constexpr int retryInterval = 60000; // ms between tries to reach peers that were away
+    static constexpr int saveDelay = 5000; // ms, manifest writes are collected for this long
+    static constexpr int maxFilesPerBatch = 1000;
+
+    // peers are certificate fingerprints, remotePath is relative to their home
+    SyncFolder(const QString &path, const QString &remotePath, const QList<QByteArray> &peers,
+               ConnectionHandler *handler, TransferQueue *queue, QObject *parent);
+    ~SyncFolder();
+
+    // One for each entry in the sync/folders settings array
+    static QList<SyncFolder*> loadFromSettings(ConnectionHandler *handler, TransferQueue *queue, QObject *parent);
+
+private slots:
+    void onChanged(const QString &directory, const QString &name, InotifyWatcher::Change change, bool isDirectory);
+    void onOverflowed();
+    void onPing(HostId host, int changes);
+    void onTransferFinished(int id, bool completed);
+    void processJournal();
+    void push();
+    void saveManifest();
+
+private:
+    class ScanTask;
+    class HashTask;
+
+    struct Entry {
+        qint64 size = -1;
+        qint64 modified = 0; // msecs since epoch
+        QByteArray hash;
+        QHash<QByteArray, QByteArray> pushed; // peer fingerprint -> hash it has
+    };
+
+    struct FileState {
+        QString relativePath;
+        qint64 size;
+        qint64 modified;
+    };
+
+    struct Batch {
+        QByteArray peer;
+        QHash<QString, QByteArray> files; // relative path -> hash being sent
+    };
+
+    // Called on the pool
+    void scan(const QString &directory, bool forgetMissing);
+    void hash(const FileState &file);
+
+    // Back on our thread
+    void onScanned(const QString &directory, const QVector<FileState> &files, bool forgetMissing);
+    void onHashed(const FileState &file, const QByteArray &hash);
+
+    void journal(const QString &relativePath);
+    void forget(const QString &relativePath);
+    QString relativePath(const QString &directory, const QString &name) const;
+    bool isInFlight(const QByteArray &peer, const QString &relativePath) const;
+    void loadManifest();
+    void manifestChanged();
+    QString manifestPath() const;
+
+    QString m_path;
+    QString m_remotePath;
+    QList<QByteArray> m_peers;
+    QPointer<ConnectionHandler> m_handler;
+    QPointer<TransferQueue> m_queue;
+
+    InotifyWatcher m_watcher;
+    QThreadPool m_pool;
+
+    QHash<QString, Entry> m_manifest; // relative path -> what we know
+    QSet<QString> m_journal; // relative paths that might have changed
+    int m_hashing = 0;
+    int m_scanning = 0;
+
+    QTimer m_quietTimer;
+    QElapsedTimer m_journalAge;
+    QTimer m_retryTimer;
+    QTimer m_saveTimer;
+
+    QHash<int, Batch> m_inFlight; // queue request id -> what it carries
+};
+
+#endif // SYNCFOLDER_H
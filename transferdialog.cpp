@@ -1,51 +1,97 @@
 #include "transferdialog.h"
 
 #include "connection.h"
+#include "transferprogress.h"
 
 #include <QLabel>
 #include <QProgressBar>
 #include <QVBoxLayout>
 #include <QSslSocket>
 #include <QPushButton>
+#include <QLocale>
 
-TransferDialog::TransferDialog(QWidget *parent, Connection *transfer, qint64 totalSize) : QDialog(parent)
+TransferDialog::TransferDialog(QWidget *parent, Connection *transfer, const QSharedPointer<TransferCounter> &counter, TransferProgress *progress) : QDialog(parent)
 {
     setAttribute(Qt::WA_DeleteOnClose);
 
     m_progressBar = new QProgressBar;
-    m_progressBar->setMaximum(totalSize / 1024);
+    // Permille, QProgressBar is int and big files don't fit in that
+    m_progressBar->setMaximum(1000);
 
     m_progressLabel = new QLabel;
+    m_statsLabel = new QLabel;
+    m_statsLabel->hide();
 
     QPushButton *cancelButton = new QPushButton("Cancel");
 
     setLayout(new QVBoxLayout);
     layout()->addWidget(m_progressBar);
     layout()->addWidget(m_progressLabel);
+    layout()->addWidget(m_statsLabel);
     layout()->addWidget(cancelButton);
 
-    connect(transfer, &Connection::destroyed, this, &TransferDialog::close);
-    connect(transfer, &Connection::bytesTransferred, this, &TransferDialog::onBytesTransferred);
-    connect(transfer->socket(), &QSslSocket::disconnected, this, &TransferDialog::close);
+    connect(progress, &TransferProgress::updated, this, &TransferDialog::onProgressUpdated);
     connect(cancelButton, &QPushButton::clicked, this, &TransferDialog::onCancel);
+    setTransfer(transfer, counter);
 
     show();
 }
 
-void TransferDialog::onBytesTransferred(qint64 bytes)
+void TransferDialog::setTransfer(Connection *transfer, const QSharedPointer<TransferCounter> &counter)
 {
-    bytes /= 1024;
-    m_progressBar->setValue(m_progressBar->value() + bytes);
+    m_connection = transfer;
+    m_counter = counter;
 
-    m_progressLabel->setText(QString("%1 kb / %2 kb").arg(m_progressBar->value(), m_progressBar->maximum()));
+    // Closed by whoever owns us when the transfer is done for good, not when a busy attempt ends
+    connect(transfer, &Connection::fileStarted, this, &TransferDialog::onFileStarted);
+    connect(transfer, &Connection::sendStatsChanged, this, &TransferDialog::onSendStatsChanged);
+    connect(transfer, &Connection::busy, this, &TransferDialog::onBusy);
+}
+
+void TransferDialog::onBusy(int retryAfter)
+{
+    m_progressLabel->setText(tr("The other side is busy, trying again in %1 s").arg((retryAfter + 999) / 1000));
+}
+
+void TransferDialog::onProgressUpdated()
+{
+    const qint64 transferred = m_counter->transferred.loadRelaxed();
+    if (m_counter->total > 0) {
+        m_progressBar->setValue(int(qMin<qint64>(1000, transferred * 1000 / m_counter->total)));
+    }
+
+    const QLocale locale;
+    m_progressLabel->setText(QString("%1 / %2, %3/s, %4 left")
+                             .arg(locale.formattedDataSize(transferred))
+                             .arg(locale.formattedDataSize(m_counter->total))
+                             .arg(locale.formattedDataSize(qint64(m_counter->rate)))
+                             .arg(TransferProgress::formatEta(m_counter->eta)));
+}
+
+void TransferDialog::onFileStarted(const QString &name, int index, int count)
+{
+    setWindowTitle(tr("Uploading %1 (%2 of %3)").arg(name).arg(index + 1).arg(count));
 }
 
 void TransferDialog::onCancel()
 {
+    // It might be waiting in the queue to try again, not running
+    emit cancelRequested();
+
     if (!m_connection) {
-        close();
         return;
     }
 
-    m_connection->socket()->close();
+    // Lives on a worker thread
+    QMetaObject::invokeMethod(m_connection, &Connection::cancel, Qt::QueuedConnection);
+}
+
+void TransferDialog::onSendStatsChanged(qint64 chunkSize, qint64 sendBufferSize, int rtt, qint64 drainRate)
+{
+    m_statsLabel->setText(QString("chunk %1 kb, send buffer %2 kb, rtt %3 ms, %4 MB/s")
+                          .arg(chunkSize / 1024)
+                          .arg(sendBufferSize / 1024)
+                          .arg(rtt / 1000., 0, 'f', 1)
+                          .arg(drainRate / 1024. / 1024., 0, 'f', 1));
+    m_statsLabel->show();
 }
@@ -3,25 +3,40 @@
 
 #include <QDialog>
 #include <QPointer>
+#include <QSharedPointer>
 
 class Connection;
 class QProgressBar;
 class QLabel;
+class TransferProgress;
+struct TransferCounter;
 
 class TransferDialog : public QDialog
 {
     Q_OBJECT
 public:
-    explicit TransferDialog(QWidget *parent, Connection *transfer, qint64 totalSize);
+    explicit TransferDialog(QWidget *parent, Connection *transfer, const QSharedPointer<TransferCounter> &counter, TransferProgress *progress);
+
+    // The same transfer again, after the other side was busy
+    void setTransfer(Connection *transfer, const QSharedPointer<TransferCounter> &counter);
+
+signals:
+    // Whoever queued it takes it out and closes us
+    void cancelRequested();
 
 private slots:
-    void onBytesTransferred(qint64 bytes);
+    void onBusy(int retryAfter);
+    void onProgressUpdated();
+    void onFileStarted(const QString &name, int index, int count);
+    void onSendStatsChanged(qint64 chunkSize, qint64 sendBufferSize, int rtt, qint64 drainRate);
     void onCancel();
 
 private:
     QPointer<QProgressBar> m_progressBar;
     QLabel *m_progressLabel;
-    Connection *m_connection;
+    QLabel *m_statsLabel;
+    QPointer<Connection> m_connection;
+    QSharedPointer<TransferCounter> m_counter;
 };
 
 #endif // TRANSFERDIALOG_H
@@ -0,0 +1,70 @@
+#include "transferprogress.h"
+
+TransferProgress::TransferProgress(QObject *parent) : QObject(parent)
+{
+    m_timer.setInterval(sampleInterval);
+    connect(&m_timer, &QTimer::timeout, this, &TransferProgress::sample);
+}
+
+QSharedPointer<TransferCounter> TransferProgress::track(qint64 totalSize)
+{
+    QSharedPointer<TransferCounter> counter(new TransferCounter);
+    counter->total = totalSize;
+    m_counters.append(counter);
+
+    if (!m_timer.isActive()) {
+        m_timer.start();
+    }
+
+    return counter;
+}
+
+void TransferProgress::sample()
+{
+    const double seconds = sampleInterval / 1000.;
+
+    double totalRate = 0;
+    qint64 totalRemaining = 0;
+
+    for (int i=0; i<m_counters.count();) {
+        TransferCounter &counter = *m_counters[i];
+
+        const qint64 transferred = counter.transferred.loadRelaxed();
+        const double rate = (transferred - counter.lastSample) / seconds;
+        counter.lastSample = transferred;
+        counter.rate = counter.rate > 0 ? counter.rate + smoothing * (rate - counter.rate) : rate;
+
+        const qint64 remaining = qMax<qint64>(0, counter.total - transferred);
+        counter.eta = counter.rate > 1 ? qint64(remaining / counter.rate) : -1;
+
+        // Sampled one last time above, the dialog holds its own reference if it needs more
+        if (counter.finished.loadAcquire()) {
+            m_counters.remove(i);
+            continue;
+        }
+
+        totalRate += counter.rate;
+        totalRemaining += remaining;
+        i++;
+    }
+
+    m_rate = totalRate;
+    m_eta = m_rate > 1 ? qint64(totalRemaining / m_rate) : -1;
+
+    emit updated();
+
+    if (m_counters.isEmpty()) {
+        m_timer.stop();
+    }
+}
+
+QString TransferProgress::formatEta(qint64 seconds)
+{
+    if (seconds < 0) {
+        return QStringLiteral("?");
+    }
+    if (seconds >= 3600) {
+        return QString("%1:%2:%3").arg(seconds / 3600).arg(seconds / 60 % 60, 2, 10, QChar('0')).arg(seconds % 60, 2, 10, QChar('0'));
+    }
+    return QString("%1:%2").arg(seconds / 60).arg(seconds % 60, 2, 10, QChar('0'));
+}
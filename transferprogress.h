@@ -0,0 +1,60 @@
+#ifndef TRANSFERPROGRESS_H
+#define TRANSFERPROGRESS_H
+
+#include <QObject>
+#include <QTimer>
+#include <QSharedPointer>
+#include <QAtomicInteger>
+#include <QVector>
+
+/// Bytes moved by one transfer. The connection bumps the counters from
+/// its worker thread, the rest is only touched on the UI thread.
+struct TransferCounter
+{
+    QAtomicInteger<qint64> transferred = 0;
+    QAtomicInt finished = 0;
+    qint64 total = 0;
+
+    qint64 lastSample = 0;
+    double rate = 0; // bytes per second, smoothed
+    qint64 eta = -1; // seconds, -1 if unknown
+
+    void add(qint64 bytes) { transferred.fetchAndAddRelaxed(bytes); }
+};
+
+/// Looks at all running transfers at a fixed rate, instead of updating
+/// the UI for every chunk that goes through a socket, and keeps smoothed
+/// throughput and time left for each and for all of them together.
+class TransferProgress : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int sampleInterval = 250; // ms
+    static constexpr double smoothing = 0.2; // weight of the newest sample
+
+    explicit TransferProgress(QObject *parent = nullptr);
+
+    QSharedPointer<TransferCounter> track(qint64 totalSize);
+
+    int activeCount() const { return m_counters.count(); }
+    double rate() const { return m_rate; }
+    qint64 eta() const { return m_eta; }
+
+    static QString formatEta(qint64 seconds);
+
+signals:
+    void updated();
+
+private slots:
+    void sample();
+
+private:
+    QVector<QSharedPointer<TransferCounter>> m_counters;
+    QTimer m_timer;
+
+    double m_rate = 0;
+    qint64 m_eta = -1;
+};
+
+#endif // TRANSFERPROGRESS_H
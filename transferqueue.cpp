@@ -0,0 +1,225 @@
+#include "transferqueue.h"
+
+#include "connection.h"
+#include "connectionhandler.h"
+
+#include <QSettings>
+#include <QDateTime>
+#include <QDebug>
+
+#include <algorithm>
+
+TransferQueue::TransferQueue(ConnectionHandler *handler, QObject *parent) : QObject(parent),
+    m_handler(handler)
+{
+    QSettings settings;
+    m_maxActive = qMax(1, settings.value("queue/global", 4).toInt());
+    m_maxActivePerHost = qMax(1, settings.value("queue/perhost", 2).toInt());
+    m_order = settings.value("queue/order", "fifo").toString() == "priority" ? Priority : Fifo;
+
+    m_retryTimer.setSingleShot(true);
+    connect(&m_retryTimer, &QTimer::timeout, this, &TransferQueue::pump);
+
+    // Their ids are about to be someone else's, don't send anything there
+    connect(handler, &ConnectionHandler::hostsEvicted, this, [this](const QVector<HostId> &ids) {
+        bool changed = false;
+        for (int i=m_pending.count() - 1; i>=0; i--) {
+            if (ids.contains(m_pending[i].host)) {
+                const int id = m_pending.takeAt(i).id;
+                emit transferFinished(id, false);
+                changed = true;
+            }
+        }
+        if (changed) {
+            emit queueChanged();
+        }
+    });
+}
+
+int TransferQueue::enqueueDownload(HostId host, const QString &remotePath, const QString &localPath, qint64 size, int priority)
+{
+    Request request;
+    request.host = host;
+    request.remotePath = remotePath;
+    request.localPath = localPath;
+    request.size = size;
+    request.priority = priority;
+    return enqueue(request);
+}
+
+int TransferQueue::enqueueUpload(HostId host, const QString &remoteDirectory, const QStringList &localPaths, qint64 size, const QString &syncRoot)
+{
+    Request request;
+    request.host = host;
+    request.remotePath = remoteDirectory;
+    request.uploadPaths = localPaths;
+    request.syncRoot = syncRoot;
+    request.size = size;
+    return enqueue(request);
+}
+
+int TransferQueue::enqueue(Request request)
+{
+    request.id = m_nextId++;
+    m_pending.append(request);
+
+    emit queueChanged();
+
+    QMetaObject::invokeMethod(this, &TransferQueue::pump, Qt::QueuedConnection);
+
+    return request.id;
+}
+
+bool TransferQueue::canStart(HostId host) const
+{
+    return m_active < m_maxActive && m_activePerHost.value(host) < m_maxActivePerHost;
+}
+
+void TransferQueue::pump()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    bool changed = false;
+    while (m_active < m_maxActive) {
+        int next = -1;
+        for (int i=0; i<m_pending.count(); i++) {
+            const Request &request = m_pending[i];
+            if (request.notBefore > now || !canStart(request.host)) {
+                continue;
+            }
+            if (next == -1) {
+                next = i;
+                if (m_order == Fifo) {
+                    break;
+                }
+                continue;
+            }
+            if (request.priority > m_pending[next].priority) {
+                next = i;
+            }
+        }
+
+        if (next == -1) {
+            break;
+        }
+
+        start(m_pending.takeAt(next));
+        changed = true;
+    }
+
+    // Come back when the first one that is waiting for a retry can go
+    qint64 nextRetry = 0;
+    for (const Request &request : m_pending) {
+        if (request.notBefore > now && (nextRetry == 0 || request.notBefore < nextRetry)) {
+            nextRetry = request.notBefore;
+        }
+    }
+    if (nextRetry > 0) {
+        m_retryTimer.start(int(nextRetry - now));
+    }
+
+    if (changed) {
+        emit queueChanged();
+    }
+}
+
+void TransferQueue::start(const Request &request)
+{
+    if (!m_handler) {
+        return;
+    }
+
+    qDebug() << "Starting transfer" << request.id << request.remotePath;
+
+    m_active++;
+    m_activePerHost[request.host]++;
+
+    Connection *connection = new Connection(m_handler);
+
+    // Both come from the worker thread, busy always before destroyed
+    connect(connection, &Connection::busy, this, [this, request](int retryAfter) {
+        onBusy(request, retryAfter);
+    });
+    connect(connection, &Connection::uploadCompleted, this, [this, request]() {
+        m_completed.insert(request.id);
+    });
+    connect(connection, &Connection::destroyed, this, [this, request]() {
+        onFinished(request);
+    });
+
+    emit transferStarted(connection, request);
+
+    // Keep the file and crypto work off the GUI thread
+    m_handler->moveToWorker(connection);
+
+    QMetaObject::invokeMethod(connection, [connection, request]() {
+        if (request.uploadPaths.isEmpty()) {
+            connection->download(request.host, request.remotePath, request.localPath, request.size);
+        } else {
+            connection->upload(request.host, request.remotePath, request.uploadPaths, request.syncRoot);
+        }
+    }, Qt::QueuedConnection);
+}
+
+void TransferQueue::cancel(int id)
+{
+    for (int i=0; i<m_pending.count(); i++) {
+        if (m_pending[i].id == id) {
+            m_pending.removeAt(i);
+            emit queueChanged();
+            emit transferFinished(id, false);
+            return;
+        }
+    }
+
+    // Running, so it isn't put back if the other side says it is busy
+    m_cancelled.insert(id);
+}
+
+void TransferQueue::onBusy(Request request, int retryAfter)
+{
+    if (m_cancelled.contains(request.id)) {
+        return;
+    }
+
+    request.attempts++;
+    if (request.attempts >= maxAttempts) {
+        qWarning() << "Giving up on" << request.remotePath << "after" << request.attempts << "busy replies";
+        return;
+    }
+
+    request.notBefore = QDateTime::currentMSecsSinceEpoch() + retryAfter;
+
+    // It was first in line, keep it there
+    m_pending.prepend(request);
+
+    emit queueChanged();
+}
+
+void TransferQueue::onFinished(const Request &request)
+{
+    m_active--;
+
+    const int forHost = m_activePerHost.value(request.host) - 1;
+    if (forHost > 0) {
+        m_activePerHost[request.host] = forHost;
+    } else {
+        m_activePerHost.remove(request.host);
+    }
+
+    if (!request.uploadPaths.isEmpty()) {
+        emit uploadFinished(request.host, request.remotePath);
+    }
+
+    // Busy ones are back in the queue under the same id
+    m_cancelled.remove(request.id);
+    const bool completed = m_completed.remove(request.id);
+    const bool requeued = std::any_of(m_pending.cbegin(), m_pending.cend(), [&request](const Request &pending) {
+        return pending.id == request.id;
+    });
+    if (!requeued) {
+        emit transferFinished(request.id, completed);
+    }
+
+    pump();
+}
@@ -0,0 +1,89 @@
+#ifndef TRANSFERQUEUE_H
+#define TRANSFERQUEUE_H
+
+#include <QObject>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QPointer>
+#include <QStringList>
+
+#include "hosttable.h"
+
+class Connection;
+class ConnectionHandler;
+
+/// Transfers we want to do, started when there is room for them.
+/// Limits how many run at once in total and per host, and puts
+/// transfers the other side was too busy for back in the queue.
+class TransferQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int maxAttempts = 20; // busy replies before we give up on a transfer
+
+    enum Order {
+        Fifo,
+        Priority
+    };
+
+    struct Request {
+        int id = -1;
+        HostId host = InvalidHostId;
+        QString remotePath;
+        QString localPath;
+        QStringList uploadPaths; // set for uploads, remotePath is then the target directory
+        QString syncRoot; // uploads from a sync folder, names are sent relative to this
+        qint64 size = 0;
+        int priority = 0; // higher goes first, if ordering by priority
+        qint64 notBefore = 0; // msecs since epoch
+        int attempts = 0;
+    };
+
+    TransferQueue(ConnectionHandler *handler, QObject *parent);
+
+    int enqueueDownload(HostId host, const QString &remotePath, const QString &localPath, qint64 size, int priority = 0);
+    int enqueueUpload(HostId host, const QString &remoteDirectory, const QStringList &localPaths, qint64 size, const QString &syncRoot = QString());
+
+    // Drops it from the queue, or keeps it from coming back if it is running
+    void cancel(int id);
+
+    const QList<Request> &pending() const { return m_pending; }
+    int activeCount() const { return m_active; }
+
+signals:
+    void transferStarted(Connection *connection, const TransferQueue::Request &request);
+    void queueChanged();
+    void uploadFinished(HostId host, const QString &remoteDirectory);
+
+    // Done for good, not put back in the queue. Completed if everything was sent.
+    void transferFinished(int id, bool completed);
+
+private slots:
+    void pump();
+
+private:
+    bool canStart(HostId host) const;
+    void start(const Request &request);
+    void onBusy(Request request, int retryAfter);
+    void onFinished(const Request &request);
+    int enqueue(Request request);
+
+    QPointer<ConnectionHandler> m_handler;
+
+    QList<Request> m_pending;
+    QHash<HostId, int> m_activePerHost;
+    QSet<int> m_completed;
+    QSet<int> m_cancelled; // running, not to be retried
+    int m_active = 0;
+    int m_nextId = 0;
+
+    int m_maxActive = 4;
+    int m_maxActivePerHost = 2;
+    Order m_order = Fifo;
+
+    QTimer m_retryTimer;
+};
+
+#endif // TRANSFERQUEUE_H
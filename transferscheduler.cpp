@@ -0,0 +1,170 @@
+#include "transferscheduler.h"
+
+#include <QDebug>
+
+void TransferScheduler::Bucket::refill(qint64 now)
+{
+    if (rate > 0) {
+        tokens = qMin(double(burst()), tokens + rate * (now - lastRefill) / 1000.);
+    }
+    lastRefill = now;
+}
+
+int TransferScheduler::Bucket::delayFor(qint64 bytes) const
+{
+    if (rate <= 0) {
+        return 0;
+    }
+    const double missing = bytes - tokens;
+    return qBound(5, int(missing * 1000 / rate), 1000);
+}
+
+TransferScheduler::TransferScheduler()
+{
+    m_clock.start();
+}
+
+void TransferScheduler::setGlobalRate(qint64 rate)
+{
+    QMutexLocker locker(&m_mutex);
+    m_global.rate = rate;
+    m_global.tokens = m_global.burst();
+    m_global.lastRefill = m_clock.elapsed();
+}
+
+void TransferScheduler::setPerHostRate(qint64 rate)
+{
+    QMutexLocker locker(&m_mutex);
+    m_perHostRate = rate;
+    m_hostBuckets.clear();
+}
+
+int TransferScheduler::registerFlow(HostId host, Priority priority, int weight)
+{
+    QMutexLocker locker(&m_mutex);
+
+    Flow flow;
+    flow.host = host;
+    flow.priority = priority;
+    flow.weight = qMax(1, weight);
+
+    const int id = m_nextFlow++;
+    m_flows.insert(id, flow);
+    return id;
+}
+
+void TransferScheduler::unregisterFlow(int flow)
+{
+    QMutexLocker locker(&m_mutex);
+    m_flows.remove(flow);
+}
+
+void TransferScheduler::forgetHost(HostId host)
+{
+    QMutexLocker locker(&m_mutex);
+    m_hostBuckets.remove(host);
+}
+
+TransferScheduler::Bucket &TransferScheduler::hostBucket(HostId host, qint64 now)
+{
+    QHash<HostId, Bucket>::iterator it = m_hostBuckets.find(host);
+    if (it == m_hostBuckets.end()) {
+        Bucket bucket;
+        bucket.rate = m_perHostRate;
+        bucket.tokens = bucket.burst();
+        bucket.lastRefill = now;
+        it = m_hostBuckets.insert(host, bucket);
+    }
+    it->refill(now);
+    return *it;
+}
+
+int TransferScheduler::activeBulkWeight(qint64 now) const
+{
+    int weight = 0;
+    for (const Flow &flow : m_flows) {
+        if (flow.priority == Bulk && now - flow.lastActive < activeWindow) {
+            weight += flow.weight;
+        }
+    }
+    return weight;
+}
+
+qint64 TransferScheduler::request(int flowId, qint64 wanted, int *retryDelay)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (retryDelay) {
+        *retryDelay = 0;
+    }
+
+    QHash<int, Flow>::iterator flowIt = m_flows.find(flowId);
+    if (flowIt == m_flows.end()) {
+        qWarning() << "Unknown flow" << flowId;
+        return wanted;
+    }
+    Flow &flow = *flowIt;
+
+    const qint64 now = m_clock.elapsed();
+    m_global.refill(now);
+    Bucket &host = hostBucket(flow.host, now);
+
+    // Higher priorities always get through, but go into debt so bulk has to wait for them
+    if (flow.priority != Bulk) {
+        m_lastPriorityTraffic = now;
+
+        qint64 granted = wanted;
+        if (flow.priority == Interactive) {
+            m_lastInteractiveTraffic = now;
+        } else if (now - m_lastInteractiveTraffic < busyWindow) {
+            // Yields to someone moving the mouse or seeking, but never stalls
+            granted = qMin(wanted, listingGrant);
+        }
+
+        if (m_global.rate > 0) {
+            m_global.tokens -= granted;
+        }
+        if (host.rate > 0) {
+            host.tokens -= granted;
+        }
+        return granted;
+    }
+
+    flow.lastActive = now;
+
+    qint64 granted = qMin(wanted, bulkQuantum * flow.weight);
+
+    // Keep socket buffers short while someone is waiting for a listing or moving the mouse
+    if (now - m_lastPriorityTraffic < busyWindow) {
+        granted = qMin(granted, busyGrant);
+    }
+
+    if (m_global.rate > 0 || host.rate > 0) {
+        double available = m_global.rate > 0 ? m_global.tokens : host.tokens;
+        if (host.rate > 0) {
+            available = qMin(available, host.tokens);
+        }
+
+        if (available < qMin(granted, minimumGrant)) {
+            if (retryDelay) {
+                *retryDelay = qMax(m_global.delayFor(minimumGrant), host.delayFor(minimumGrant));
+            }
+            return 0;
+        }
+
+        // Weighted share of what is in the bucket right now
+        const int totalWeight = qMax(flow.weight, activeBulkWeight(now));
+        const qint64 share = qint64(available * flow.weight / totalWeight);
+        granted = qMin(granted, qMax(share, minimumGrant));
+        granted = qMin(granted, qint64(available));
+
+        if (m_global.rate > 0) {
+            m_global.tokens -= granted;
+        }
+        if (host.rate > 0) {
+            host.tokens -= granted;
+        }
+    }
+
+    return granted;
+}
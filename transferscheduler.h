@@ -0,0 +1,82 @@
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include <QMutex>
+#include <QHash>
+#include <QElapsedTimer>
+
+#include "hosttable.h"
+
+/// Decides how much each connection is allowed to write to its socket.
+/// Token buckets for a global and a per host rate cap. Interactive traffic
+/// always goes first, listings come next and get a small share while it
+/// flows, and bulk transfers split what is left by weight. Called from the
+/// connection worker threads.
+class TransferScheduler
+{
+public:
+    enum Priority {
+        Interactive,
+        Listing,
+        Bulk
+    };
+
+    static constexpr qint64 bulkQuantum = 1024 * 1024; // bytes per weight per grant
+    static constexpr qint64 minimumGrant = 16 * 1024;
+    static constexpr qint64 busyGrant = 64 * 1024; // max bulk grant while higher priority traffic is flowing
+    static constexpr qint64 listingGrant = 16 * 1024; // what a listing still gets per grant while interactive traffic is flowing
+    static constexpr int busyWindow = 100; // ms
+    static constexpr int activeWindow = 1000; // ms, how long a bulk flow counts as competing
+
+    TransferScheduler();
+
+    // Bytes per second, 0 for no limit
+    void setGlobalRate(qint64 rate);
+    void setPerHostRate(qint64 rate);
+
+    int registerFlow(HostId host, Priority priority, int weight = 1);
+    void unregisterFlow(int flow);
+
+    // The id is about to be reused for another host
+    void forgetHost(HostId host);
+
+    // Returns how many of the wanted bytes can be written now.
+    // If nothing, retryDelay is set to how many ms to wait before asking again.
+    qint64 request(int flow, qint64 wanted, int *retryDelay = nullptr);
+
+private:
+    struct Bucket {
+        qint64 rate = 0;
+        double tokens = 0;
+        qint64 lastRefill = 0;
+
+        void refill(qint64 now);
+        qint64 burst() const { return qMax<qint64>(rate / 4, 64 * 1024); }
+        int delayFor(qint64 bytes) const;
+    };
+
+    struct Flow {
+        HostId host = InvalidHostId;
+        Priority priority = Bulk;
+        int weight = 1;
+        qint64 lastActive = -activeWindow;
+    };
+
+    Bucket &hostBucket(HostId host, qint64 now);
+    int activeBulkWeight(qint64 now) const;
+
+    QMutex m_mutex;
+    QElapsedTimer m_clock;
+
+    Bucket m_global;
+    qint64 m_perHostRate = 0;
+    QHash<HostId, Bucket> m_hostBuckets;
+
+    QHash<int, Flow> m_flows;
+    int m_nextFlow = 0;
+
+    qint64 m_lastPriorityTraffic = -busyWindow;
+    qint64 m_lastInteractiveTraffic = -busyWindow;
+};
+
+#endif // TRANSFERSCHEDULER_H